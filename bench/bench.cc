@@ -0,0 +1,328 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "bench.hh"
+#include "benchutils_inl.hh"
+#include "corpus.hh"
+
+#include <argp.h>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <sstream>
+
+using namespace zipprof;
+using namespace zipprof::bench;
+
+// Allocations are counted globally; runs are single threaded so the count
+// during a run belongs to that run.
+static std::atomic<uint64_t> allocation_count(0);
+
+void *operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  void *result = malloc(size == 0 ? 1 : size);
+  if (result == NULL)
+    throw std::bad_alloc();
+  return result;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  free(ptr);
+}
+
+Bench::Bench(const Input &input, std::chrono::nanoseconds min_time,
+    PerfCounters *counters)
+    : input_(input)
+    , min_time_(min_time)
+    , counters_(counters)
+    , skipped_(false)
+    , runs_(0)
+    , bytes_(0)
+    , symbols_(0)
+    , allocations_(0)
+    , elapsed_(0) { }
+
+void Bench::measure(std::function<void()> op) {
+  typedef std::chrono::steady_clock clock;
+  // Run once outside the measurement to warm up caches and lazy state.
+  op();
+  uint64_t allocations_before = allocation_count.load();
+  if (counters_ != NULL)
+    counters_->start();
+  clock::time_point start = clock::now();
+  clock::duration elapsed;
+  do {
+    op();
+    runs_++;
+    elapsed = clock::now() - start;
+  } while (elapsed < min_time_);
+  if (counters_ != NULL)
+    counters_->stop();
+  allocations_ = allocation_count.load() - allocations_before;
+  elapsed_ = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
+}
+
+Registration::Registration(const char *name, BenchFunction function,
+    bool uses_input)
+    : name_(name)
+    , function_(function)
+    , uses_input_(uses_input) {
+  all().push_back(this);
+}
+
+std::vector<Registration*> &Registration::all() {
+  static std::vector<Registration*> registrations;
+  return registrations;
+}
+
+class Arguments {
+public:
+  Arguments();
+  void parse(Array<char*> cmdline);
+
+  std::string &data_dir() { return data_dir_; }
+  std::string &filter() { return filter_; }
+  uint32_t min_time_ms() { return min_time_ms_; }
+  uint64_t generated_size() { return generated_size_; }
+  bool use_counters() { return use_counters_; }
+
+private:
+  static error_t dispatch_parse_option(int key, char *arg, argp_state *state);
+  error_t parse_option(int key, char *arg, argp_state *state);
+
+  static const argp_option kOptions[6];
+  static const argp kParser;
+
+  std::string data_dir_;
+  std::string filter_;
+  uint32_t min_time_ms_;
+  uint64_t generated_size_;
+  bool use_counters_;
+};
+
+const argp_option Arguments::kOptions[6] = {
+    {"data", 'd', "DIR", 0, "Directory containing the test fixtures"},
+    {"generated-size", 'g', "BYTES", 0, "Size of the generated inputs"},
+    {"filter", 'f', "TEXT", 0, "Only run cases whose name contains TEXT"},
+    {"min-time", 't', "MS", 0, "Minimum time to run each case for"},
+    {"no-counters", 'C', 0, 0, "Don't collect hardware performance counters"},
+    {NULL}
+};
+
+Arguments::Arguments()
+    : data_dir_("../tests/data")
+    , min_time_ms_(200)
+    , generated_size_(1024 * 1024)
+    , use_counters_(true) { }
+
+error_t Arguments::dispatch_parse_option(int key, char *arg, struct argp_state *state) {
+  return static_cast<Arguments*>(state->input)->parse_option(key, arg, state);
+}
+
+error_t Arguments::parse_option(int key, char *arg, struct argp_state *state) {
+  switch (key) {
+  case 'd':
+    data_dir_ = arg;
+    break;
+  case 'f':
+    filter_ = arg;
+    break;
+  case 't':
+    min_time_ms_ = atoi(arg);
+    break;
+  case 'g':
+    generated_size_ = strtoull(arg, NULL, 10);
+    break;
+  case 'C':
+    use_counters_ = false;
+    break;
+  case ARGP_KEY_ARG:
+  case ARGP_KEY_END:
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+void Arguments::parse(Array<char*> cmdline) {
+  argp_parse(&kParser, cmdline.size(), cmdline.begin(), 0, 0, this);
+}
+
+const argp Arguments::kParser = { kOptions, dispatch_parse_option, "", NULL };
+
+class BenchMain {
+public:
+  int main(Array<char*> cmdline);
+
+private:
+  static std::string read_file(std::string path);
+
+  // Adds the zlib compressed fixture with the given name, if it exists.
+  void add_fixture(std::string name);
+
+  // Adds a synthetic input with the given shape.
+  void add_generated(gen::Shape shape, uint64_t size);
+
+  void add_inputs();
+  void report(std::ostream &out, Registration *registration, Bench &bench, bool first);
+
+  Arguments args_;
+  std::vector<Input> inputs_;
+};
+
+std::string BenchMain::read_file(std::string path) {
+  std::stringstream bytes;
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return std::string();
+  bytes << file.rdbuf();
+  file.close();
+  return bytes.str();
+}
+
+void BenchMain::add_fixture(std::string name) {
+  std::string zlib = read_file(args_.data_dir() + "/" + name);
+  if (zlib.size() < 6) {
+    std::cerr << "Couldn't read fixture " << name << std::endl;
+    return;
+  }
+  Input input;
+  input.name = name;
+  // Strip the two byte zlib header and the four byte adler32 trailer.
+  input.deflated = zlib.substr(2, zlib.size() - 6);
+  input.inflated_size = Profiler::profile_deflated(input.deflated_data()).inflated_size();
+  input.symbol_count = record_tokens(input.deflated_data()).size();
+  inputs_.push_back(input);
+}
+
+void BenchMain::add_generated(gen::Shape shape, uint64_t size) {
+  std::string zlib = gen::Corpus(shape, 0).generate(size);
+  Input input;
+  input.name = gen::Corpus::shape_name(shape);
+  input.deflated = zlib.substr(2, zlib.size() - 6);
+  input.inflated_size = size;
+  input.symbol_count = record_tokens(input.deflated_data()).size();
+  inputs_.push_back(input);
+}
+
+void BenchMain::add_inputs() {
+  add_fixture("lipsum.txt.z");
+  add_fixture("lipsum-big.txt.z");
+  add_fixture("shakespeare.txt.z");
+  std::vector<gen::Shape> shapes = gen::Corpus::all_shapes();
+  for (auto it = shapes.begin(); it != shapes.end(); it++)
+    add_generated(*it, args_.generated_size());
+}
+
+static void write_double(std::ostream &out, double value) {
+  if (std::isnan(value)) {
+    out << "null";
+  } else {
+    out << value;
+  }
+}
+
+void BenchMain::report(std::ostream &out, Registration *registration, Bench &bench,
+    bool first) {
+  double ns = static_cast<double>(bench.elapsed().count());
+  double runs = static_cast<double>(bench.runs());
+  double ns_per_run = ns / runs;
+  double nan = std::numeric_limits<double>::quiet_NaN();
+  double mb_per_s = (bench.bytes() == 0)
+      ? nan
+      : (bench.bytes() * runs / (1024.0 * 1024.0)) / (ns / 1e9);
+  double ns_per_symbol = (bench.symbols() == 0)
+      ? nan
+      : ns_per_run / bench.symbols();
+  std::string input = registration->uses_input() ? bench.input().name : "";
+  out << (first ? "" : ",") << std::endl;
+  out << "    {\"case\": \"" << registration->name() << "\""
+      << ", \"input\": \"" << input << "\""
+      << ", \"runs\": " << bench.runs()
+      << ", \"ns_per_run\": ";
+  write_double(out, ns_per_run);
+  out << ", \"mb_per_s\": ";
+  write_double(out, mb_per_s);
+  out << ", \"ns_per_symbol\": ";
+  write_double(out, ns_per_symbol);
+  out << ", \"allocations_per_run\": ";
+  write_double(out, bench.allocations() / runs);
+  PerfCounters *counters = bench.counters();
+  if (counters != NULL) {
+    // Counters are normalized per byte and per symbol of a single run so
+    // they're comparable across inputs.
+    for (uint32_t i = 0; i < PerfCounters::kCounterCount; i++) {
+      PerfCounters::Counter counter = static_cast<PerfCounters::Counter>(i);
+      double per_run = counters->has_value(counter)
+          ? counters->value(counter) / runs
+          : nan;
+      out << ", \"" << PerfCounters::name(counter) << "_per_byte\": ";
+      write_double(out, (bench.bytes() == 0) ? nan : per_run / bench.bytes());
+      out << ", \"" << PerfCounters::name(counter) << "_per_symbol\": ";
+      write_double(out, (bench.symbols() == 0) ? nan : per_run / bench.symbols());
+    }
+    bool has_ipc = counters->has_value(PerfCounters::CYCLES)
+        && counters->has_value(PerfCounters::INSTRUCTIONS)
+        && counters->value(PerfCounters::CYCLES) > 0;
+    out << ", \"ipc\": ";
+    write_double(out, has_ipc
+        ? static_cast<double>(counters->value(PerfCounters::INSTRUCTIONS))
+            / counters->value(PerfCounters::CYCLES)
+        : nan);
+  }
+  out << "}";
+}
+
+int BenchMain::main(Array<char*> cmdline) {
+  args_.parse(cmdline);
+  add_inputs();
+  std::chrono::nanoseconds min_time = std::chrono::milliseconds(args_.min_time_ms());
+  PerfCounters counters;
+  PerfCounters *counters_ptr = NULL;
+  if (args_.use_counters()) {
+    if (counters.open()) {
+      counters_ptr = &counters;
+    } else {
+      std::cerr << "Hardware counters unavailable (" << counters.error()
+          << "), reporting timings only" << std::endl;
+    }
+  }
+  std::ostream &out = std::cout;
+  out << "{" << std::endl << "  \"results\": [";
+  bool first = true;
+  std::vector<Registration*> &all = Registration::all();
+  for (auto reg = all.begin(); reg != all.end(); reg++) {
+    if (strstr((*reg)->name(), args_.filter().c_str()) == NULL)
+      continue;
+    for (auto input = inputs_.begin(); input != inputs_.end(); input++) {
+      Bench bench(*input, min_time, counters_ptr);
+      (*reg)->function()(bench);
+      if (bench.skipped() || bench.runs() == 0)
+        continue;
+      report(out, *reg, bench, first);
+      first = false;
+      if (!(*reg)->uses_input())
+        break;
+    }
+  }
+  out << std::endl << "  ]" << std::endl << "}" << std::endl;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  BenchMain bench;
+  return bench.main(Array<char*>(argv, argc));
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#pragma once
+
+#include "perf.hh"
+#include "zipprof.h"
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace zipprof {
+namespace bench {
+
+// An input to run the benchmark cases against.
+struct Input {
+  // Name of the input, used to identify results.
+  std::string name;
+
+  // The raw deflated data, without zlib framing.
+  std::string deflated;
+
+  // The size of the data the deflated data inflates to.
+  uint64_t inflated_size;
+
+  // The number of literals and copies in the deflated data.
+  uint64_t symbol_count;
+
+  Array<const uint8_t> deflated_data() const {
+    return Array<const uint8_t>(reinterpret_cast<const uint8_t*>(deflated.data()),
+        deflated.size());
+  }
+};
+
+// The state of a single benchmark case running against a single input. Cases
+// set up whatever they need and then call measure with the operation to time.
+class Bench {
+public:
+  // If counters are given they are collected over the measured runs.
+  Bench(const Input &input, std::chrono::nanoseconds min_time,
+      PerfCounters *counters = NULL);
+
+  // Runs the given operation repeatedly until enough time has passed to get a
+  // stable measurement.
+  void measure(std::function<void()> op);
+
+  // Sets the number of bytes and symbols each run of the operation processes.
+  void set_bytes(uint64_t bytes) { bytes_ = bytes; }
+  void set_symbols(uint64_t symbols) { symbols_ = symbols; }
+
+  // Skips this case for this input, for instance because the input doesn't
+  // exercise it.
+  void skip() { skipped_ = true; }
+
+  const Input &input() { return input_; }
+  bool skipped() { return skipped_; }
+  uint64_t runs() { return runs_; }
+  uint64_t bytes() { return bytes_; }
+  uint64_t symbols() { return symbols_; }
+  uint64_t allocations() { return allocations_; }
+  std::chrono::nanoseconds elapsed() { return elapsed_; }
+  PerfCounters *counters() { return counters_; }
+
+private:
+  const Input &input_;
+  std::chrono::nanoseconds min_time_;
+  PerfCounters *counters_;
+  bool skipped_;
+  uint64_t runs_;
+  uint64_t bytes_;
+  uint64_t symbols_;
+  uint64_t allocations_;
+  std::chrono::nanoseconds elapsed_;
+};
+
+typedef void (*BenchFunction)(Bench &bench);
+
+// Registers a benchmark case when constructed; use the BENCH macro rather than
+// creating these directly.
+class Registration {
+public:
+  Registration(const char *name, BenchFunction function, bool uses_input);
+
+  const char *name() { return name_; }
+  BenchFunction function() { return function_; }
+
+  // Cases that don't use their input are only run once.
+  bool uses_input() { return uses_input_; }
+
+  static std::vector<Registration*> &all();
+
+private:
+  const char *name_;
+  BenchFunction function_;
+  bool uses_input_;
+};
+
+#define ZIPPROF_BENCH_CASE(NAME, USES_INPUT)                                   \
+  static void bench_##NAME(zipprof::bench::Bench &bench);                      \
+  static zipprof::bench::Registration register_##NAME(#NAME, bench_##NAME,     \
+      USES_INPUT);                                                             \
+  static void bench_##NAME(zipprof::bench::Bench &bench)
+
+// Declares a benchmark case with the given name that is run against each
+// input.
+#define BENCH(NAME) ZIPPROF_BENCH_CASE(NAME, true)
+
+// Declares a benchmark case that doesn't depend on the input.
+#define BENCH_ONCE(NAME) ZIPPROF_BENCH_CASE(NAME, false)
+
+} // namespace bench
+} // namespace zipprof
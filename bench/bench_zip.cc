@@ -0,0 +1,257 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "bench.hh"
+#include "benchutils_inl.hh"
+#include "kernels.hh"
+#include "zipprof_impl.hh"
+
+#include <memory>
+
+using namespace zipprof;
+using namespace zipprof::bench;
+using namespace zipprof::impl;
+
+namespace zipprof {
+namespace impl {
+
+class DeflaterAccess {
+public:
+  // Unlike the deflater this doesn't reject the two invalid fixed codes since
+  // they're bound to turn up when decoding arbitrary input.
+  template <typename R, typename W>
+  static uint32_t decode_fixed_symbol(Deflater<R, W> &deflater, Account &account) {
+    uint32_t entry = FixedHuffman::kLitLen.entries[
+        deflater.in().peek_word(FixedHuffman::kLitLenBits)];
+    return deflater.template consume_entry<false>(account, entry);
+  }
+};
+
+} // namespace impl
+} // namespace zipprof
+
+// Keeps results alive so the compiler can't drop the work that produced them.
+static volatile uint32_t sink;
+
+BENCH(bit_reader_words) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  uint64_t bit_count = static_cast<uint64_t>(data.size()) * 8;
+  bench.set_bytes(data.size());
+  bench.measure([&]() {
+    ArrayBitReader reader(data);
+    uint32_t acc = 0;
+    uint64_t bits = 0;
+    // Cycle through all the widths deflate reads.
+    for (uint32_t width = 1; bits < bit_count; width = (width % 16) + 1) {
+      acc ^= reader.next_word(width);
+      bits += width;
+    }
+    sink = acc;
+  });
+}
+
+BENCH_ONCE(build_code_table) {
+  stack_array<uint32_t, 288> len_table;
+  len_table.slice(0, 144).fill(8);
+  len_table.slice(144, 256).fill(9);
+  len_table.slice(256, 280).fill(7);
+  len_table.slice(280, 288).fill(8);
+  stack_array<uint32_t, 32> dist_table;
+  dist_table.fill(5);
+  stack_array<uint32_t, CodeTable::kLitLenCapacity> len_storage;
+  stack_array<uint32_t, CodeTable::kDistCapacity> dist_storage;
+  bench.set_symbols(288 + 32);
+  bench.measure([&]() {
+    CodeTable len_code;
+    CodeTable dist_code;
+    len_code.build(len_table, CodeTable::kLitLenRootBits, len_storage);
+    dist_code.build(dist_table, CodeTable::kDistRootBits, dist_storage);
+    sink = len_code.size() + dist_code.size();
+  });
+}
+
+BENCH_ONCE(build_literal_table) {
+  stack_array<uint32_t, 288> len_table;
+  len_table.slice(0, 144).fill(8);
+  len_table.slice(144, 256).fill(9);
+  len_table.slice(256, 280).fill(7);
+  len_table.slice(280, 288).fill(8);
+  stack_array<uint32_t, CodeTable::kLitLenCapacity> len_storage;
+  CodeTable len_code;
+  len_code.build(len_table, CodeTable::kLitLenRootBits, len_storage);
+  stack_array<uint64_t, 1 << CodeTable::kLitLenRootBits> storage;
+  bench.set_symbols(1 << CodeTable::kLitLenRootBits);
+  bench.measure([&]() {
+    LiteralTable literals;
+    literals.build(len_code, storage);
+    sink = static_cast<uint32_t>(literals.entries()[0]);
+  });
+}
+
+BENCH(decode_symbol) {
+  // Any bit string is a valid sequence of fixed huffman codes so the input
+  // can be decoded as such regardless of what it actually contains.
+  Array<const uint8_t> data = bench.input().deflated_data();
+  uint32_t symbol_count = data.size() * 8 / 9;
+  bench.set_bytes(data.size());
+  bench.set_symbols(symbol_count);
+  bench.measure([&]() {
+    ArrayBitReader reader(data);
+    NullWriter writer;
+    Deflater<ArrayBitReader, NullWriter> deflater(reader, writer);
+    Account account;
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < symbol_count; i++)
+      acc += DeflaterAccess::decode_fixed_symbol(deflater, account);
+    account.close();
+    sink = acc;
+  });
+}
+
+BENCH(output_copy) {
+  std::vector<Token> tokens = record_tokens(bench.input().deflated_data());
+  bench.set_bytes(bench.input().inflated_size);
+  bench.set_symbols(tokens.size());
+  bench.measure([&]() {
+    NullWriter writer;
+    OutputTracker<NullWriter> tracker(64 * 1024, writer);
+    for (auto it = tokens.begin(); it != tokens.end(); it++) {
+      if (it->dist == 0)
+        tracker.add(it->value, 8);
+      else
+        tracker.copy(it->dist, it->len, 16);
+    }
+  });
+}
+
+BENCH(inflate) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.set_symbols(bench.input().symbol_count);
+  bench.measure([&]() {
+    ArrayBitReader reader(data);
+    NullWriter writer;
+    Deflater<ArrayBitReader, NullWriter> deflater(reader, writer);
+    deflater.deflate();
+  });
+}
+
+// Decodes every dynamic block that isn't cached with canonical codes.
+BENCH(inflate_canonical) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.set_symbols(bench.input().symbol_count);
+  bench.measure([&]() {
+    ArrayBitReader reader(data);
+    NullWriter writer;
+    Deflater<ArrayBitReader, NullWriter> deflater(reader, writer);
+    deflater.set_canonical_limit(static_cast<uint32_t>(-1));
+    deflater.deflate();
+  });
+}
+
+// Builds tables for every dynamic block that isn't cached.
+BENCH(inflate_tables) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.set_symbols(bench.input().symbol_count);
+  bench.measure([&]() {
+    ArrayBitReader reader(data);
+    NullWriter writer;
+    Deflater<ArrayBitReader, NullWriter> deflater(reader, writer);
+    deflater.set_canonical_limit(0);
+    deflater.deflate();
+  });
+}
+
+BENCH(inflate_multi_literal) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.set_symbols(bench.input().symbol_count);
+  bench.measure([&]() {
+    ArrayBitReader reader(data);
+    NullWriter writer;
+    Deflater<ArrayBitReader, NullWriter> deflater(reader, writer);
+    deflater.set_multi_literal(true);
+    deflater.deflate();
+  });
+}
+
+// Times the passes that derive the columns of a profile from its byte stats,
+// dispatched to the given cpu level.
+static void measure_profile_columns(Bench &bench, CpuLevel level) {
+  if (level > detect_cpu_level()) {
+    bench.skip();
+    return;
+  }
+  ArrayBitReader reader(bench.input().deflated_data());
+  ProfilingByteWriter writer;
+  Deflater<ArrayBitReader, ProfilingByteWriter> deflater(reader, writer);
+  deflater.deflate();
+  std::unique_ptr<DeflateProfile::Impl> profile(writer.flush(0));
+  uint32_t size = profile->inflated_size_;
+  array<const ByteStat> stats = profile->byte_stats_;
+  std::vector<uint32_t> origins(size);
+  std::vector<uint32_t> weights(size);
+  bench.set_bytes(size);
+  set_cpu_level(level);
+  bench.measure([&]() {
+    resolve_origins(stats, array<uint32_t>(origins.data(), size));
+    memset(weights.data(), 0, size * sizeof(uint32_t));
+    count_weights(array<const uint32_t>(origins.data(), size),
+        array<uint32_t>(weights.data(), size));
+    sink = weights[0];
+  });
+  set_cpu_level(detect_cpu_level());
+}
+
+BENCH(profile_columns) {
+  measure_profile_columns(bench, detect_cpu_level());
+}
+
+BENCH(profile_columns_portable) {
+  measure_profile_columns(bench, CpuLevel::PORTABLE);
+}
+
+// Times the multi-threaded variants of the passes profile_columns times, as
+// used for large profiles.
+BENCH(profile_columns_parallel) {
+  ArrayBitReader reader(bench.input().deflated_data());
+  ProfilingByteWriter writer;
+  Deflater<ArrayBitReader, ProfilingByteWriter> deflater(reader, writer);
+  deflater.deflate();
+  std::unique_ptr<DeflateProfile::Impl> profile(writer.flush(0));
+  uint32_t size = profile->inflated_size_;
+  array<const ByteStat> stats = profile->byte_stats_;
+  std::vector<uint32_t> origins(size);
+  std::vector<uint32_t> weights(size);
+  bench.set_bytes(size);
+  bench.measure([&]() {
+    resolve_origins_parallel(stats, array<uint32_t>(origins.data(), size),
+        DeflateProfile::Impl::kParallelColumnChunk);
+    memset(weights.data(), 0, size * sizeof(uint32_t));
+    count_weights_parallel(array<const uint32_t>(origins.data(), size),
+        array<uint32_t>(weights.data(), size), thread_count());
+    sink = weights[0];
+  });
+}
+
+// Times resolving origins and copy depths together, to compare with
+// profile_columns.
+BENCH(profile_depths) {
+  ArrayBitReader reader(bench.input().deflated_data());
+  ProfilingByteWriter writer;
+  Deflater<ArrayBitReader, ProfilingByteWriter> deflater(reader, writer);
+  deflater.deflate();
+  std::unique_ptr<DeflateProfile::Impl> profile(writer.flush(0));
+  uint32_t size = profile->inflated_size_;
+  array<const ByteStat> stats = profile->byte_stats_;
+  std::vector<uint32_t> origins(size);
+  std::vector<uint32_t> depths(size);
+  bench.set_bytes(size);
+  bench.measure([&]() {
+    resolve_depths(stats, array<uint32_t>(origins.data(), size),
+        array<uint32_t>(depths.data(), size));
+    sink = depths[size / 2];
+  });
+}
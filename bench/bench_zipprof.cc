@@ -0,0 +1,112 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "bench.hh"
+
+using namespace zipprof;
+using namespace zipprof::bench;
+
+// Keeps results alive so the compiler can't drop the work that produced them.
+static volatile double sink;
+
+BENCH(profile_deflated) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.set_symbols(bench.input().symbol_count);
+  bench.measure([&]() {
+    DeflateProfile profile = Profiler::profile_deflated(data);
+    sink = profile.literal_count();
+  });
+}
+
+BENCH(profile_accessors) {
+  DeflateProfile profile = Profiler::profile_deflated(bench.input().deflated_data());
+  uint32_t size = profile.inflated_size();
+  bench.set_bytes(size);
+  bench.measure([&]() {
+    double acc = 0;
+    for (uint32_t i = 0; i < size; i++)
+      acc += profile.literal_contribution(i) + profile.literal_weight(i);
+    acc += profile.contents().size();
+    sink = acc;
+  });
+}
+
+// A visitor that wants no tokens, which should cost no more than inflating.
+class NoTokensVisitor : public ProfileVisitor {
+public:
+  virtual bool wants_literals() override { return false; }
+  virtual bool wants_copies() override { return false; }
+};
+
+BENCH(visit_noop) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.set_symbols(bench.input().symbol_count);
+  bench.measure([&]() {
+    NoTokensVisitor visitor;
+    Profiler::visit_deflated(data, visitor);
+  });
+}
+
+// Counts the bits of every token, so every token is recorded and delivered.
+class BitCountingVisitor : public ProfileVisitor {
+public:
+  BitCountingVisitor() : bits_(0) { }
+
+  virtual void on_tokens(Array<const ProfileToken> tokens) override {
+    for (size_t i = 0; i < tokens.size(); i++)
+      bits_ += tokens.begin()[i].bits;
+  }
+
+  uint64_t bits() { return bits_; }
+
+private:
+  uint64_t bits_;
+};
+
+BENCH(visit_tokens) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.set_symbols(bench.input().symbol_count);
+  bench.measure([&]() {
+    BitCountingVisitor visitor;
+    Profiler::visit_deflated(data, visitor);
+    sink = visitor.bits();
+  });
+}
+
+// Builds the range index, including the bit cost and weight columns it is
+// built from.
+BENCH(range_index) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.measure([&]() {
+    DeflateProfile profile = Profiler::profile_deflated(data);
+    profile.build_range_index();
+    sink = profile.range_totals(0, profile.inflated_size()).bit_cost;
+  });
+}
+
+// Answers the queries zprof --top makes, on a profile whose columns and
+// range index are already in place.
+BENCH(top_queries) {
+  DeflateProfile profile = Profiler::profile_deflated(bench.input().deflated_data());
+  profile.build_range_index();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.measure([&]() {
+    sink = profile.hottest_regions(4096, 50).size() + profile.most_copied(50).size();
+  });
+}
+
+// Builds the copy index on a profile whose origins are already resolved.
+BENCH(copy_index) {
+  Array<const uint8_t> data = bench.input().deflated_data();
+  bench.set_bytes(bench.input().inflated_size);
+  bench.measure([&]() {
+    DeflateProfile profile = Profiler::profile_deflated(data);
+    profile.origin(0);
+    profile.build_copy_index();
+    sink = profile.copies_of(0).size();
+  });
+}
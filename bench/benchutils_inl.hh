@@ -0,0 +1,79 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#pragma once
+
+#include "zip_inl.hh"
+#include "io_inl.hh"
+
+#include <vector>
+
+namespace zipprof {
+namespace bench {
+
+// A writer that discards everything written to it.
+class NullWriter : public impl::ByteWriter {
+public:
+  void copy(uint8_t data, uint32_t source, uint32_t copy, uint32_t bit_size) { }
+  void append(uint8_t data, uint32_t bit_size) { }
+  void borrow(uint8_t data, uint32_t copy, uint32_t bit_size) { }
+  void open_block(uint8_t type) { }
+  void close_block(uint32_t bit_count) { }
+};
+
+// A literal or a copy from the deflated stream. Literals have a distance of 0.
+struct Token {
+  uint32_t dist;
+  uint32_t len;
+  uint8_t value;
+};
+
+// A writer that reconstructs the tokens of the deflated stream.
+class TokenWriter : public impl::ByteWriter {
+public:
+  TokenWriter(std::vector<Token> &tokens)
+      : tokens_(tokens)
+      , cursor_(0)
+      , last_copy_(static_cast<uint32_t>(-1)) { }
+
+  void copy(uint8_t data, uint32_t source, uint32_t copy, uint32_t bit_size) {
+    if (copy != last_copy_) {
+      Token token = {cursor_ - source, 0, 0};
+      tokens_.push_back(token);
+      last_copy_ = copy;
+    }
+    tokens_.back().len++;
+    cursor_++;
+  }
+
+  void append(uint8_t data, uint32_t bit_size) {
+    Token token = {0, 1, data};
+    tokens_.push_back(token);
+    cursor_++;
+  }
+
+  void borrow(uint8_t data, uint32_t copy, uint32_t bit_size) {
+    append(data, bit_size);
+  }
+
+  void open_block(uint8_t type) { }
+  void close_block(uint32_t bit_count) { }
+
+private:
+  std::vector<Token> &tokens_;
+  uint32_t cursor_;
+  uint32_t last_copy_;
+};
+
+// Returns the tokens of the given raw deflated data.
+static std::vector<Token> record_tokens(Array<const uint8_t> data) {
+  std::vector<Token> tokens;
+  impl::ArrayBitReader reader(data);
+  TokenWriter writer(tokens);
+  impl::Deflater<impl::ArrayBitReader, TokenWriter> deflater(reader, writer);
+  deflater.deflate();
+  return tokens;
+}
+
+} // namespace bench
+} // namespace zipprof
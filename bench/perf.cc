@@ -0,0 +1,139 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "perf.hh"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+using namespace zipprof::bench;
+
+const uint32_t PerfCounters::kCounterCount;
+
+PerfCounters::PerfCounters() {
+  for (uint32_t i = 0; i < kCounterCount; i++) {
+    fds_[i] = -1;
+    values_[i] = 0;
+    has_values_[i] = false;
+  }
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (uint32_t i = 0; i < kCounterCount; i++) {
+    if (fds_[i] != -1)
+      close(fds_[i]);
+  }
+#endif
+}
+
+const char *PerfCounters::name(Counter counter) {
+  switch (counter) {
+  case CYCLES: return "cycles";
+  case INSTRUCTIONS: return "instructions";
+  case BRANCH_MISSES: return "branch_misses";
+  case L1D_MISSES: return "l1d_misses";
+  case LLC_MISSES: return "llc_misses";
+  }
+  return NULL;
+}
+
+#ifdef __linux__
+
+// The values read from a counter when it is opened with
+// PERF_FORMAT_TOTAL_TIME_ENABLED and PERF_FORMAT_TOTAL_TIME_RUNNING.
+struct CounterReading {
+  uint64_t value;
+  uint64_t time_enabled;
+  uint64_t time_running;
+};
+
+static int open_counter(uint32_t type, uint64_t config) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+static uint64_t cache_miss_config(uint64_t cache) {
+  return cache
+      | (static_cast<uint64_t>(PERF_COUNT_HW_CACHE_OP_READ) << 8)
+      | (static_cast<uint64_t>(PERF_COUNT_HW_CACHE_RESULT_MISS) << 16);
+}
+
+bool PerfCounters::open() {
+  fds_[CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  fds_[INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  fds_[BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  fds_[L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+      cache_miss_config(PERF_COUNT_HW_CACHE_L1D));
+  fds_[LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+      cache_miss_config(PERF_COUNT_HW_CACHE_LL));
+  for (uint32_t i = 0; i < kCounterCount; i++) {
+    if (fds_[i] != -1)
+      return true;
+  }
+  error_ = strerror(errno);
+  return false;
+}
+
+void PerfCounters::start() {
+  for (uint32_t i = 0; i < kCounterCount; i++) {
+    if (fds_[i] == -1)
+      continue;
+    ioctl(fds_[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void PerfCounters::stop() {
+  for (uint32_t i = 0; i < kCounterCount; i++) {
+    if (fds_[i] != -1)
+      ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+  }
+  for (uint32_t i = 0; i < kCounterCount; i++) {
+    values_[i] = 0;
+    has_values_[i] = false;
+    if (fds_[i] == -1)
+      continue;
+    CounterReading reading;
+    if (read(fds_[i], &reading, sizeof(reading)) != sizeof(reading))
+      continue;
+    if (reading.time_running == 0)
+      continue;
+    if (reading.time_running < reading.time_enabled) {
+      // The counter was only scheduled some of the time so extrapolate.
+      double scale = static_cast<double>(reading.time_enabled) / reading.time_running;
+      values_[i] = static_cast<uint64_t>(reading.value * scale);
+    } else {
+      values_[i] = reading.value;
+    }
+    has_values_[i] = true;
+  }
+}
+
+#else // __linux__
+
+bool PerfCounters::open() {
+  error_ = "perf_event_open is only available on linux";
+  return false;
+}
+
+void PerfCounters::start() { }
+
+void PerfCounters::stop() { }
+
+#endif // __linux__
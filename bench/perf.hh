@@ -0,0 +1,61 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace zipprof {
+namespace bench {
+
+// Hardware performance counters for the current thread, read through
+// perf_event_open on linux. Counters that can't be opened, because the kernel
+// or the container doesn't allow it or the cpu doesn't have them, are simply
+// reported as unavailable.
+class PerfCounters {
+public:
+  enum Counter {
+    CYCLES = 0,
+    INSTRUCTIONS = 1,
+    BRANCH_MISSES = 2,
+    L1D_MISSES = 3,
+    LLC_MISSES = 4
+  };
+  static const uint32_t kCounterCount = 5;
+
+  PerfCounters();
+  ~PerfCounters();
+
+  // Tries to open all the counters, returning true if any of them could be.
+  // If none could the reason is available through error().
+  bool open();
+
+  // Resets and starts counting.
+  void start();
+
+  // Stops counting and reads the values.
+  void stop();
+
+  // Was a value read for the given counter at the last stop?
+  bool has_value(Counter counter) { return has_values_[counter]; }
+
+  // Returns the value read at the last stop, scaled up if the kernel had to
+  // multiplex the counters.
+  uint64_t value(Counter counter) { return values_[counter]; }
+
+  // Why the counters couldn't be opened.
+  const std::string &error() { return error_; }
+
+  // Returns the name used to report the given counter.
+  static const char *name(Counter counter);
+
+private:
+  int fds_[kCounterCount];
+  uint64_t values_[kCounterCount];
+  bool has_values_[kCounterCount];
+  std::string error_;
+};
+
+} // namespace bench
+} // namespace zipprof
@@ -0,0 +1,280 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "corpus.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <random>
+
+#include <zlib.h>
+
+using namespace zipprof;
+using namespace zipprof::gen;
+
+const uint32_t Corpus::kFarDistance;
+const uint32_t Corpus::kTinyBlockSize;
+
+void StringSink::write(Array<const uint8_t> data) {
+  out_.append(reinterpret_cast<const char*>(data.begin()), data.size());
+}
+
+namespace {
+
+// Produces the uncompressed data for a shape one chunk at a time. Only the raw
+// output of the random generator is used, the standard distributions aren't
+// guaranteed to be the same across implementations.
+class Source {
+public:
+  Source(uint64_t seed) : random_(seed) { }
+  virtual ~Source() { }
+  virtual void fill(uint8_t *buf, uint32_t size) = 0;
+
+protected:
+  // Returns a random value from 0 to limit.
+  uint32_t next(uint32_t limit) { return static_cast<uint32_t>(random_() % limit); }
+
+  void fill_random(uint8_t *buf, uint32_t size);
+
+  std::mt19937_64 random_;
+};
+
+void Source::fill_random(uint8_t *buf, uint32_t size) {
+  for (uint32_t i = 0; i < size; i += 8) {
+    uint64_t value = random_();
+    memcpy(buf + i, &value, std::min<uint32_t>(8, size - i));
+  }
+}
+
+class RandomSource : public Source {
+public:
+  RandomSource(uint64_t seed) : Source(seed) { }
+  virtual void fill(uint8_t *buf, uint32_t size) override {
+    fill_random(buf, size);
+  }
+};
+
+class RunSource : public Source {
+public:
+  RunSource(uint64_t seed) : Source(seed), value_(0), remaining_(0) { }
+  virtual void fill(uint8_t *buf, uint32_t size) override;
+
+private:
+  uint8_t value_;
+  uint32_t remaining_;
+};
+
+void RunSource::fill(uint8_t *buf, uint32_t size) {
+  uint32_t cursor = 0;
+  while (cursor < size) {
+    if (remaining_ == 0) {
+      value_ = static_cast<uint8_t>(next(256));
+      remaining_ = 1024 + next(64 * 1024);
+    }
+    uint32_t count = std::min(remaining_, size - cursor);
+    memset(buf + cursor, value_, count);
+    cursor += count;
+    remaining_ -= count;
+  }
+}
+
+class RepeatSource : public Source {
+public:
+  RepeatSource(uint64_t seed, uint32_t period);
+  virtual void fill(uint8_t *buf, uint32_t size) override;
+
+private:
+  std::vector<uint8_t> block_;
+  uint32_t cursor_;
+};
+
+RepeatSource::RepeatSource(uint64_t seed, uint32_t period)
+    : Source(seed)
+    , block_(period)
+    , cursor_(0) {
+  fill_random(block_.data(), period);
+}
+
+void RepeatSource::fill(uint8_t *buf, uint32_t size) {
+  for (uint32_t i = 0; i < size; i++) {
+    buf[i] = block_[cursor_];
+    cursor_ = (cursor_ + 1) % block_.size();
+  }
+}
+
+class AlphabetSource : public Source {
+public:
+  AlphabetSource(uint64_t seed) : Source(seed) { }
+  virtual void fill(uint8_t *buf, uint32_t size) override;
+};
+
+void AlphabetSource::fill(uint8_t *buf, uint32_t size) {
+  // A skewed distribution over a handful of letters gives small code tables
+  // that beat the fixed code even for tiny blocks.
+  static const char kLetters[] = "aaaaaaaabbbbccde";
+  for (uint32_t i = 0; i < size; i++)
+    buf[i] = kLetters[next(sizeof(kLetters) - 1)];
+}
+
+class TextSource : public Source {
+public:
+  TextSource(uint64_t seed) : Source(seed), pending_(0) { }
+  virtual void fill(uint8_t *buf, uint32_t size) override;
+
+private:
+  std::string word_;
+  uint32_t pending_;
+};
+
+void TextSource::fill(uint8_t *buf, uint32_t size) {
+  static const char *const kWords[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+    "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+    "et", "dolore", "magna", "aliqua", "enim", "ad", "minim", "veniam",
+    "quis", "nostrud", "exercitation", "ullamco", "laboris", "nisi",
+    "aliquip", "ex", "ea", "commodo", "consequat", "duis", "aute", "irure",
+    "in", "reprehenderit", "voluptate", "velit", "esse", "cillum", "fugiat",
+    "nulla", "pariatur", "excepteur", "sint", "occaecat", "cupidatat", "non",
+    "proident", "sunt", "culpa", "qui", "officia", "deserunt", "mollit",
+    "anim", "id", "est", "laborum"
+  };
+  static const uint32_t kWordCount = sizeof(kWords) / sizeof(kWords[0]);
+  uint32_t cursor = 0;
+  while (cursor < size) {
+    if (pending_ == 0) {
+      word_ = kWords[next(kWordCount)];
+      word_ += (next(12) == 0) ? ".\n" : " ";
+      pending_ = word_.size();
+    }
+    uint32_t count = std::min(pending_, size - cursor);
+    memcpy(buf + cursor, word_.data() + word_.size() - pending_, count);
+    cursor += count;
+    pending_ -= count;
+  }
+}
+
+// How to compress each shape.
+struct Encoding {
+  int level;
+  int strategy;
+  int flush;
+  uint32_t chunk_size;
+};
+
+Source *new_source(Shape shape, uint64_t seed) {
+  switch (shape) {
+  case Shape::STORED:
+    return new RandomSource(seed);
+  case Shape::RUNS:
+    return new RunSource(seed);
+  case Shape::FAR_COPIES:
+    return new RepeatSource(seed, Corpus::kFarDistance);
+  case Shape::TINY_BLOCKS:
+    return new AlphabetSource(seed);
+  case Shape::FIXED:
+  case Shape::TEXT:
+    return new TextSource(seed);
+  }
+  return NULL;
+}
+
+Encoding get_encoding(Shape shape) {
+  static const uint32_t kChunkSize = 64 * 1024;
+  Encoding result = {Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, Z_NO_FLUSH, kChunkSize};
+  switch (shape) {
+  case Shape::STORED:
+    result.level = Z_NO_COMPRESSION;
+    break;
+  case Shape::RUNS:
+    result.level = Z_BEST_COMPRESSION;
+    break;
+  case Shape::TINY_BLOCKS:
+    result.flush = Z_BLOCK;
+    result.chunk_size = Corpus::kTinyBlockSize;
+    break;
+  case Shape::FIXED:
+    result.strategy = Z_FIXED;
+    break;
+  case Shape::FAR_COPIES:
+  case Shape::TEXT:
+    break;
+  }
+  return result;
+}
+
+} // namespace
+
+Corpus::Corpus(Shape shape, uint64_t seed)
+    : shape_(shape)
+    , seed_(seed) { }
+
+bool Corpus::generate(uint64_t size, Sink &zlib, Sink *inflated) {
+  std::unique_ptr<Source> source(new_source(shape_, seed_));
+  Encoding encoding = get_encoding(shape_);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, encoding.level, Z_DEFLATED, 15, 8, encoding.strategy) != Z_OK)
+    return false;
+  std::vector<uint8_t> in(encoding.chunk_size);
+  std::vector<uint8_t> out(64 * 1024);
+  uint64_t remaining = size;
+  do {
+    uint32_t count = static_cast<uint32_t>(std::min<uint64_t>(in.size(), remaining));
+    source->fill(in.data(), count);
+    if (inflated != NULL)
+      inflated->write(Array<const uint8_t>(in.data(), count));
+    remaining -= count;
+    int flush = (remaining == 0) ? Z_FINISH : encoding.flush;
+    stream.next_in = in.data();
+    stream.avail_in = count;
+    do {
+      stream.next_out = out.data();
+      stream.avail_out = out.size();
+      if (::deflate(&stream, flush) == Z_STREAM_ERROR) {
+        ::deflateEnd(&stream);
+        return false;
+      }
+      zlib.write(Array<const uint8_t>(out.data(), out.size() - stream.avail_out));
+    } while (stream.avail_out == 0);
+  } while (remaining > 0);
+  ::deflateEnd(&stream);
+  return true;
+}
+
+std::string Corpus::generate(uint64_t size) {
+  std::string result;
+  StringSink sink(result);
+  if (!generate(size, sink))
+    return std::string();
+  return result;
+}
+
+const char *Corpus::shape_name(Shape shape) {
+  switch (shape) {
+  case Shape::STORED: return "stored";
+  case Shape::RUNS: return "runs";
+  case Shape::FAR_COPIES: return "far-copies";
+  case Shape::TINY_BLOCKS: return "tiny-blocks";
+  case Shape::FIXED: return "fixed";
+  case Shape::TEXT: return "text";
+  }
+  return NULL;
+}
+
+bool Corpus::parse_shape(const std::string &name, Shape *shape_out) {
+  std::vector<Shape> shapes = all_shapes();
+  for (auto it = shapes.begin(); it != shapes.end(); it++) {
+    if (name == shape_name(*it)) {
+      *shape_out = *it;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<Shape> Corpus::all_shapes() {
+  Shape shapes[] = {Shape::STORED, Shape::RUNS, Shape::FAR_COPIES,
+      Shape::TINY_BLOCKS, Shape::FIXED, Shape::TEXT};
+  return std::vector<Shape>(shapes, shapes + sizeof(shapes) / sizeof(shapes[0]));
+}
@@ -0,0 +1,89 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#pragma once
+
+#include "zipprof.h"
+
+#include <string>
+#include <vector>
+
+namespace zipprof {
+namespace gen {
+
+// The shapes of synthetic corpora that can be generated. Each one stresses a
+// different part of the decoder.
+enum class Shape {
+  // Incompressible random bytes, stored without compression.
+  STORED,
+  // Long runs of a single byte, which compress to dist=1/len=258 copies.
+  RUNS,
+  // A random block repeated over and over at the largest distance zlib will
+  // emit, 32506 bytes.
+  FAR_COPIES,
+  // Text over a small alphabet flushed every 256 bytes, producing lots of tiny
+  // dynamic huffman blocks.
+  TINY_BLOCKS,
+  // Text compressed using only the fixed huffman code.
+  FIXED,
+  // Plain text compressed the usual way.
+  TEXT
+};
+
+// Receives the output of a generator as it is being produced, so corpora that
+// are too large to keep in memory can be streamed.
+class Sink {
+public:
+  virtual ~Sink() { }
+  virtual void write(Array<const uint8_t> data) = 0;
+};
+
+// A sink that appends everything to a string.
+class StringSink : public Sink {
+public:
+  StringSink(std::string &out) : out_(out) { }
+  virtual void write(Array<const uint8_t> data) override;
+
+private:
+  std::string &out_;
+};
+
+// Generates synthetic corpora deterministically; the same shape, seed and size
+// always produce the same data.
+class Corpus {
+public:
+  Corpus(Shape shape, uint64_t seed);
+
+  // Generates size bytes of data and writes the zlib compressed stream to the
+  // given sink. If inflated is non-NULL the uncompressed data is written to it
+  // too. Returns false if compression failed.
+  bool generate(uint64_t size, Sink &zlib, Sink *inflated = NULL);
+
+  // Generates size bytes of data and returns the zlib compressed stream, or
+  // the empty string if compression failed.
+  std::string generate(uint64_t size);
+
+  Shape shape() { return shape_; }
+
+  // Returns the name of the given shape.
+  static const char *shape_name(Shape shape);
+
+  // Looks up the shape with the given name, returning false if there is none.
+  static bool parse_shape(const std::string &name, Shape *shape_out);
+
+  // Returns a list of all the shapes.
+  static std::vector<Shape> all_shapes();
+
+  // The distance between repeats in the FAR_COPIES shape.
+  static const uint32_t kFarDistance = 32506;
+
+  // The amount of data between flushes in the TINY_BLOCKS shape.
+  static const uint32_t kTinyBlockSize = 256;
+
+private:
+  Shape shape_;
+  uint64_t seed_;
+};
+
+} // namespace gen
+} // namespace zipprof
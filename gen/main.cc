@@ -0,0 +1,184 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "corpus.hh"
+
+#include <argp.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace zipprof;
+using namespace zipprof::gen;
+
+class Arguments {
+public:
+  Arguments();
+  bool parse(Array<char*> cmdline);
+
+  Shape shape() { return shape_; }
+  uint64_t size() { return size_; }
+  uint64_t seed() { return seed_; }
+  std::string &output() { return output_; }
+  std::string &inflated_output() { return inflated_output_; }
+
+private:
+  static error_t dispatch_parse_option(int key, char *arg, argp_state *state);
+  error_t parse_option(int key, char *arg, argp_state *state);
+
+  // Parses a size with an optional k, m or g suffix.
+  static bool parse_size(const char *str, uint64_t *size_out);
+
+  static const argp_option kOptions[6];
+  static const argp kParser;
+
+  Shape shape_;
+  uint64_t size_;
+  uint64_t seed_;
+  std::string output_;
+  std::string inflated_output_;
+};
+
+const argp_option Arguments::kOptions[6] = {
+    {"shape", 's', "SHAPE", 0, "One of stored, runs, far-copies, tiny-blocks, fixed, text"},
+    {"size", 'n', "SIZE", 0, "Uncompressed size, optionally suffixed with k, m or g"},
+    {"seed", 'r', "SEED", 0, "Seed for the random generator"},
+    {"output", 'o', "FILE", 0, "Where to write the zlib stream, stdout by default"},
+    {"inflated", 'i', "FILE", 0, "Where to write the uncompressed data, if anywhere"},
+    {NULL}
+};
+
+Arguments::Arguments()
+    : shape_(Shape::TEXT)
+    , size_(1024 * 1024)
+    , seed_(0) { }
+
+bool Arguments::parse_size(const char *str, uint64_t *size_out) {
+  char *end = NULL;
+  uint64_t value = strtoull(str, &end, 10);
+  if (end == str)
+    return false;
+  switch (*end) {
+  case 'g': case 'G':
+    value *= 1024;
+    // fall through
+  case 'm': case 'M':
+    value *= 1024;
+    // fall through
+  case 'k': case 'K':
+    value *= 1024;
+    end++;
+  }
+  *size_out = value;
+  return *end == '\0';
+}
+
+error_t Arguments::dispatch_parse_option(int key, char *arg, struct argp_state *state) {
+  return static_cast<Arguments*>(state->input)->parse_option(key, arg, state);
+}
+
+error_t Arguments::parse_option(int key, char *arg, struct argp_state *state) {
+  switch (key) {
+  case 's':
+    if (!Corpus::parse_shape(arg, &shape_))
+      argp_error(state, "unknown shape '%s'", arg);
+    break;
+  case 'n':
+    if (!parse_size(arg, &size_))
+      argp_error(state, "invalid size '%s'", arg);
+    break;
+  case 'r':
+    seed_ = strtoull(arg, NULL, 10);
+    break;
+  case 'o':
+    output_ = arg;
+    break;
+  case 'i':
+    inflated_output_ = arg;
+    break;
+  case ARGP_KEY_ARG:
+    argp_usage(state);
+    break;
+  case ARGP_KEY_END:
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+bool Arguments::parse(Array<char*> cmdline) {
+  return argp_parse(&kParser, cmdline.size(), cmdline.begin(), 0, 0, this) == 0;
+}
+
+const argp Arguments::kParser = { kOptions, dispatch_parse_option, "", NULL };
+
+// A sink that writes to a stdio file.
+class FileSink : public Sink {
+public:
+  FileSink(FILE *file) : file_(file), failed_(false) { }
+  virtual void write(Array<const uint8_t> data) override;
+  bool failed() { return failed_; }
+
+private:
+  FILE *file_;
+  bool failed_;
+};
+
+void FileSink::write(Array<const uint8_t> data) {
+  if (fwrite(data.begin(), 1, data.size(), file_) != data.size())
+    failed_ = true;
+}
+
+class ZGen {
+public:
+  int main(Array<char*> cmdline);
+
+private:
+  static FILE *open_output(const std::string &path);
+
+  Arguments args_;
+};
+
+FILE *ZGen::open_output(const std::string &path) {
+  if (path.empty() || path == "-")
+    return stdout;
+  FILE *result = fopen(path.c_str(), "wb");
+  if (result == NULL)
+    std::cerr << "Couldn't open file " << path << std::endl;
+  return result;
+}
+
+int ZGen::main(Array<char*> cmdline) {
+  if (!args_.parse(cmdline))
+    return 1;
+  FILE *zlib_file = open_output(args_.output());
+  if (zlib_file == NULL)
+    return 1;
+  FILE *inflated_file = NULL;
+  if (!args_.inflated_output().empty()) {
+    inflated_file = open_output(args_.inflated_output());
+    if (inflated_file == NULL)
+      return 1;
+  }
+  FileSink zlib(zlib_file);
+  FileSink inflated(inflated_file);
+  Corpus corpus(args_.shape(), args_.seed());
+  bool succeeded = corpus.generate(args_.size(), zlib,
+      (inflated_file == NULL) ? NULL : &inflated);
+  if (zlib_file != stdout)
+    fclose(zlib_file);
+  if (inflated_file != NULL && inflated_file != stdout)
+    fclose(inflated_file);
+  if (!succeeded || zlib.failed() || inflated.failed()) {
+    std::cerr << "Failed to generate corpus" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  ZGen zgen;
+  return zgen.main(Array<char*>(argv, argc));
+}
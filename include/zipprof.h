@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string>
 #include <memory>
+#include <vector>
 
 namespace zipprof {
 
@@ -18,6 +19,7 @@ template <typename S> struct _StripConst<const S> { typedef S Type; };
 template <typename T>
 class Array {
 public:
+  Array() : elms_(NULL), size_(0) { }
   Array(T *elms, size_t size) : elms_(elms), size_(size) { }
   Array(Array<typename impl::_StripConst<T>::Type> that) : elms_(that.begin()), size_(that.size()) { }
   size_t size() { return size_; }
@@ -27,6 +29,158 @@ private:
   size_t size_;
 };
 
+class DeflateTimings;
+
+// Statistics about a single block of a deflate stream.
+struct BlockStat {
+  // The type from the block's header: 0 for stored blocks, 1 for blocks
+  // using the fixed code and 2 for blocks with codes of their own.
+  uint32_t type;
+
+  // The bits of the deflated stream the block spans, counted from its start.
+  uint64_t bit_offset;
+  uint64_t bit_count;
+
+  // The bits that aren't part of any literal or match: the header, code
+  // tables, padding and end of block code.
+  uint32_t header_bits;
+
+  // The number of literals and of matches in the block. The bytes of stored
+  // blocks count as literals.
+  uint32_t literal_count;
+  uint32_t match_count;
+
+  // The bytes of output the block spans.
+  uint32_t inflated_offset;
+  uint32_t inflated_size;
+
+  // The mean and maximum length and distance of the block's matches, all 0
+  // if it has none.
+  double mean_match_length;
+  uint32_t max_match_length;
+  double mean_match_distance;
+  uint32_t max_match_distance;
+
+  // The code length of each literal/length and each distance symbol for
+  // blocks with codes of their own, empty for others. They point into the
+  // profile so are only valid as long as it is.
+  Array<const uint8_t> lit_len_lengths;
+  Array<const uint8_t> dist_lengths;
+};
+
+// A span of bytes of a profile's output.
+struct Segment {
+  uint32_t offset;
+  uint32_t length;
+};
+
+// Totals over a range of bytes of a profile's output.
+struct RangeTotals {
+  // The number of bytes in the range.
+  uint32_t size;
+
+  // The number of them that are literals.
+  uint32_t literal_count;
+
+  // The sum of their literal contributions. Each contribution is rounded to
+  // a multiple of 2^-32 before being added.
+  double literal_contribution;
+
+  // The sum of their bit costs, exactly.
+  double bit_cost;
+};
+
+// Statistics about the matches of a deflate stream, including how far back
+// they reach which tells how much of the output a decoder with a smaller
+// window could still produce from copies.
+struct MatchStats {
+  static const uint32_t kMaxLength = 258;
+  static const uint32_t kDistanceBucketCount = 16;
+
+  // The number of matches and the number of bytes they copied.
+  uint64_t match_count;
+  uint64_t copied_bytes;
+
+  // The number of matches of each length, indexed by the length. Only the
+  // entries from 3 up are used.
+  uint64_t length_histogram[kMaxLength + 1];
+
+  // The number of matches and the number of bytes they copied for each
+  // bucket of distances, as assigned by distance_bucket.
+  uint64_t distance_histogram[kDistanceBucketCount];
+  uint64_t distance_bytes[kDistanceBucketCount];
+
+  // The number of bytes copied from within 2^window_bits bytes back, which a
+  // decoder with a window that size could still produce. zlib's deflate with
+  // that windowBits copies from at most 262 bytes less, so for a stream it
+  // compresses this is an upper bound on what it could have copied.
+  uint64_t copied_within(uint32_t window_bits);
+
+  // The share of copied bytes that are copied_within the given window, 1 if
+  // nothing was copied.
+  double copied_share_within(uint32_t window_bits);
+
+  // Returns the bucket a distance falls into: 0 for a distance of 1 and b
+  // for distances from 2^(b-1)+1 up to 2^b, so a window of 2^b bytes spans
+  // exactly the buckets up to b.
+  static uint32_t distance_bucket(uint32_t distance);
+};
+
+// A region of a profile's output, as found by hottest_regions.
+struct HotRegion {
+  uint32_t offset;
+  uint32_t length;
+
+  // The sum of the literal contributions of its bytes, rounded like those of
+  // RangeTotals.
+  double literal_contribution;
+};
+
+// A byte of a profile's output and how many times it appears in the output,
+// as found by most_copied.
+struct CopiedByte {
+  uint32_t offset;
+  uint32_t weight;
+};
+
+// The positions of the bytes of a profile's output that share an origin, in
+// ascending order, as returned by copies_of. Points into the profile so is
+// only valid as long as it is.
+class CopyPositions {
+public:
+  typedef const uint32_t *iterator;
+
+  CopyPositions() : begin_(NULL), end_(NULL) { }
+  CopyPositions(iterator begin, iterator end) : begin_(begin), end_(end) { }
+
+  iterator begin() { return begin_; }
+  iterator end() { return end_; }
+  size_t size() { return end_ - begin_; }
+  bool empty() { return begin_ == end_; }
+
+private:
+  iterator begin_;
+  iterator end_;
+};
+
+// How many copies the bytes of some range of a profile's output went through
+// since they were literals.
+struct DepthStats {
+  static const uint32_t kBucketCount = 33;
+
+  // The number of bytes whose depth falls within each bucket, as assigned by
+  // depth_bucket.
+  uint64_t histogram[kBucketCount];
+
+  // The largest and the mean depth of the bytes, both 0 for an empty range.
+  uint32_t max_depth;
+  double mean_depth;
+
+  // Returns the bucket a depth falls into: 0 for a depth of 0 and b for
+  // depths from 2^(b-1) up to 2^b-1.
+  static uint32_t depth_bucket(uint32_t depth);
+};
+
 class DeflateProfile {
 public:
   class Impl;
@@ -47,6 +201,13 @@ public:
   // The number of zip blocks the archive was divided into.
   uint32_t block_count();
 
+  // Returns statistics about each of the blocks, in order. The result is
+  // owned by the profile.
+  Array<const BlockStat> blocks();
+
+  // Returns statistics about the matches of the whole stream.
+  MatchStats match_stats();
+
   // Returns the weight of the byte at that index'th position, that is, the
   // number of times it has been copied. All copies of the same byte have the
   // same weight. This is the reciprocal value of the literal_contribution.
@@ -56,12 +217,81 @@ public:
   // count of literals. A single literal byte contributes one, a byte that is
   // copied exactly once contributes 0.5 with the other copy contributing the
   // other 0.5, and so on. The sum of literal contributions yields the literal
-  // count.
+  // count, except for profiles made with a preset dictionary where bytes
+  // copied from the dictionary also contribute though they're not literals.
   double literal_contribution(uint32_t index);
 
+  // Returns the index of the byte the byte at the given index was ultimately
+  // copied from, which is the index itself for literals.
+  uint32_t origin(uint32_t index);
+
+  // Builds the reverse index that copies_of is answered from, spreading the
+  // work over multiple threads. This happens on the first lookup anyway so
+  // is only needed to control when the work is done. The index takes 8
+  // bytes per byte of output.
+  void build_copy_index();
+
+  // Returns the positions of all the bytes whose origin is the byte at the
+  // given index, starting with the byte itself, or nothing if the byte
+  // isn't its own origin. Takes constant time once the index has been built.
+  CopyPositions copies_of(uint32_t index);
+
+  // Returns the number of copies between the byte at the given index and its
+  // origin, the literal it was ultimately copied from: 0 for literals and
+  // one more than the byte it was copied from for copies. Bytes copied from
+  // a preset dictionary are their own origins so also have a depth of 0.
+  uint32_t copy_depth(uint32_t index);
+
+  // Returns the histogram of copy depths of the bytes from start up to but
+  // not including end, or of all bytes.
+  DepthStats depth_stats();
+  DepthStats depth_stats(uint32_t start, uint32_t end);
+
+  // Returns the number of compressed bits the byte at the given index is
+  // charged with. A literal is charged with its code and the bytes of a match
+  // with an even share of its codes. The bits of each block that don't belong
+  // to any token, like the header and code tables, are spread evenly over
+  // the block's bytes, and the ones outside any block, like zlib framing and
+  // padding, over all bytes. The costs add up to exactly deflated_size()*8.
+  double bit_cost(uint32_t index);
+
+  // Stores the bit costs of the bytes from the given index on into costs,
+  // which must not extend past the end.
+  void bit_costs(uint32_t start, Array<double> costs);
+
+  // Builds the prefix sums that range queries are answered from, spreading
+  // the work over multiple threads. This happens on the first query anyway
+  // so is only needed to control when the work is done. The index takes 20
+  // bytes per byte of output.
+  void build_range_index();
+
+  // Returns the totals over the bytes from start up to but not including
+  // end, in constant time once the index has been built.
+  RangeTotals range_totals(uint32_t start, uint32_t end);
+
+  // Stores the totals over each of the segments in the corresponding entry
+  // of totals, which must be at least as long.
+  void segment_totals(Array<const Segment> segments, Array<RangeTotals> totals);
+
+  // Returns up to k windows of the given length with the largest literal
+  // contributions, largest first. The windows don't overlap: the largest is
+  // picked first, then the largest that doesn't overlap it, and so on, with
+  // ties going to the earlier window. Builds the range index, if it hasn't
+  // been, and spreads the search over multiple threads.
+  std::vector<HotRegion> hottest_regions(uint32_t window, uint32_t k);
+
+  // Returns up to k of the bytes that are their own origin with the largest
+  // literal weights, largest first with ties going to the earlier byte.
+  // Selects rather than sorts, spreading the work over multiple threads.
+  std::vector<CopiedByte> most_copied(uint32_t k);
+
   // Returns the deflated contents of the input.
   Array<const uint8_t> contents();
 
+  // Returns how long the different phases of decoding took. Only collected
+  // when the library is built with ZIPPROF_TIMINGS.
+  DeflateTimings timings();
+
 private:
   friend class Profiler;
   DeflateProfile(Impl *impl);
@@ -70,6 +300,179 @@ private:
   std::shared_ptr<Impl> impl_;
 };
 
+// The phases of decoding that are timed separately. Each phase is charged only
+// for the time not spent in other phases nested within it.
+enum class DecodePhase {
+  // Block headers and dynamic code length tables.
+  HEADERS = 0,
+  // Building huffman code trees.
+  CODE_TREES = 1,
+  // Decoding literal, length and distance symbols.
+  SYMBOLS = 2,
+  // Resolving matches against the history.
+  COPIES = 3,
+  // Reading the contents of stored blocks.
+  STORED = 4,
+  // Calls to the writer that receives the output.
+  WRITER = 5
+};
+
+// How the symbols of a block were decoded.
+enum class BlockDecoder {
+  // Stored blocks have no symbols.
+  STORED = 0,
+  // Through the tables of the fixed code, which are built at compile time.
+  FIXED = 1,
+  // Through lookup tables built for the block.
+  TABLE = 2,
+  // Through lookup tables found in the decode table cache.
+  CACHED_TABLE = 3,
+  // By walking the block's canonical codes, for blocks expected to have too
+  // few symbols to pay for building tables.
+  CANONICAL = 4
+};
+
+// Time spent in and events seen by one decoding phase.
+struct PhaseCounters {
+  // Elapsed cycles, or nanoseconds where there is no cycle counter.
+  uint64_t cycles;
+
+  // Block headers read, code trees built, symbols decoded, matches copied,
+  // stored blocks read or bytes written, depending on the phase.
+  uint64_t events;
+};
+
+// Per-block and total phase counters for decoding a deflate stream.
+class DeflateTimings {
+public:
+  static const uint32_t kPhaseCount = 6;
+  static const uint32_t kDecoderCount = 5;
+
+  DeflateTimings() { }
+
+  // Were timings collected? This is decided when the library is built so
+  // it's the same for every profile.
+  static bool enabled();
+
+  // The number of blocks timed, zero if timings weren't collected.
+  uint32_t block_count();
+
+  // Returns the counters for the given phase summed over all blocks.
+  PhaseCounters total(DecodePhase phase);
+
+  // Returns the counters for the given phase within a single block.
+  PhaseCounters block(uint32_t index, DecodePhase phase);
+
+  // Returns a short name for the given phase.
+  static const char *phase_name(DecodePhase phase);
+
+  // The number of dynamic blocks whose tables were looked up in the decode
+  // table cache, and how many of those were found there rather than built.
+  // Unlike the phase counters these are always collected.
+  uint64_t table_cache_lookups();
+  uint64_t table_cache_hits();
+
+  // Returns how the symbols of the given block were decoded, for blocks up to
+  // the profile's block count. Always collected.
+  BlockDecoder decoder(uint32_t index);
+
+  // Returns a short name for the given decoder.
+  static const char *decoder_name(BlockDecoder decoder);
+
+private:
+  friend class DeflateProfile;
+  DeflateTimings(std::shared_ptr<DeflateProfile::Impl> impl) : impl_(impl) { }
+
+  std::shared_ptr<DeflateProfile::Impl> impl_;
+};
+
+// Aggregates of a profile that can be collected in a single pass over the
+// output without keeping anything per byte, so arbitrarily large streams can
+// be summarized in constant memory.
+struct DeflateSummary {
+  static const uint32_t kContributionBucketCount = 16;
+
+  // As reported by the DeflateProfile of the same data.
+  uint64_t deflated_size;
+  uint64_t inflated_size;
+  uint64_t literal_count;
+  uint64_t block_count;
+
+  // The number of bytes whose literal contribution falls within each bucket,
+  // as assigned by contribution_bucket.
+  uint64_t contribution_histogram[kContributionBucketCount];
+
+  // The number of compressed bits per inflated byte.
+  double bits_per_byte();
+
+  // Returns the bucket a literal contribution falls into. The buckets split
+  // the range from 0 to 1 evenly, except that the last is for exactly 1,
+  // that is, for bytes that are never copied.
+  static uint32_t contribution_bucket(double contribution);
+};
+
+// The output of a single deflate symbol, as passed to a ProfileVisitor.
+struct ProfileToken {
+  // The position in the output of the token's first byte.
+  uint64_t pos;
+
+  // How far back the token was copied from, or 0 for literals.
+  uint32_t dist;
+
+  // The number of bytes, 1 for literals.
+  uint32_t len;
+
+  // The number of bits it took to encode the token.
+  uint32_t bits;
+
+  // The byte of a literal, 0 for copies.
+  uint8_t value;
+};
+
+// Receives the blocks and tokens of a deflate stream as they are decoded so
+// custom metrics can be computed without building a profile. Tokens are
+// delivered in batches through on_tokens which by default passes each one on
+// to on_literal or on_copy. Visitors that don't need one kind of token say so
+// through wants_literals or wants_copies and those tokens aren't even
+// recorded, so a visitor that wants neither runs as fast as plain inflation.
+class ProfileVisitor {
+public:
+  virtual ~ProfileVisitor() { }
+
+  // Return whether literals and copies should be delivered at all. Asked
+  // once, before decoding starts.
+  virtual bool wants_literals() { return true; }
+  virtual bool wants_copies() { return true; }
+
+  // Called at the end of each block, after its tokens, with the type from
+  // the block's header and the bits it took that aren't part of any token:
+  // the header itself, the code tables and the end of block code.
+  virtual void on_block(uint32_t type, uint32_t header_bits) { }
+
+  // Called for each literal byte.
+  virtual void on_literal(uint64_t pos, uint8_t value, uint32_t bits) { }
+
+  // Called for each copy of len bytes from src, dist bytes before pos. For
+  // copies that start in a preset dictionary dist is greater than pos and
+  // src wraps around.
+  virtual void on_copy(uint64_t pos, uint64_t src, uint32_t len, uint32_t dist,
+      uint32_t bits) { }
+
+  // Called with the tokens decoded since the last call, in order.
+  virtual void on_tokens(Array<const ProfileToken> tokens);
+};
+
+// Input that is read one chunk at a time, so a stream never has to be held in
+// memory as a whole.
+class ByteSource {
+public:
+  virtual ~ByteSource() { }
+
+  // Returns the next chunk of the input, or an empty array once it has all
+  // been read. The chunk only has to stay valid until the next call.
+  virtual Array<const uint8_t> next_chunk() = 0;
+};
+
 class Compressor {
 public:
   class Output {
@@ -82,6 +485,12 @@ public:
   virtual ~Compressor() { }
   virtual Output *compress(Array<const uint8_t> data) const = 0;
 
+  // Compresses the data using the given preset dictionary, returning NULL if
+  // that isn't supported. Compressors that don't override this only support
+  // an empty dictionary, which is the same as plain compress.
+  virtual Output *compress_with_dictionary(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary) const;
+
   static const Compressor &zlib_best_speed();
   static const Compressor &zlib_best_compression();
   static const Compressor &zlib_no_compression();
@@ -92,13 +501,127 @@ public:
   // Returns a profile of a naked deflated block.
   static DeflateProfile profile_deflated(Array<const uint8_t> data);
 
+  // Returns a profile of a naked deflated block that was compressed using the
+  // given preset dictionary.
+  static DeflateProfile profile_deflated(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary);
+
   // Returns a profile of the output of compressing data with zlib.
   static DeflateProfile profile_zlib(Array<const uint8_t> data);
 
+  // Returns a profile of the output of compressing data with zlib using the
+  // given preset dictionary.
+  static DeflateProfile profile_zlib(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary);
+
   // Returns the profile of compressing the given string with the given
   // compressor.
   static DeflateProfile profile_string(std::string str,
       const Compressor &compressor = Compressor::zlib_best_compression());
+
+  // Returns the summary of a naked deflated block, optionally compressed
+  // using the given preset dictionary. Unlike profiling this only uses
+  // memory proportional to the deflate window, not to the inflated size.
+  static DeflateSummary summarize_deflated(Array<const uint8_t> data);
+  static DeflateSummary summarize_deflated(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary);
+
+  // Returns the summary of the output of compressing data with zlib,
+  // optionally using the given preset dictionary.
+  static DeflateSummary summarize_zlib(Array<const uint8_t> data);
+  static DeflateSummary summarize_zlib(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary);
+
+  // Like the above but read from the given source, which is consumed to its
+  // end. Only a fixed amount of the input is buffered at a time so streams of
+  // any length can be summarized.
+  static DeflateSummary summarize_deflated(ByteSource &source);
+  static DeflateSummary summarize_deflated(ByteSource &source,
+      Array<const uint8_t> dictionary);
+  static DeflateSummary summarize_zlib(ByteSource &source);
+  static DeflateSummary summarize_zlib(ByteSource &source,
+      Array<const uint8_t> dictionary);
+
+  // Decodes a naked deflated block, optionally compressed using the given
+  // preset dictionary, passing its blocks and tokens to the given visitor.
+  static void visit_deflated(Array<const uint8_t> data, ProfileVisitor &visitor);
+  static void visit_deflated(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary, ProfileVisitor &visitor);
+
+  // Decodes the output of compressing data with zlib, optionally using the
+  // given preset dictionary, passing its blocks and tokens to the given
+  // visitor.
+  static void visit_zlib(Array<const uint8_t> data, ProfileVisitor &visitor);
+  static void visit_zlib(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary, ProfileVisitor &visitor);
+
+private:
+  // Profiles the deflated data, reporting the deflated size as the given
+  // value which may include framing around the data.
+  static DeflateProfile profile(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary, uint32_t deflated_size);
+
+  // Summarizes the deflated data, reporting the deflated size as the given
+  // value like profile.
+  static DeflateSummary summarize(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary, uint64_t deflated_size);
+
+  // Summarizes the deflated data read from the source, skipping a zlib header
+  // first if zlib is set.
+  static DeflateSummary summarize(ByteSource &source,
+      Array<const uint8_t> dictionary, bool zlib);
+};
+
+// The result of comparing how a corpus compresses with and without a preset
+// dictionary.
+struct DictionarySavings {
+  // The number of samples in the corpus.
+  uint32_t sample_count;
+
+  // The total size in bytes of the samples.
+  uint64_t inflated_size;
+
+  // The total compressed size without and with the dictionary.
+  uint64_t deflated_size;
+  uint64_t dictionary_deflated_size;
+
+  // The total number of literals without and with the dictionary.
+  uint64_t literal_count;
+  uint64_t dictionary_literal_count;
+};
+
+// Builds preset dictionaries for zlib from a corpus of sample messages. The
+// samples are profiled to find the regions that were expensive to encode
+// because they had to be emitted as literals, and the substrings that occur
+// most frequently across those regions make up the dictionary.
+class DictionaryTrainer {
+public:
+  class Impl;
+
+  // The largest dictionary that is useful with deflate's 32k window.
+  static const uint32_t kMaxDictionarySize = 32 * 1024;
+
+  DictionaryTrainer(const Compressor &compressor = Compressor::zlib_best_compression());
+  ~DictionaryTrainer();
+
+  // Adds a sample to the corpus. The data is copied so it doesn't have to
+  // outlive the trainer.
+  void add_sample(Array<const uint8_t> data);
+
+  // Returns the number of samples in the corpus.
+  uint32_t sample_count();
+
+  // Profiles the corpus and returns a dictionary of at most max_size bytes.
+  // The most valuable content is placed at the end of the dictionary since
+  // that's where it is cheapest to copy from.
+  std::string train(uint32_t max_size = kMaxDictionarySize);
+
+  // Compresses and profiles the corpus with and without the given dictionary.
+  DictionarySavings evaluate(const std::string &dictionary);
+
+private:
+  Impl &impl() { return *impl_; }
+  std::shared_ptr<Impl> impl_;
 };
 
 class Archive {
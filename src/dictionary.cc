@@ -0,0 +1,259 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "dictionary.hh"
+
+#include "utils_inl.hh"
+
+#include <algorithm>
+
+using namespace zipprof;
+using namespace zipprof::impl;
+
+const uint32_t DictionaryTrainer::kMaxDictionarySize;
+const uint32_t DictionaryTrainer::Impl::kKmerSize;
+const uint32_t DictionaryTrainer::Impl::kSegmentSize;
+const uint32_t DictionaryTrainer::Impl::kMaxGap;
+constexpr double DictionaryTrainer::Impl::kExpensiveContribution;
+const uint32_t DictionaryTrainer::Impl::kMinSampleCount;
+const uint32_t DictionaryTrainer::Impl::kMinSegmentScore;
+
+DictionaryTrainer::DictionaryTrainer(const Compressor &compressor)
+    : impl_(new Impl(compressor)) { }
+
+DictionaryTrainer::~DictionaryTrainer() { }
+
+void DictionaryTrainer::add_sample(Array<const uint8_t> data) {
+  impl().add_sample(data);
+}
+
+uint32_t DictionaryTrainer::sample_count() {
+  return impl().sample_count();
+}
+
+std::string DictionaryTrainer::train(uint32_t max_size) {
+  return impl().train(max_size);
+}
+
+DictionarySavings DictionaryTrainer::evaluate(const std::string &dictionary) {
+  return impl().evaluate(dictionary);
+}
+
+DictionaryTrainer::Impl::Impl(const Compressor &compressor)
+    : compressor_(compressor) { }
+
+void DictionaryTrainer::Impl::add_sample(Array<const uint8_t> data) {
+  samples_.push_back(std::string(reinterpret_cast<const char*>(data.begin()),
+      data.size()));
+}
+
+std::vector<DictionaryTrainer::Impl::Region> DictionaryTrainer::Impl::find_expensive_regions() {
+  std::vector<std::vector<Region>> sample_regions(samples_.size());
+  parallel_for(samples_.size(), [&](uint32_t sample) {
+    Array<const uint8_t> data(sample_bytes(sample), samples_[sample].size());
+    Compressor::Output *output = compressor_.compress(data);
+    if (output == NULL)
+      return;
+    DeflateProfile profile = Profiler::profile_deflated(output->contents());
+    delete output;
+    std::vector<Region> &regions = sample_regions[sample];
+    uint32_t size = profile.inflated_size();
+    uint32_t start = 0;
+    while (start < size) {
+      if (profile.literal_contribution(start) < kExpensiveContribution) {
+        start++;
+        continue;
+      }
+      // Extend the region across short gaps of cheap bytes, those are usually
+      // short copies within an otherwise expensive stretch.
+      uint32_t end = start + 1;
+      uint32_t gap = 0;
+      for (uint32_t i = end; i < size && gap <= kMaxGap; i++) {
+        if (profile.literal_contribution(i) >= kExpensiveContribution) {
+          end = i + 1;
+          gap = 0;
+        } else {
+          gap++;
+        }
+      }
+      if (end - start >= kKmerSize) {
+        Region region = {sample, start, end};
+        regions.push_back(region);
+      }
+      start = end;
+    }
+  });
+  std::vector<Region> result;
+  for (auto it = sample_regions.begin(); it != sample_regions.end(); it++)
+    result.insert(result.end(), it->begin(), it->end());
+  return result;
+}
+
+uint64_t DictionaryTrainer::Impl::kmer_at(uint32_t sample, uint32_t offset) {
+  uint64_t result = 0;
+  memcpy(&result, sample_bytes(sample) + offset, kKmerSize);
+  return result;
+}
+
+void DictionaryTrainer::Impl::index_kmers(const std::vector<Region> &regions,
+    KmerIndex *index) {
+  for (auto it = regions.begin(); it != regions.end(); it++) {
+    const uint8_t *bytes = sample_bytes(it->sample);
+    // The key is a window over the last kKmerSize bytes, rolled forward one
+    // byte at a time.
+    uint64_t key = 0;
+    for (uint32_t i = it->start; i < it->end; i++) {
+      key = (key >> 8) | (static_cast<uint64_t>(bytes[i]) << (8 * (kKmerSize - 1)));
+      if (i + 1 - it->start < kKmerSize)
+        continue;
+      KmerCount &count = (*index)[key];
+      if (count.count == 0 || count.last_sample != it->sample) {
+        count.count++;
+        count.last_sample = it->sample;
+      }
+    }
+  }
+}
+
+DictionaryTrainer::Impl::Segment DictionaryTrainer::Impl::best_segment(
+    const Region &region, uint32_t start, uint32_t end, const KmerIndex &index) {
+  Segment best = {region.sample, start, start, 0};
+  if (end - start < kKmerSize)
+    return best;
+  // The value of the k-mer starting at each position, or 0 if it isn't worth
+  // including.
+  uint32_t kmer_count = end - start - kKmerSize + 1;
+  std::vector<uint32_t> values(kmer_count);
+  for (uint32_t i = 0; i < kmer_count; i++) {
+    auto entry = index.find(kmer_at(region.sample, start + i));
+    uint32_t count = (entry == index.end()) ? 0 : entry->second.count;
+    values[i] = (count >= kMinSampleCount) ? count : 0;
+  }
+  uint32_t window = std::min(kSegmentSize, end - start) - kKmerSize + 1;
+  uint64_t score = 0;
+  for (uint32_t i = 0; i < kmer_count; i++) {
+    score += values[i];
+    if (i >= window)
+      score -= values[i - window];
+    if (i + 1 >= window && score > best.score) {
+      best.start = start + i + 1 - window;
+      best.end = best.start + window + kKmerSize - 1;
+      best.score = score;
+    }
+  }
+  return best;
+}
+
+void DictionaryTrainer::Impl::clear_kmers(const Segment &segment, KmerIndex *index) {
+  for (uint32_t i = segment.start; i + kKmerSize <= segment.end; i++) {
+    auto entry = index->find(kmer_at(segment.sample, i));
+    if (entry != index->end())
+      entry->second.count = 0;
+  }
+}
+
+std::string DictionaryTrainer::Impl::train(uint32_t max_size) {
+  std::vector<Region> regions = find_expensive_regions();
+  KmerIndex index;
+  index_kmers(regions, &index);
+
+  // Split the expensive bytes into epochs and pick the best segment from
+  // each, the way zstd's cover algorithm does, so the dictionary draws on
+  // the whole corpus rather than just the start.
+  uint64_t total_size = 0;
+  for (auto it = regions.begin(); it != regions.end(); it++)
+    total_size += it->end - it->start;
+  uint32_t epoch_count = std::max<uint32_t>(max_size / kSegmentSize, 1);
+  uint64_t epoch_size = std::max<uint64_t>(total_size / epoch_count, kSegmentSize);
+  std::vector<Segment> segments;
+  uint64_t offset = 0;
+  auto region = regions.begin();
+  while (region != regions.end()) {
+    uint64_t epoch_end = offset + epoch_size;
+    Segment best = {0, 0, 0, 0};
+    while (region != regions.end() && offset < epoch_end) {
+      // Clip the region to the part that falls within this epoch.
+      uint64_t region_offset = offset;
+      uint32_t region_size = region->end - region->start;
+      uint32_t clip_start = region->start;
+      uint32_t clip_end = region->end;
+      if (region_offset + region_size > epoch_end) {
+        clip_end = region->start + static_cast<uint32_t>(epoch_end - region_offset);
+        if (clip_end - clip_start < kSegmentSize)
+          clip_end = std::min(clip_start + kSegmentSize, region->end);
+      }
+      Segment candidate = best_segment(*region, clip_start, clip_end, index);
+      if (candidate.score > best.score)
+        best = candidate;
+      offset += clip_end - clip_start;
+      if (clip_end == region->end) {
+        region++;
+      } else {
+        // Leave the rest of the region for the next epoch.
+        Region rest = {region->sample, clip_end, region->end};
+        *region = rest;
+      }
+    }
+    if (best.score >= kMinSegmentScore) {
+      // Clear the k-mers that are now covered so they're not selected again.
+      clear_kmers(best, &index);
+      segments.push_back(best);
+    }
+  }
+
+  // Keep the most valuable segments that fit and place them in order of
+  // increasing value so the best ones end up closest to the data.
+  std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) {
+    return a.score > b.score;
+  });
+  std::vector<std::string> parts;
+  uint32_t size = 0;
+  for (auto it = segments.begin(); it != segments.end() && size < max_size; it++) {
+    uint32_t length = std::min(it->end - it->start, max_size - size);
+    // If the segment has to be truncated drop the start rather than the end.
+    uint32_t start = it->end - length;
+    parts.push_back(samples_[it->sample].substr(start, length));
+    size += length;
+  }
+  std::string result;
+  for (auto it = parts.rbegin(); it != parts.rend(); it++)
+    result += *it;
+  return result;
+}
+
+DictionarySavings DictionaryTrainer::Impl::evaluate(const std::string &dictionary) {
+  Array<const uint8_t> dict(reinterpret_cast<const uint8_t*>(dictionary.data()),
+      dictionary.size());
+  uint32_t count = samples_.size();
+  std::vector<DictionarySavings> savings(count);
+  parallel_for(count, [&](uint32_t sample) {
+    DictionarySavings &result = savings[sample];
+    memset(&result, 0, sizeof(result));
+    Array<const uint8_t> data(sample_bytes(sample), samples_[sample].size());
+    Compressor::Output *plain = compressor_.compress(data);
+    Compressor::Output *primed = compressor_.compress_with_dictionary(data, dict);
+    if (plain != NULL && primed != NULL) {
+      DeflateProfile plain_profile = Profiler::profile_deflated(plain->contents());
+      DeflateProfile primed_profile = Profiler::profile_deflated(primed->contents(), dict);
+      result.sample_count = 1;
+      result.inflated_size = data.size();
+      result.deflated_size = plain_profile.deflated_size();
+      result.dictionary_deflated_size = primed_profile.deflated_size();
+      result.literal_count = plain_profile.literal_count();
+      result.dictionary_literal_count = primed_profile.literal_count();
+    }
+    delete plain;
+    delete primed;
+  });
+  DictionarySavings total;
+  memset(&total, 0, sizeof(total));
+  for (auto it = savings.begin(); it != savings.end(); it++) {
+    total.sample_count += it->sample_count;
+    total.inflated_size += it->inflated_size;
+    total.deflated_size += it->deflated_size;
+    total.dictionary_deflated_size += it->dictionary_deflated_size;
+    total.literal_count += it->literal_count;
+    total.dictionary_literal_count += it->dictionary_literal_count;
+  }
+  return total;
+}
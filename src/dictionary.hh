@@ -0,0 +1,94 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#pragma once
+
+#include "utils.hh"
+#include "zipprof.h"
+
+#include <unordered_map>
+#include <vector>
+
+namespace zipprof {
+
+class DictionaryTrainer::Impl {
+public:
+  Impl(const Compressor &compressor);
+
+  void add_sample(Array<const uint8_t> data);
+  uint32_t sample_count() { return samples_.size(); }
+  std::string train(uint32_t max_size);
+  DictionarySavings evaluate(const std::string &dictionary);
+
+  // Substrings are indexed by their first kKmerSize bytes. Must be at most 8
+  // so a k-mer fits in a 64-bit key.
+  static const uint32_t kKmerSize = 6;
+
+  // The length of the substrings the dictionary is built from.
+  static const uint32_t kSegmentSize = 64;
+
+  // Bytes whose literal contribution is at least this are considered
+  // expensive; they were encoded as literals that were copied at most once.
+  static constexpr double kExpensiveContribution = 0.5;
+
+  // Expensive regions extend across gaps of up to this many cheap bytes.
+  static const uint32_t kMaxGap = 8;
+
+  // The number of different samples a substring has to occur in before it's
+  // worth including in the dictionary.
+  static const uint32_t kMinSampleCount = 2;
+
+  // Segments that score lower than this are mostly made up of k-mers that
+  // only occur in a few samples by coincidence.
+  static const uint32_t kMinSegmentScore = 64;
+
+private:
+  // A run of expensive bytes within a sample.
+  struct Region {
+    uint32_t sample;
+    uint32_t start;
+    uint32_t end;
+  };
+
+  // A substring of a sample selected for the dictionary.
+  struct Segment {
+    uint32_t sample;
+    uint32_t start;
+    uint32_t end;
+    uint64_t score;
+  };
+
+  // The number of samples a k-mer has been seen in.
+  struct KmerCount {
+    uint32_t count;
+    uint32_t last_sample;
+  };
+
+  typedef std::unordered_map<uint64_t, KmerCount> KmerIndex;
+
+  // Profiles all the samples in parallel and returns the expensive regions.
+  std::vector<Region> find_expensive_regions();
+
+  // Records the k-mers within the given regions in the index.
+  void index_kmers(const std::vector<Region> &regions, KmerIndex *index);
+
+  // Returns the best segment within the given range of a region, or a
+  // segment with a score of 0 if there is none.
+  Segment best_segment(const Region &region, uint32_t start, uint32_t end,
+      const KmerIndex &index);
+
+  // Clears the k-mers covered by the segment from the index.
+  void clear_kmers(const Segment &segment, KmerIndex *index);
+
+  // Returns the k-mer at the given offset within a sample.
+  uint64_t kmer_at(uint32_t sample, uint32_t offset);
+
+  const uint8_t *sample_bytes(uint32_t sample) {
+    return reinterpret_cast<const uint8_t*>(samples_[sample].data());
+  }
+
+  const Compressor &compressor_;
+  std::vector<std::string> samples_;
+};
+
+} // namespace zipprof
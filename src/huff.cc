@@ -9,51 +9,356 @@
 using namespace zipprof;
 using namespace zipprof::impl;
 
-HuffNode::HuffNode()
-    : is_leaf_(true)
-    , index_(0)
-    , leaf_value_(0) { }
-
-HuffNode::HuffNode(uint32_t index, uint32_t value)
-    : is_leaf_(true)
-    , index_(index)
-    , leaf_value_(value) { }
-
-HuffNode::HuffNode(uint32_t index, HuffNode left, HuffNode right)
-    : is_leaf_(false)
-    , index_(index)
-    , branch_left_(left.index_)
-    , branch_right_(right.index_) { }
-
-template <typename... As>
-HuffNode HuffCode::new_huff_node(As... as) {
-  uint32_t index = node_pool_.size();
-  HuffNode result(index, as...);
-  node_pool_.push_back(result);
-  return node(index);
-}
-
-HuffNode HuffCode::new_code_tree(array<uint32_t> table) {
-  std::vector<HuffNode> *nodes = new std::vector<HuffNode>();
-  for (int32_t sil = 15; sil >= 0; sil--) {
-    uint32_t il = static_cast<uint32_t>(sil);
-    std::vector<HuffNode> *new_nodes = new std::vector<HuffNode>();
-    if (il > 0) {
-      for (uint32_t ie = 0; ie < table.size(); ie++) {
-        if (table[ie] == il)
-          new_nodes->push_back(new_huff_node(ie));
+constexpr uint32_t FixedHuffman::kLitLenBits;
+constexpr uint32_t FixedHuffman::kDistBits;
+constexpr HuffTable<1 << FixedHuffman::kLitLenBits> FixedHuffman::kLitLen;
+constexpr HuffTable<1 << FixedHuffman::kDistBits> FixedHuffman::kDist;
+constexpr HuffTable<288> DeflateSymbols::kLitLen;
+constexpr HuffTable<32> DeflateSymbols::kDist;
+
+// The all-zero code is end-of-block, 0b00110000 is literal 0, 0b110010000
+// literal 144 and 0b11000000 symbol 280, length 115 plus 4 extra bits.
+static_assert(FixedHuffman::kLitLen.entries[0] == huff_entry(0, 7, kHuffEnd), "bad fixed table");
+static_assert(FixedHuffman::kLitLen.entries[0x0C] == huff_entry(0, 8), "bad fixed table");
+static_assert(FixedHuffman::kLitLen.entries[0x013] == huff_entry(144, 9), "bad fixed table");
+static_assert(FixedHuffman::kLitLen.entries[0x03] == huff_entry(115, 8, kHuffLength | (4 << 8)),
+    "bad fixed table");
+static_assert(FixedHuffman::kDist.entries[0x10] == huff_entry(2, 5), "bad fixed table");
+
+// Spot checks of the bases and extra bits against RFC 1951.
+static_assert(DeflateSymbols::kLitLen.entries[257] == huff_base_entry(3, 0, kHuffLength),
+    "bad length symbol");
+static_assert(DeflateSymbols::kLitLen.entries[265] == huff_base_entry(11, 1, kHuffLength),
+    "bad length symbol");
+static_assert(DeflateSymbols::kLitLen.entries[284] == huff_base_entry(227, 5, kHuffLength),
+    "bad length symbol");
+static_assert(DeflateSymbols::kLitLen.entries[285] == huff_base_entry(258, 0, kHuffLength),
+    "bad length symbol");
+static_assert((DeflateSymbols::kLitLen.entries[286] & kHuffInvalid) != 0, "bad length symbol");
+static_assert(DeflateSymbols::kDist.entries[4] == huff_base_entry(5, 1), "bad distance symbol");
+static_assert(DeflateSymbols::kDist.entries[29] == huff_base_entry(24577, 13),
+    "bad distance symbol");
+static_assert((DeflateSymbols::kDist.entries[30] & kHuffInvalid) != 0, "bad distance symbol");
+
+const uint32_t CodeTable::kLitLenRootBits;
+const uint32_t CodeTable::kLitLenCapacity;
+const uint32_t CodeTable::kDistRootBits;
+const uint32_t CodeTable::kDistCapacity;
+const uint32_t CodeTable::kCodeLenRootBits;
+const uint32_t CodeTable::kCodeLenCapacity;
+const uint32_t CodeTable::kMaxCodeLength;
+
+template <uint32_t... Is>
+constexpr HuffTable<sizeof...(Is)> make_reversed_bytes(IndexList<Is...>) {
+  return {{reverse_bits(Is, 8)...}};
+}
+
+static constexpr HuffTable<256> kReversedBytes = make_reversed_bytes(MakeIndices<256>::Type());
+
+// Returns the entry, less the code length, of the given symbol.
+static inline uint32_t symbol_entry(const uint32_t *symbols, uint32_t symbol) {
+  return (symbols == NULL) ? huff_entry(symbol, 0) : symbols[symbol];
+}
+
+// Reverses the order of the lowest len bits of a code of up to 16 bits.
+static inline uint32_t reverse_code(uint32_t code, uint32_t len) {
+  uint32_t reversed = (kReversedBytes.entries[code & 0xFF] << 8)
+      | kReversedBytes.entries[(code >> 8) & 0xFF];
+  return reversed >> (16 - len);
+}
+
+bool CodeTable::build(array<uint32_t> lengths, uint32_t root_bits,
+    array<uint32_t> storage, const uint32_t *symbols) {
+  static const uint32_t kMaxSymbols = 320;
+  uint32_t root_size = 1 << root_bits;
+  uint32_t symbol_count = lengths.size();
+  if (storage.size() < root_size || symbol_count > kMaxSymbols)
+    return false;
+  entries_ = storage;
+  root_bits_ = root_bits;
+  size_ = root_size;
+
+  // Count the codes of each length. Counting into several tables keeps runs
+  // of equal lengths from waiting on each other's increments.
+  const uint32_t *lens = lengths.begin();
+  uint32_t partial[4][kMaxCodeLength + 1];
+  memset(partial, 0, sizeof(partial));
+  uint32_t all_lengths = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= symbol_count; i += 4) {
+    all_lengths |= lens[i] | lens[i + 1] | lens[i + 2] | lens[i + 3];
+    if (all_lengths > kMaxCodeLength)
+      return false;
+    partial[0][lens[i]]++;
+    partial[1][lens[i + 1]]++;
+    partial[2][lens[i + 2]]++;
+    partial[3][lens[i + 3]]++;
+  }
+  for (; i < symbol_count; i++) {
+    if (lens[i] > kMaxCodeLength)
+      return false;
+    partial[0][lens[i]]++;
+  }
+  uint32_t count[kMaxCodeLength + 1];
+  for (uint32_t len = 0; len <= kMaxCodeLength; len++)
+    count[len] = partial[0][len] + partial[1][len] + partial[2][len] + partial[3][len];
+
+  // Check that the codes fit and find the first code of each length.
+  uint32_t next_code[kMaxCodeLength + 1];
+  uint32_t offsets[kMaxCodeLength + 1];
+  int32_t left = 1;
+  next_code[0] = 0;
+  offsets[0] = 0;
+  count[0] = 0;
+  for (uint32_t len = 1; len <= kMaxCodeLength; len++) {
+    left = (left << 1) - static_cast<int32_t>(count[len]);
+    if (left < 0)
+      return false;
+    next_code[len] = (next_code[len - 1] + count[len - 1]) << 1;
+    offsets[len] = offsets[len - 1] + count[len - 1];
+  }
+  bool complete = (left == 0);
+
+  // Sort the symbols by code length, then by value, which is the order their
+  // canonical codes are assigned in.
+  uint16_t sorted[kMaxSymbols];
+  uint32_t cursors[kMaxCodeLength + 1];
+  memcpy(cursors, offsets, sizeof(cursors));
+  for (i = 0; i < symbol_count; i++) {
+    if (lens[i] != 0)
+      sorted[cursors[lens[i]]++] = i;
+  }
+
+  // Codes that fit in the root are assigned shortest first. Before moving to
+  // a longer length the entries filled so far are doubled, which repeats each
+  // shorter code everywhere its bits appear as a prefix, so each code only
+  // has to be written once. Anything never written stays invalid.
+  uint32_t *entries = storage.begin();
+  uint32_t filled = 1;
+  entries[0] = huff_entry(0, 0, kHuffInvalid);
+  uint32_t short_len = std::min(root_bits, kMaxCodeLength);
+  for (uint32_t len = 1; len <= short_len; len++) {
+    for (; filled < (1u << len); filled <<= 1)
+      memcpy(entries + filled, entries, filled * sizeof(uint32_t));
+    uint32_t code = next_code[len];
+    uint32_t end = offsets[len] + count[len];
+    for (i = offsets[len]; i < end; i++, code++)
+      entries[reverse_code(code, len)] = symbol_entry(symbols, sorted[i]) | len;
+  }
+  for (; filled < root_size; filled <<= 1)
+    memcpy(entries + filled, entries, filled * sizeof(uint32_t));
+
+  // Longer codes go into a subtable per root prefix, sized to hold the codes
+  // that remain under that prefix.
+  uint32_t prefix = static_cast<uint32_t>(-1);
+  uint32_t sub_offset = 0;
+  uint32_t sub_bits = 0;
+  for (uint32_t len = short_len + 1; len <= kMaxCodeLength; len++) {
+    uint32_t end = offsets[len] + count[len];
+    for (i = offsets[len]; i < end; i++) {
+      uint32_t reversed = reverse_code(next_code[len]++, len);
+      uint32_t low = reversed & (root_size - 1);
+      if (low != prefix) {
+        sub_bits = len - root_bits;
+        int32_t sub_left = 1 << sub_bits;
+        while (sub_bits + root_bits < kMaxCodeLength) {
+          sub_left -= count[sub_bits + root_bits];
+          if (sub_left <= 0)
+            break;
+          sub_bits++;
+          sub_left <<= 1;
+        }
+        sub_offset = size_;
+        size_ += (1 << sub_bits);
+        if (size_ > storage.size())
+          return false;
+        if (!complete)
+          storage.slice(sub_offset, size_).fill(huff_entry(0, 0, kHuffInvalid));
+        entries[low] = huff_subtable_entry(sub_offset, root_bits, sub_bits);
+        prefix = low;
       }
+      uint32_t sub_len = len - root_bits;
+      for (uint32_t index = reversed >> root_bits; index < (1u << sub_bits);
+          index += (1 << sub_len))
+        entries[sub_offset + index] = symbol_entry(symbols, sorted[i]) | sub_len;
+      count[len]--;
     }
-    for (uint32_t in = 0; in < nodes->size(); in += 2)
-      new_nodes->push_back(new_huff_node(nodes->at(in), nodes->at(in + 1)));
-    delete nodes;
-    nodes = new_nodes;
   }
-  HuffNode root = nodes->at(0);
-  delete nodes;
-  return node(root.index());
+  return true;
 }
 
-HuffCode::HuffCode() { }
+const uint32_t CanonicalCode::kPeekBits;
+
+bool CanonicalCode::build(array<uint32_t> lengths, array<uint32_t> storage,
+    const uint32_t *symbols) {
+  uint32_t symbol_count = lengths.size();
+  if (storage.size() < symbol_count)
+    return false;
+  symbols_ = storage;
+  memset(counts_, 0, sizeof(counts_));
+  for (uint32_t i = 0; i < symbol_count; i++) {
+    if (lengths[i] > CodeTable::kMaxCodeLength)
+      return false;
+    counts_[lengths[i]]++;
+  }
+  counts_[0] = 0;
+  uint32_t offsets[CodeTable::kMaxCodeLength + 1];
+  int32_t left = 1;
+  offsets[0] = 0;
+  for (uint32_t len = 1; len <= CodeTable::kMaxCodeLength; len++) {
+    left = (left << 1) - counts_[len];
+    if (left < 0)
+      return false;
+    offsets[len] = offsets[len - 1] + counts_[len - 1];
+  }
+  for (uint32_t i = 0; i < symbol_count; i++) {
+    if (lengths[i] != 0)
+      storage[offsets[lengths[i]]++] = symbol_entry(symbols, i);
+  }
+  return true;
+}
 
-HuffCode::~HuffCode() { }
+void LiteralTable::build(CodeTable &lit_len, array<uint64_t> storage) {
+  root_bits_ = lit_len.root_bits();
+  uint32_t count = 1 << root_bits_;
+  entries_ = storage.slice(0, count);
+  const uint32_t *codes = lit_len.entries();
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t entry = 0;
+    uint32_t literals = 0;
+    uint32_t index = i;
+    uint32_t remaining = root_bits_;
+    // Once the first codes are consumed only the remaining low bits of the
+    // index are known but any root entry whose code fits within them is
+    // replicated over all the unknown high bits, so looking up the remaining
+    // bits padded with zeros finds it.
+    while (literals < kMaxLiteralRun) {
+      uint32_t code = codes[index];
+      uint32_t length = huff_entry_length(code);
+      if ((code & (kHuffSubtable | kHuffInvalid | kHuffLength | kHuffEnd)) != 0
+          || length > remaining)
+        break;
+      entry |= static_cast<uint64_t>(huff_entry_value(code)) << (literals << 3);
+      entry |= static_cast<uint64_t>(length) << (24 + (literals << 2));
+      literals++;
+      index >>= length;
+      remaining -= length;
+    }
+    if (literals == 0) {
+      entries_[i] = codes[i];
+    } else {
+      entries_[i] = entry
+          | (static_cast<uint64_t>(literals) << 36)
+          | (static_cast<uint64_t>(root_bits_ - remaining) << 40);
+    }
+  }
+}
+
+const uint32_t CodeTableCache::kSlotCount;
+const uint32_t CodeTableCache::kMaxLengthCount;
+
+CodeTableCache::CodeTableCache()
+    : slots_(NULL)
+    , clock_(0)
+    , hits_(0)
+    , misses_(0) { }
+
+CodeTableCache::~CodeTableCache() {
+  delete[] slots_;
+}
+
+uint64_t CodeTableCache::hash_lengths(array<uint32_t> lengths, uint32_t lit_len_count) {
+  // FNV-1a over the lengths, each of which fits in a nibble.
+  uint64_t hash = 0xcbf29ce484222325ULL ^ lit_len_count;
+  for (uint32_t i = 0; i < lengths.size(); i++)
+    hash = (hash ^ lengths[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+bool CodeTableCache::lookup(array<uint32_t> lengths, uint32_t lit_len_count,
+    CodeTable **lit_len_out, CodeTable **dist_out, LiteralTable **literals_out) {
+  return find(lengths, lit_len_count, lit_len_out, dist_out, literals_out)
+      || build(lengths, lit_len_count, lit_len_out, dist_out, literals_out);
+}
+
+bool CodeTableCache::find(array<uint32_t> lengths, uint32_t lit_len_count,
+    CodeTable **lit_len_out, CodeTable **dist_out, LiteralTable **literals_out) {
+  if (slots_ == NULL)
+    return false;
+  Slot *slot = find_slot(lengths, lit_len_count, hash_lengths(lengths, lit_len_count));
+  if (slot == NULL)
+    return false;
+  hits_++;
+  slot->last_use = ++clock_;
+  fill_result(slot, lit_len_out, dist_out, literals_out);
+  return true;
+}
+
+CodeTableCache::Slot *CodeTableCache::find_slot(array<uint32_t> lengths,
+    uint32_t lit_len_count, uint64_t hash) {
+  for (uint32_t i = 0; i < kSlotCount; i++) {
+    Slot *slot = &slots_[i];
+    if (!slot->valid || slot->hash != hash || slot->lit_len_count != lit_len_count
+        || slot->length_count != lengths.size())
+      continue;
+    bool equal = true;
+    for (uint32_t j = 0; j < lengths.size() && equal; j++)
+      equal = (slot->lengths[j] == lengths[j]);
+    if (equal)
+      return slot;
+  }
+  return NULL;
+}
+
+bool CodeTableCache::build(array<uint32_t> lengths, uint32_t lit_len_count,
+    CodeTable **lit_len_out, CodeTable **dist_out, LiteralTable **literals_out) {
+  if (lengths.size() > kMaxLengthCount || lit_len_count > lengths.size())
+    return false;
+  if (slots_ == NULL) {
+    slots_ = new Slot[kSlotCount];
+    for (uint32_t i = 0; i < kSlotCount; i++)
+      slots_[i].valid = false;
+  }
+  misses_++;
+
+  // Build the tables into an empty slot or else the least recently used one.
+  Slot *victim = &slots_[0];
+  for (uint32_t i = 0; i < kSlotCount && victim->valid; i++) {
+    Slot *slot = &slots_[i];
+    if (!slot->valid || slot->last_use < victim->last_use)
+      victim = slot;
+  }
+  victim->valid = false;
+  array<uint32_t> lit_len_storage(victim->lit_len_storage, CodeTable::kLitLenCapacity);
+  array<uint32_t> dist_storage(victim->dist_storage, CodeTable::kDistCapacity);
+  if (!victim->lit_len.build(lengths.slice(0, lit_len_count),
+      CodeTable::kLitLenRootBits, lit_len_storage, DeflateSymbols::kLitLen.entries))
+    return false;
+  if (!victim->dist.build(lengths.slice(lit_len_count),
+      CodeTable::kDistRootBits, dist_storage, DeflateSymbols::kDist.entries))
+    return false;
+  victim->valid = true;
+  victim->has_literals = false;
+  victim->hash = hash_lengths(lengths, lit_len_count);
+  victim->last_use = ++clock_;
+  victim->lit_len_count = lit_len_count;
+  victim->length_count = lengths.size();
+  for (uint32_t j = 0; j < lengths.size(); j++)
+    victim->lengths[j] = static_cast<uint8_t>(lengths[j]);
+  fill_result(victim, lit_len_out, dist_out, literals_out);
+  return true;
+}
+
+void CodeTableCache::fill_result(Slot *slot, CodeTable **lit_len_out,
+    CodeTable **dist_out, LiteralTable **literals_out) {
+  *lit_len_out = &slot->lit_len;
+  *dist_out = &slot->dist;
+  if (literals_out == NULL)
+    return;
+  if (!slot->has_literals) {
+    array<uint64_t> storage(slot->literal_storage, 1 << CodeTable::kLitLenRootBits);
+    slot->literals.build(slot->lit_len, storage);
+    slot->has_literals = true;
+  }
+  *literals_out = &slot->literals;
+}
@@ -5,71 +5,355 @@
 
 #include "utils.hh"
 
-#include <vector>
-
 namespace zipprof {
 namespace impl {
 
-class HuffCode;
+// Huffman decode tables are indexed by the next bits of input, first bit in
+// the least significant position, and each entry holds the symbol those bits
+// start with and the length of its code. Codes longer than the table's index
+// are resolved through a subtable, in which case the entry holds the offset of
+// the subtable, the number of bits to index it with and, as its length, the
+// number of bits to consume before indexing it.
+static const uint32_t kHuffSubtable = 0x8000;
+// Marks entries that no code starts with.
+static const uint32_t kHuffInvalid = 0x4000;
+// In literal/length tables, marks the entries of length symbols and the end of
+// block symbol. Length and distance entries hold the base value of the symbol
+// rather than the symbol itself and, in the same bits subtable entries use for
+// their index bits, the number of extra bits that follow the code.
+static const uint32_t kHuffLength = 0x2000;
+static const uint32_t kHuffEnd = 0x1000;
+
+constexpr uint32_t huff_entry(uint32_t value, uint32_t length, uint32_t flags = 0) {
+  return (value << 16) | flags | length;
+}
+
+constexpr uint32_t huff_subtable_entry(uint32_t offset, uint32_t root_bits,
+    uint32_t sub_bits) {
+  return huff_entry(offset, root_bits, kHuffSubtable | (sub_bits << 8));
+}
+
+constexpr uint32_t huff_entry_value(uint32_t entry) { return entry >> 16; }
+
+constexpr uint32_t huff_entry_length(uint32_t entry) { return entry & 0xFF; }
+
+constexpr uint32_t huff_entry_sub_bits(uint32_t entry) { return (entry >> 8) & 0xF; }
 
-// A node in a huffman code tree.
-class HuffNode {
+constexpr uint32_t huff_entry_extra_bits(uint32_t entry) { return (entry >> 8) & 0xF; }
+
+constexpr uint32_t huff_base_entry(uint32_t base, uint32_t extra_bits, uint32_t flags = 0) {
+  return huff_entry(base, 0, flags | (extra_bits << 8));
+}
+
+// Returns the entry, less the code length, for the given literal/length
+// symbol. The bases and extra bits are from RFC 1951 section 3.2.5.
+constexpr uint32_t lit_len_symbol_entry(uint32_t symbol) {
+  return (symbol < 256) ? huff_entry(symbol, 0)
+      : (symbol == 256) ? huff_entry(0, 0, kHuffEnd)
+      : (symbol <= 264) ? huff_base_entry(symbol - 254, 0, kHuffLength)
+      : (symbol <= 284) ? huff_base_entry(
+          ((((symbol - 265) & 0x3) + 4) << ((symbol - 261) >> 2)) + 3,
+          (symbol - 261) >> 2, kHuffLength)
+      : (symbol == 285) ? huff_base_entry(258, 0, kHuffLength)
+      : huff_entry(0, 0, kHuffInvalid);
+}
+
+// Returns the entry, less the code length, for the given distance symbol.
+constexpr uint32_t dist_symbol_entry(uint32_t symbol) {
+  return (symbol <= 3) ? huff_base_entry(symbol + 1, 0)
+      : (symbol <= 29) ? huff_base_entry((((symbol & 1) + 2) << ((symbol >> 1) - 1)) + 1,
+          (symbol >> 1) - 1)
+      : huff_entry(0, 0, kHuffInvalid);
+}
+
+// A decode table for the canonical huffman code given by a table of code
+// lengths, built into storage provided by the caller.
+class CodeTable {
 public:
-  // Creates a branch node.
-  HuffNode(uint32_t index, HuffNode left, HuffNode right);
+  // The number of index bits and the worst case number of entries, including
+  // subtables, for each of deflate's codes.
+  static const uint32_t kLitLenRootBits = 10;
+  static const uint32_t kLitLenCapacity = 1334;
+  static const uint32_t kDistRootBits = 8;
+  static const uint32_t kDistCapacity = 402;
+  static const uint32_t kCodeLenRootBits = 7;
+  static const uint32_t kCodeLenCapacity = 128;
 
-  // Creates a leaf node.
-  HuffNode(uint32_t index, uint32_t value);
+  static const uint32_t kMaxCodeLength = 15;
 
-  // Creates an empty node.
-  HuffNode();
+  CodeTable() : root_bits_(0), size_(0) { }
 
-  bool is_leaf() { return is_leaf_; }
-  bool is_branch() { return !is_leaf_; }
-  uint16_t index() { return index_; }
-  inline HuffNode branch_left(HuffCode *code);
-  inline HuffNode branch_right(HuffCode *code);
-  uint16_t leaf_value() { return leaf_value_; }
+  // Builds the table from the given code lengths, where a length of zero means
+  // the symbol is unused. Returns false if the lengths don't describe a valid
+  // prefix code or the storage is too small. Incomplete codes are allowed;
+  // their unused entries are marked invalid. If symbols is non-NULL each
+  // symbol's entry is taken from it, otherwise it holds the symbol itself.
+  bool build(array<uint32_t> lengths, uint32_t root_bits, array<uint32_t> storage,
+      const uint32_t *symbols = NULL);
+
+  const uint32_t *entries() { return entries_.begin(); }
+  uint32_t root_bits() { return root_bits_; }
+
+  // The number of entries in use, including subtables.
+  uint32_t size() { return size_; }
 
 private:
-  bool is_leaf_;
-  uint16_t index_;
-  union {
-    struct {
-      uint16_t branch_left_;
-      uint16_t branch_right_;
-    };
-    uint16_t leaf_value_;
-  };
+  array<uint32_t> entries_;
+  uint32_t root_bits_;
+  uint32_t size_;
 };
 
-// A container of huffman tree nodes that takes care of disposing them when
-// a block has been decoded.
-class HuffCode {
+// A canonical huffman code that is decoded by walking the code one length at
+// a time, as zlib's puff does, rather than through a table. Building it takes
+// only a count and a sort of the symbols so for blocks with few symbols it's
+// cheaper overall than building a table, even though each decode is slower.
+class CanonicalCode {
 public:
-  HuffCode();
-  ~HuffCode();
+  // The number of bits find needs to be given.
+  static const uint32_t kPeekBits = CodeTable::kMaxCodeLength;
 
-  // Returns a huff tree based on the given table of lengths.
-  HuffNode new_code_tree(array<uint32_t> table);
+  CanonicalCode() { memset(counts_, 0, sizeof(counts_)); }
 
-  inline HuffNode node(uint32_t index) { return node_pool_[index]; }
+  // Builds the code from the given code lengths, keeping the symbols in
+  // storage which must have room for one entry per length. Accepts the same
+  // codes as CodeTable::build and takes the symbols' entries from symbols in
+  // the same way.
+  bool build(array<uint32_t> lengths, array<uint32_t> storage,
+      const uint32_t *symbols = NULL);
 
-  template <typename... As>
-  HuffNode new_huff_node(As... as);
+  // Returns the entry of the code the given kPeekBits bits of input start
+  // with, first bit in the least significant position, with the code's length
+  // as its length. Returns an invalid entry if no code matches.
+  inline uint32_t find(uint32_t bits);
 
 private:
+  // The number of codes of each length.
+  uint16_t counts_[CodeTable::kMaxCodeLength + 1];
+  // The entries of the symbols in the order their codes are assigned.
+  array<uint32_t> symbols_;
+};
 
-  std::vector<HuffNode> node_pool_;
+uint32_t CanonicalCode::find(uint32_t bits) {
+  // The codes of each length are consecutive and start right after the
+  // shorter codes, doubled, so a code can be identified by extending it one
+  // bit at a time until it falls within the range of its length.
+  uint32_t code = 0;
+  uint32_t first = 0;
+  uint32_t index = 0;
+  for (uint32_t len = 1; len <= CodeTable::kMaxCodeLength; len++) {
+    code |= bits & 1;
+    bits >>= 1;
+    uint32_t count = counts_[len];
+    if (code - first < count)
+      return symbols_.begin()[index + code - first] | len;
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return huff_entry(0, 0, kHuffInvalid);
+}
+
+// Entries of a literal table pack up to three literals, the length of each of
+// their codes and how many there are:
+//
+//   bits 0-23   the literals, the first in the lowest byte
+//   bits 24-35  the code length of each literal, four bits each
+//   bits 36-37  the number of literals
+//   bits 40-44  the total length of their codes
+//
+// Entries that don't start with a literal instead hold the root entry of the
+// literal/length table in the low 32 bits so it doesn't have to be looked up
+// again.
+static const uint32_t kMaxLiteralRun = 3;
+
+constexpr uint32_t literal_entry_count(uint64_t entry) {
+  return static_cast<uint32_t>(entry >> 36) & 0x3;
+}
+
+constexpr uint8_t literal_entry_value(uint64_t entry, uint32_t index) {
+  return static_cast<uint8_t>(entry >> (index << 3));
+}
+
+constexpr uint32_t literal_entry_length(uint64_t entry, uint32_t index) {
+  return static_cast<uint32_t>(entry >> (24 + (index << 2))) & 0xF;
+}
+
+constexpr uint32_t literal_entry_code(uint64_t entry) {
+  return static_cast<uint32_t>(entry);
+}
+
+constexpr uint32_t literal_entry_total_length(uint64_t entry) {
+  return static_cast<uint32_t>(entry >> 40) & 0x1F;
+}
+
+// A table indexed like the root of a literal/length table whose entries
+// resolve as many consecutive literals as fit within the index bits, so runs
+// of short literal codes take one lookup rather than one per literal. Symbols
+// other than literals must be decoded through the code table as usual.
+class LiteralTable {
+public:
+  LiteralTable() : root_bits_(0) { }
+
+  // Builds the table from the root of the given literal/length table.
+  void build(CodeTable &lit_len, array<uint64_t> storage);
+
+  const uint64_t *entries() { return entries_.begin(); }
+  uint32_t root_bits() { return root_bits_; }
+
+private:
+  array<uint64_t> entries_;
+  uint32_t root_bits_;
 };
 
-HuffNode HuffNode::branch_left(HuffCode *code) {
-  return code->node(branch_left_);
+// Keeps the literal/length and distance tables of the last few dynamic blocks
+// keyed by their code lengths, so streams that repeat the same code, as
+// flush-heavy producers tend to, don't rebuild it for every block.
+class CodeTableCache {
+public:
+  static const uint32_t kSlotCount = 4;
+  // The most code lengths a dynamic block can have.
+  static const uint32_t kMaxLengthCount = 288 + 32;
+
+  CodeTableCache();
+  ~CodeTableCache();
+
+  // Returns the tables for the given code lengths, the first lit_len_count of
+  // which belong to the literal/length code and the rest to the distance
+  // code, building them if they're not cached. If literals_out is non-NULL
+  // the literal table for the literal/length code is returned too. Returns
+  // false if the lengths don't describe valid codes. The tables stay valid
+  // until the next lookup.
+  bool lookup(array<uint32_t> lengths, uint32_t lit_len_count,
+      CodeTable **lit_len_out, CodeTable **dist_out,
+      LiteralTable **literals_out = NULL);
+
+  // The two halves of lookup: find returns false, without counting a miss,
+  // if the tables aren't cached and build builds them unconditionally. Only
+  // call build after find has failed for the same lengths.
+  bool find(array<uint32_t> lengths, uint32_t lit_len_count,
+      CodeTable **lit_len_out, CodeTable **dist_out,
+      LiteralTable **literals_out = NULL);
+  bool build(array<uint32_t> lengths, uint32_t lit_len_count,
+      CodeTable **lit_len_out, CodeTable **dist_out,
+      LiteralTable **literals_out = NULL);
+
+  uint64_t hits() { return hits_; }
+  uint64_t misses() { return misses_; }
+
+private:
+  struct Slot {
+    bool valid;
+    uint64_t hash;
+    uint64_t last_use;
+    uint32_t lit_len_count;
+    uint32_t length_count;
+    uint8_t lengths[kMaxLengthCount];
+    CodeTable lit_len;
+    CodeTable dist;
+    uint32_t lit_len_storage[CodeTable::kLitLenCapacity];
+    uint32_t dist_storage[CodeTable::kDistCapacity];
+    // The literal table is only built when asked for.
+    bool has_literals;
+    LiteralTable literals;
+    uint64_t literal_storage[1 << CodeTable::kLitLenRootBits];
+  };
+
+  // Returns the slot the given lengths are cached in, or NULL.
+  Slot *find_slot(array<uint32_t> lengths, uint32_t lit_len_count, uint64_t hash);
+
+  void fill_result(Slot *slot, CodeTable **lit_len_out, CodeTable **dist_out,
+      LiteralTable **literals_out);
+
+  static uint64_t hash_lengths(array<uint32_t> lengths, uint32_t lit_len_count);
+
+  // Allocated on the first lookup since many streams never need it.
+  Slot *slots_;
+  uint64_t clock_;
+  uint64_t hits_;
+  uint64_t misses_;
+};
+
+// A list of the indices from 0 to N, for expanding into a table initializer.
+template <uint32_t... Is> struct IndexList { };
+
+template <typename A, typename B> struct ConcatIndices;
+
+template <uint32_t... As, uint32_t... Bs>
+struct ConcatIndices<IndexList<As...>, IndexList<Bs...>> {
+  typedef IndexList<As..., (sizeof...(As) + Bs)...> Type;
+};
+
+template <uint32_t N>
+struct MakeIndices {
+  typedef typename ConcatIndices<typename MakeIndices<N / 2>::Type,
+      typename MakeIndices<N - N / 2>::Type>::Type Type;
+};
+
+template <> struct MakeIndices<0> { typedef IndexList<> Type; };
+template <> struct MakeIndices<1> { typedef IndexList<0> Type; };
+
+template <uint32_t N>
+struct HuffTable {
+  uint32_t entries[N];
+};
+
+// Reverses the order of the lowest count bits of value.
+constexpr uint32_t reverse_bits(uint32_t value, uint32_t count) {
+  return (count == 0)
+      ? 0
+      : (((value & 1) << (count - 1)) | reverse_bits(value >> 1, count - 1));
+}
+
+// Returns the fixed literal/length entry for a code that starts with the given
+// 9 bits, read most significant bit first.
+constexpr uint32_t fixed_lit_len_entry(uint32_t code) {
+  return ((code >> 2) < 24) ? (lit_len_symbol_entry(256 + (code >> 2)) | 7)
+      : ((code >> 1) < 192) ? (lit_len_symbol_entry((code >> 1) - 48) | 8)
+      : ((code >> 1) < 200) ? (lit_len_symbol_entry(280 + (code >> 1) - 192) | 8)
+      : (lit_len_symbol_entry(144 + code - 400) | 9);
+}
+
+template <uint32_t... Is>
+constexpr HuffTable<sizeof...(Is)> make_fixed_lit_len(IndexList<Is...>) {
+  return {{fixed_lit_len_entry(reverse_bits(Is, 9))...}};
+}
+
+template <uint32_t... Is>
+constexpr HuffTable<sizeof...(Is)> make_fixed_dist(IndexList<Is...>) {
+  return {{dist_symbol_entry(reverse_bits(Is, 5)) | 5 ...}};
 }
 
-HuffNode HuffNode::branch_right(HuffCode *code) {
-  return code->node(branch_right_);
+template <uint32_t... Is>
+constexpr HuffTable<sizeof...(Is)> make_lit_len_symbols(IndexList<Is...>) {
+  return {{lit_len_symbol_entry(Is)...}};
 }
 
+template <uint32_t... Is>
+constexpr HuffTable<sizeof...(Is)> make_dist_symbols(IndexList<Is...>) {
+  return {{dist_symbol_entry(Is)...}};
+}
+
+// The entries of deflate's literal/length and distance symbols, to build code
+// tables from.
+class DeflateSymbols {
+public:
+  static constexpr HuffTable<288> kLitLen = make_lit_len_symbols(MakeIndices<288>::Type());
+  static constexpr HuffTable<32> kDist = make_dist_symbols(MakeIndices<32>::Type());
+};
+
+// Decode tables for the fixed huffman code from RFC 1951 section 3.2.6. They
+// are generated at compile time so they're shared by all deflaters and never
+// have to be built.
+class FixedHuffman {
+public:
+  static constexpr uint32_t kLitLenBits = 9;
+  static constexpr uint32_t kDistBits = 5;
+
+  static constexpr HuffTable<1 << kLitLenBits> kLitLen =
+      make_fixed_lit_len(MakeIndices<1 << kLitLenBits>::Type());
+  static constexpr HuffTable<1 << kDistBits> kDist =
+      make_fixed_dist(MakeIndices<1 << kDistBits>::Type());
+};
+
 } // namespace impl
 } // namespace zipprof
@@ -9,56 +9,138 @@
 using namespace zipprof;
 using namespace zipprof::impl;
 
-ArrayBitReader::ArrayBitReader(array<const uint8_t> data)
-  : data_(data)
-  , data_cursor_(static_cast<uint32_t>(-8))
-  , buffer_cursor_(64)
-  , buffer_(0) {
+template <typename R>
+BitReader<R>::BitReader()
+  : data_cursor_(0)
+  , buffer_(0)
+  , buffer_bits_(0) {
 }
 
-uint8_t ArrayBitReader::bit_cursor() {
-  return buffer_cursor_ & 0x7;
-}
+template <typename R>
+const uint32_t BitReader<R>::kFastBits;
 
-void ArrayBitReader::flush_current_byte() {
-  while (bit_cursor() != 0)
-    next_bit();
+template <typename R>
+uint8_t BitReader<R>::bit_cursor() {
+  // Whole bytes are loaded at a time so the bits consumed from the current
+  // byte are what's missing from the buffer to make a multiple of 8.
+  return (8 - (buffer_bits_ & 0x7)) & 0x7;
 }
 
-void ArrayBitReader::fetch_next_block() {
-  uint64_t new_buffer;
-  data_cursor_ += 8;
-  uint32_t cursor = data_cursor_;
-  if ((cursor + 8) <= data_.size()) {
-    new_buffer = reinterpret_cast<const uint64_t*>(data_.begin() + cursor)[0];
-  } else {
-    new_buffer = 0;
-    for (uint32_t i = 0; i < 8; i++, cursor++) {
-      uint64_t byte = (cursor < data_.size()) ? data_[cursor] : 0;
-      new_buffer |= byte << (i << 3);
-    }
+template <typename R>
+void BitReader<R>::refill() {
+  if (reader().has_slack(8)) {
+    refill_fast();
+    return;
+  }
+  array<const uint8_t> data = reader().loaded();
+  while (buffer_bits_ <= kFastBits) {
+    uint64_t byte = (data_cursor_ < data.size()) ? data[data_cursor_] : 0;
+    // Clear any stale bits left above the buffer by an earlier fast refill.
+    buffer_ &= (1ULL << buffer_bits_) - 1;
+    buffer_ |= byte << buffer_bits_;
+    buffer_bits_ += 8;
+    data_cursor_++;
   }
-  buffer_ = new_buffer;
-  buffer_cursor_ = 0;
 }
 
-uint32_t ArrayBitReader::next_word_fallback(uint32_t word_size) {
-  uint32_t result = 0;
-  for (uint32_t i = 0; i < word_size; i++)
-    result = result | (next_bit() << i);
-  return result;
+template <typename R>
+uint32_t BitReader<R>::unload() {
+  ASSERT(bit_cursor() == 0);
+  data_cursor_ -= buffer_bits_ >> 3;
+  buffer_ = 0;
+  buffer_bits_ = 0;
+  return data_cursor_;
 }
 
-uint8_t ArrayBitReader::ensure_aligned() {
+template <typename R>
+uint8_t BitReader<R>::ensure_aligned() {
   if (bit_cursor() != 0) {
     uint8_t result = 7 - bit_cursor();
-    flush_current_byte();
+    skip_bits(8 - bit_cursor());
     return result;
   } else {
     return 0;
   }
 }
 
+template class impl::BitReader<ArrayBitReader>;
+template class impl::BitReader<StreamBitReader>;
+
+ArrayBitReader::ArrayBitReader(array<const uint8_t> data)
+  : data_(data) {
+}
+
+bool ArrayBitReader::next_bytes(uint32_t count, array<const uint8_t> *bytes_out) {
+  // Give back the whole bytes still in the buffer and read from the data.
+  uint32_t start = unload();
+  if (start > data_.size() || count > data_.size() - start)
+    return false;
+  *bytes_out = data_.slice(start, start + count);
+  data_cursor_ = start + count;
+  return true;
+}
+
+StreamBitReader::StreamBitReader(ByteSource &source)
+  : source_(source)
+  , source_ended_(false)
+  , data_(new uint8_t[kBufferSize], kBufferSize)
+  , data_size_(0)
+  , base_(0) {
+}
+
+StreamBitReader::~StreamBitReader() {
+  delete[] data_.begin();
+}
+
+const uint32_t StreamBitReader::kMaxSlack;
+const uint32_t StreamBitReader::kBufferSize;
+
+bool StreamBitReader::fill(uint32_t bytes) {
+  ASSERT(bytes <= kMaxSlack);
+  if (source_ended_)
+    return false;
+  // The whole bytes still in the bit buffer may be given back by next_bytes
+  // so they have to stay, everything before them can go.
+  uint32_t keep = data_cursor_ - (buffer_bits_ >> 3);
+  memmove(data_.begin(), data_.begin() + keep, data_size_ - keep);
+  data_size_ -= keep;
+  data_cursor_ -= keep;
+  base_ += keep;
+  while (data_size_ < data_.size()) {
+    if (pending_.size() == 0) {
+      pending_ = source_.next_chunk();
+      if (pending_.size() == 0) {
+        source_ended_ = true;
+        break;
+      }
+    }
+    size_t count = std::min<size_t>(pending_.size(), data_.size() - data_size_);
+    memcpy(data_.begin() + data_size_, pending_.begin(), count);
+    pending_ = Array<const uint8_t>(pending_.begin() + count, pending_.size() - count);
+    data_size_ += count;
+  }
+  return data_cursor_ + bytes <= data_size_;
+}
+
+bool StreamBitReader::next_bytes(uint32_t count, array<const uint8_t> *bytes_out) {
+  if (unload() > data_size_ || !has_slack(count))
+    return false;
+  *bytes_out = data_.slice(data_cursor_, data_cursor_ + count);
+  data_cursor_ += count;
+  return true;
+}
+
+uint64_t StreamBitReader::drain() {
+  uint64_t size = base_ + data_size_ + pending_.size();
+  pending_ = Array<const uint8_t>();
+  while (!source_ended_) {
+    Array<const uint8_t> chunk = source_.next_chunk();
+    size += chunk.size();
+    source_ended_ = (chunk.size() == 0);
+  }
+  return size;
+}
+
 VectorByteWriter::VectorByteWriter(std::vector<uint8_t> &buf)
     : buf_(buf) { }
 
@@ -70,39 +152,173 @@ void VectorByteWriter::append(uint8_t data, uint32_t size_bits) {
   buf_.push_back(data);
 }
 
+void VectorByteWriter::borrow(uint8_t data, int32_t copy, uint32_t size_bits) {
+  buf_.push_back(data);
+}
+
+const bool ByteWriter::kRetainsOutput;
+const bool ByteWriter::kWholeCopies;
+const bool ProfilingByteWriter::kRetainsOutput;
+
 ProfilingByteWriter::ProfilingByteWriter()
     : bytes_(new ByteStat[1024 * 1024], 1024 * 1024)
+    , contents_(new uint8_t[1024 * 1024], 1024 * 1024)
     , cursor_(0)
-    , literal_count_(0) {
+    , literal_count_(0)
+    , length_sum_(0)
+    , distance_sum_(0) {
+  memset(&match_stats_, 0, sizeof(match_stats_));
 }
 
 ProfilingByteWriter::~ProfilingByteWriter() {
+  delete[] bytes_.begin();
+  delete[] contents_.begin();
 }
 
 void ProfilingByteWriter::grow_buffer() {
   array<ByteStat> old_stats = bytes_;
+  array<uint8_t> old_contents = contents_;
   uint32_t old_size = old_stats.size();
   uint32_t new_size = old_size * 2;
   array<ByteStat> new_stats(new ByteStat[new_size], new_size);
   memcpy(new_stats.begin(), old_stats.begin(), old_size * sizeof(ByteStat));
+  array<uint8_t> new_contents(new uint8_t[new_size], new_size);
+  memcpy(new_contents.begin(), old_contents.begin(), old_size);
   bytes_ = new_stats;
+  contents_ = new_contents;
+  delete[] old_stats.begin();
+  delete[] old_contents.begin();
 }
 
 void ProfilingByteWriter::open_block(uint8_t type) {
-  BlockStat stat = {type};
+  BlockStat stat = {};
+  stat.type = type;
+  stat.literal_count = literal_count_;
+  stat.inflated_offset = cursor_;
   blocks_.push_back(stat);
+  code_length_offsets_.push_back(code_lengths_.size());
+  length_sum_ = 0;
+  distance_sum_ = 0;
 }
 
 void ProfilingByteWriter::close_block(uint32_t bit_count) {
+  BlockStat &stat = blocks_.back();
+  stat.header_bits = bit_count;
+  stat.literal_count = literal_count_ - stat.literal_count;
+  stat.inflated_size = cursor_ - stat.inflated_offset;
+  if (stat.match_count > 0) {
+    stat.mean_match_length = static_cast<double>(length_sum_) / stat.match_count;
+    stat.mean_match_distance = static_cast<double>(distance_sum_) / stat.match_count;
+  }
+}
+
+void ProfilingByteWriter::block_span(uint64_t bit_offset, uint64_t bit_count) {
+  BlockStat &stat = blocks_.back();
+  stat.bit_offset = bit_offset;
+  stat.bit_count = bit_count;
+}
+
+void ProfilingByteWriter::code_lengths(array<const uint32_t> lengths, uint32_t lit_len_count) {
+  for (uint32_t i = 0; i < lengths.size(); i++)
+    code_lengths_.push_back(static_cast<uint8_t>(lengths[i]));
+  BlockStat &stat = blocks_.back();
+  stat.lit_len_lengths = Array<const uint8_t>(NULL, lit_len_count);
+  stat.dist_lengths = Array<const uint8_t>(NULL, lengths.size() - lit_len_count);
 }
 
 DeflateProfile::Impl *ProfilingByteWriter::flush(uint32_t deflated_size) {
   uint32_t inflated_size = cursor_;
   array<ByteStat> bytes(new ByteStat[inflated_size], inflated_size);
   memcpy(bytes.begin(), bytes_.begin(), inflated_size * sizeof(ByteStat));
-  uint32_t block_count = blocks_.size();
-  array<BlockStat> blocks(new BlockStat[block_count], block_count);
-  memcpy(blocks.begin(), blocks_.data(), block_count * sizeof(BlockStat));
-  return new DeflateProfile::Impl(deflated_size, inflated_size, literal_count_,
-      bytes, blocks);
+  array<uint8_t> contents(new uint8_t[inflated_size], inflated_size);
+  memcpy(contents.begin(), contents_.begin(), inflated_size);
+  DeflateProfile::Impl *result = new DeflateProfile::Impl(deflated_size, inflated_size,
+      literal_count_, bytes, contents);
+  result->code_lengths_.swap(code_lengths_);
+  result->block_stats_.swap(blocks_);
+  // The totals are only added up here to keep match cheap.
+  MatchStats &match_stats = result->match_stats_;
+  match_stats = match_stats_;
+  for (uint32_t i = 0; i < MatchStats::kDistanceBucketCount; i++) {
+    match_stats.match_count += match_stats.distance_histogram[i];
+    match_stats.copied_bytes += match_stats.distance_bytes[i];
+  }
+  const uint8_t *lengths = result->code_lengths_.data();
+  for (uint32_t i = 0; i < result->block_stats_.size(); i++) {
+    BlockStat &stat = result->block_stats_[i];
+    uint32_t offset = code_length_offsets_[i];
+    uint32_t lit_len_count = stat.lit_len_lengths.size();
+    stat.lit_len_lengths = Array<const uint8_t>(lengths + offset, lit_len_count);
+    stat.dist_lengths = Array<const uint8_t>(lengths + offset + lit_len_count,
+        stat.dist_lengths.size());
+  }
+  return result;
+}
+
+const uint32_t SummaryByteWriter::kWindowSize;
+const uint16_t SummaryByteWriter::kNoOrigin;
+
+SummaryByteWriter::SummaryByteWriter()
+    : window_(new uint16_t[kWindowSize], kWindowSize)
+    , origins_(new Origin[kWindowSize], kWindowSize)
+    , free_(new uint16_t[kWindowSize], kWindowSize)
+    , free_count_(kWindowSize)
+    , cursor_(0)
+    , literal_count_(0)
+    , block_count_(0) {
+  window_.fill(kNoOrigin);
+  // Hand out the low indices first.
+  for (uint32_t i = 0; i < kWindowSize; i++)
+    free_[i] = kWindowSize - 1 - i;
+  memset(histogram_, 0, sizeof(histogram_));
+}
+
+SummaryByteWriter::~SummaryByteWriter() {
+  delete[] window_.begin();
+  delete[] origins_.begin();
+  delete[] free_.begin();
+}
+
+DeflateSummary SummaryByteWriter::flush(uint64_t deflated_size) {
+  for (uint32_t i = 0; i < kWindowSize; i++) {
+    if (window_[i] != kNoOrigin) {
+      release(window_[i]);
+      window_[i] = kNoOrigin;
+    }
+  }
+  DeflateSummary result;
+  result.deflated_size = deflated_size;
+  result.inflated_size = cursor_;
+  result.literal_count = literal_count_;
+  result.block_count = block_count_;
+  memcpy(result.contribution_histogram, histogram_, sizeof(histogram_));
+  return result;
+}
+
+const bool VisitingByteWriter::kWholeCopies;
+const uint32_t VisitingByteWriter::kBatchSize;
+
+VisitingByteWriter::VisitingByteWriter(ProfileVisitor &visitor)
+    : visitor_(visitor)
+    , cursor_(0)
+    , type_(0)
+    , wants_literals_(visitor.wants_literals())
+    , wants_copies_(visitor.wants_copies())
+    , token_count_(0)
+    , tokens_(new ProfileToken[kBatchSize], kBatchSize) { }
+
+VisitingByteWriter::~VisitingByteWriter() {
+  delete[] tokens_.begin();
+}
+
+void VisitingByteWriter::close_block(uint32_t bit_count) {
+  flush();
+  visitor_.on_block(type_, bit_count);
+}
+
+void VisitingByteWriter::flush() {
+  if (token_count_ > 0) {
+    visitor_.on_tokens(Array<const ProfileToken>(tokens_.begin(), token_count_));
+    token_count_ = 0;
+  }
 }
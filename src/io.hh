@@ -10,11 +10,14 @@
 namespace zipprof {
 namespace impl {
 
-// Bit reader that takes its data from a flat array of bytes.
-class ArrayBitReader {
+// The bit buffer the bit readers share. Bits are loaded into it a byte at a
+// time from the bytes the reader R has loaded so far, which R gives access to
+// through loaded(). R also decides, through has_slack, whether there are
+// enough of those for a fast refill, which it may load more bytes to make
+// true.
+template <typename R>
+class BitReader {
 public:
-  ArrayBitReader(array<const uint8_t> data);
-
   // Returns the current bit offset, from 0 to 7.
   uint8_t bit_cursor();
 
@@ -30,22 +33,120 @@ public:
   inline uint16_t next_short();
   inline uint8_t next_byte();
 
+  // Returns the next width bits, up to 32, without consuming them. Bits past
+  // the end of the data read as zero.
+  inline uint32_t peek_word(uint32_t width);
+
+  // Consumes the given number of bits, up to 32.
+  inline void skip_bits(uint32_t width);
+
   uint8_t ensure_aligned();
 
-private:
-  // Advances to the next byte boundary.
-  void flush_current_byte();
+  // The number of bits refill_fast guarantees are buffered.
+  static const uint32_t kFastBits = 56;
 
-  void fetch_next_block();
+  // Refills the buffer to at least kFastBits bits without checking for the
+  // end of the data. Only valid when has_slack(8) holds.
+  inline void refill_fast();
 
-  uint32_t next_word_fallback(uint32_t word_size);
+  // Like peek_word and skip_bits but never refill, so the caller must know
+  // that the bits are already buffered.
+  inline uint32_t peek_word_fast(uint32_t width);
+  inline void skip_bits_fast(uint32_t width);
 
-  array<const uint8_t> data_;
-  // Index of the beginning of the current buffer.
+protected:
+  BitReader();
+
+  // Refills the buffer to at least kFastBits bits, padding with zeros past the
+  // end of the data.
+  void refill();
+
+  // Returns the position in the loaded bytes of the first whole byte still
+  // in the buffer and empties the buffer, so the reader can go on from there
+  // a byte at a time. Must be on a byte boundary.
+  uint32_t unload();
+
+  // Index of the next byte to load into the buffer. Once past the end of the
+  // data it keeps counting the zero bytes padded in.
   uint32_t data_cursor_;
-  // Index of the next bit in the buffer.
-  uint32_t buffer_cursor_;
+  // The buffered bits, the next one in the least significant position, and
+  // how many of them there are. Bits above that count may hold copies of the
+  // data that follows and are ignored.
   uint64_t buffer_;
+  uint32_t buffer_bits_;
+
+private:
+  R &reader() { return *static_cast<R*>(this); }
+};
+
+// Bit reader that takes its data from a flat array of bytes.
+class ArrayBitReader : public BitReader<ArrayBitReader> {
+public:
+  ArrayBitReader(array<const uint8_t> data);
+
+  // Returns the number of bits consumed since the start of the data.
+  uint64_t bit_offset() { return static_cast<uint64_t>(data_cursor_) * 8 - buffer_bits_; }
+
+  // Reads count whole bytes, which must start on a byte boundary, returning
+  // them directly from the data. Returns false if the data ends first.
+  bool next_bytes(uint32_t count, array<const uint8_t> *bytes_out);
+
+  // Returns true if at least the given number of bytes remain to be loaded
+  // into the buffer.
+  bool has_slack(uint32_t bytes) { return data_cursor_ + bytes <= data_.size(); }
+
+private:
+  friend class BitReader<ArrayBitReader>;
+  array<const uint8_t> loaded() { return data_; }
+
+  array<const uint8_t> data_;
+};
+
+// Bit reader like ArrayBitReader that pulls its data from a ByteSource into a
+// fixed-size buffer, so it never holds more than that much of the input.
+class StreamBitReader : public BitReader<StreamBitReader> {
+public:
+  StreamBitReader(ByteSource &source);
+  ~StreamBitReader();
+
+  uint64_t bit_offset() { return (base_ + data_cursor_) * 8 - buffer_bits_; }
+
+  // Like ArrayBitReader::next_bytes except that the bytes are only valid
+  // until the next read.
+  bool next_bytes(uint32_t count, array<const uint8_t> *bytes_out);
+
+  // Returns true if at least the given number of bytes remain to be loaded
+  // into the buffer, pulling more from the source if necessary. Can't be
+  // more than kMaxSlack.
+  inline bool has_slack(uint32_t bytes);
+
+  // Reads the rest of the source and returns its total size in bytes.
+  uint64_t drain();
+
+  // The most that has_slack can be asked for; enough for a stored block.
+  static const uint32_t kMaxSlack = 64 * 1024;
+
+  // The size of the buffer, which leaves room for a stored block on top of
+  // what is kept around for next_bytes to give back.
+  static const uint32_t kBufferSize = 2 * kMaxSlack;
+
+private:
+  friend class BitReader<StreamBitReader>;
+  array<const uint8_t> loaded() { return data_.slice(0, data_size_); }
+
+  // Moves the data that may still be read to the start of the buffer and
+  // fills the rest from the source. Returns has_slack(bytes).
+  bool fill(uint32_t bytes);
+
+  ByteSource &source_;
+  // The part of the last chunk that didn't fit in the buffer.
+  Array<const uint8_t> pending_;
+  bool source_ended_;
+  array<uint8_t> data_;
+  // The number of valid bytes at the start of data_ and how many bytes of
+  // input came before them.
+  uint32_t data_size_;
+  uint64_t base_;
 };
 
 // Utility for writing output as blocks of bytes.
@@ -59,10 +160,41 @@ public:
   // Append the given literal byte to the output.
   void append(uint8_t data, uint32_t bit_size);
 
+  // Write the given byte of data to the output which has been copied from the
+  // preset dictionary as part of the copy operation with the given serial
+  // number.
+  void borrow(uint8_t data, int32_t copy, uint32_t bit_size);
+
   // Called whenever a new block is encountered.
   void open_block(uint8_t type) { }
 
+  // Called at the end of each block with the bits it took that weren't
+  // reported with any byte.
   void close_block(uint32_t bit_count) { }
+
+  // Called just before close_block with the span of the input the block took
+  // up, in bits from the start.
+  void block_span(uint64_t bit_offset, uint64_t bit_count) { }
+
+  // Called once for each copy, with the position of the first byte copied
+  // to, before the bytes themselves are written.
+  void match(uint64_t pos, uint32_t dist, uint32_t len, uint32_t bit_size) { }
+
+  // Called with the code lengths of each block that has codes of its own, the
+  // literal/length code's followed by the distance code's.
+  void code_lengths(array<const uint32_t> lengths, uint32_t lit_len_count) { }
+
+  // Writers that keep everything written to them set this and implement
+  // history, which returns the byte written at the given position. Copies are
+  // then resolved against the writer's output and the output tracker doesn't
+  // keep a history of its own.
+  static const bool kRetainsOutput = false;
+  uint8_t history(uint32_t pos);
+
+  // Writers that only care about copies as a whole set this and then only
+  // get match, not copy or borrow for each byte. Can't be combined with
+  // kRetainsOutput.
+  static const bool kWholeCopies = false;
 };
 
 class VectorByteWriter : public ByteWriter {
@@ -70,6 +202,7 @@ public:
   VectorByteWriter(std::vector<uint8_t> &buf);
   void copy(uint8_t data, uint32_t source, int32_t copy, uint32_t size_bits);
   void append(uint8_t data, uint32_t size_bits);
+  void borrow(uint8_t data, int32_t copy, uint32_t size_bits);
 
 private:
   std::vector<uint8_t> &buf_;
@@ -84,15 +217,9 @@ struct ByteStat {
   // it was a literal.
   uint32_t copy;
 
-  // How many bits did it take to encode this byte?
+  // How many bits did it take to encode this byte? For copies this is the
+  // bits of the whole copy, see DeflateProfile::bit_cost for a fair share.
   uint32_t bit_size;
-
-  // The literal value of this byte.
-  uint8_t value;
-};
-
-struct BlockStat {
-  uint32_t type;
 };
 
 class ProfilingByteWriter : public ByteWriter {
@@ -101,17 +228,126 @@ public:
   ~ProfilingByteWriter();
   inline void copy(uint8_t data, uint32_t source, uint32_t copy, uint32_t bit_size);
   inline void append(uint8_t data, uint32_t bit_size);
+  inline void borrow(uint8_t data, uint32_t copy, uint32_t bit_size);
   void open_block(uint8_t type);
   void close_block(uint32_t bit_count);
+  void block_span(uint64_t bit_offset, uint64_t bit_count);
+  inline void match(uint64_t pos, uint32_t dist, uint32_t len, uint32_t bit_size);
+  void code_lengths(array<const uint32_t> lengths, uint32_t lit_len_count);
   DeflateProfile::Impl *flush(uint32_t zsize);
+
+  // The contents are kept in a column of their own that copies read from.
+  static const bool kRetainsOutput = true;
+  uint8_t history(uint32_t pos) { return contents_[pos]; }
+
 private:
-  inline void add_stat(const ByteStat &stat);
+  inline void add_stat(const ByteStat &stat, uint8_t value);
   void grow_buffer();
 
   array<ByteStat> bytes_;
+  array<uint8_t> contents_;
   std::vector<BlockStat> blocks_;
+  // The code lengths of all blocks one after the other, and where each
+  // block's start. The block stats only get to point to them once they've
+  // stopped moving.
+  std::vector<uint8_t> code_lengths_;
+  std::vector<uint32_t> code_length_offsets_;
   uint32_t cursor_;
   uint32_t literal_count_;
+  // Totals for the current block that are turned into its stats once it's
+  // closed.
+  uint64_t length_sum_;
+  uint64_t distance_sum_;
+  MatchStats match_stats_;
+};
+
+// Writer that keeps only what it takes to summarize the output: the origin of
+// each byte in the window and how many bytes have come from each of those
+// origins so far. Once no byte in the window comes from an origin nothing
+// more can be copied from it so its weight is final and can be counted. That
+// bounds the state by the size of the window, however long the output.
+class SummaryByteWriter : public ByteWriter {
+public:
+  SummaryByteWriter();
+  ~SummaryByteWriter();
+  inline void copy(uint8_t data, uint32_t source, uint32_t copy, uint32_t bit_size);
+  inline void append(uint8_t data, uint32_t bit_size);
+  inline void borrow(uint8_t data, uint32_t copy, uint32_t bit_size);
+  void open_block(uint8_t type) { block_count_++; }
+  void close_block(uint32_t bit_count) { }
+
+  // Counts the origins still in the window and returns the summary.
+  DeflateSummary flush(uint64_t deflated_size);
+
+  // The largest distance deflate can copy from.
+  static const uint32_t kWindowSize = 32 * 1024;
+
+private:
+  struct Origin {
+    uint64_t weight;
+    // The number of bytes in the window that come from this origin.
+    uint32_t refs;
+  };
+
+  // Adds a byte that is its own origin.
+  inline void add_origin();
+
+  // Moves the window past the oldest byte and puts the given origin in its
+  // place, returning the origin that was there or kNoOrigin.
+  inline uint16_t shift(uint16_t origin);
+
+  // Drops a reference to the given origin, counting it if it was the last.
+  inline void release(uint16_t origin);
+
+  static const uint16_t kNoOrigin = 0xFFFF;
+
+  // The origin of each byte in the window, indexed by position modulo the
+  // window size.
+  array<uint16_t> window_;
+  array<Origin> origins_;
+  // Indices of the unused entries of origins_. There can't be more origins
+  // than bytes in the window so there's always one free when a byte enters.
+  array<uint16_t> free_;
+  uint32_t free_count_;
+  uint64_t cursor_;
+  uint64_t literal_count_;
+  uint64_t block_count_;
+  uint64_t histogram_[DeflateSummary::kContributionBucketCount];
+};
+
+// Writer that passes the tokens of the output on to a ProfileVisitor in
+// batches.
+class VisitingByteWriter : public ByteWriter {
+public:
+  VisitingByteWriter(ProfileVisitor &visitor);
+  ~VisitingByteWriter();
+  inline void append(uint8_t data, uint32_t bit_size);
+  inline void match(uint64_t pos, uint32_t dist, uint32_t len, uint32_t bit_size);
+  void open_block(uint8_t type) { type_ = type; }
+  void close_block(uint32_t bit_count);
+
+  // Delivers the tokens that haven't been yet.
+  void flush();
+
+  static const bool kWholeCopies = true;
+
+  // The number of tokens delivered at a time.
+  static const uint32_t kBatchSize = 1024;
+
+private:
+  inline void add(uint64_t pos, uint32_t dist, uint32_t len, uint32_t bit_size,
+      uint8_t value);
+
+  ProfileVisitor &visitor_;
+  // The position of the next byte. Only kept up to date while literals are
+  // wanted since copies come with their position.
+  uint64_t cursor_;
+  uint32_t type_;
+  // Which tokens the visitor wants.
+  bool wants_literals_;
+  bool wants_copies_;
+  uint32_t token_count_;
+  array<ProfileToken> tokens_;
 };
 
 } // namespace impl
@@ -10,46 +10,82 @@
 namespace zipprof {
 namespace impl {
 
-uint8_t ArrayBitReader::next_bit() {
-  if (buffer_cursor_ == 64)
-    fetch_next_block();
-  return (buffer_ >> (buffer_cursor_++)) & 0x1;
+template <typename R>
+uint8_t BitReader<R>::next_bit() {
+  return static_cast<uint8_t>(next_word(1));
 }
 
+template <typename R>
 template <uint32_t W>
-uint32_t ArrayBitReader::next_word() {
-  if (buffer_cursor_ + W > 64)
-    return next_word_fallback(W);
-  uint32_t result = (buffer_ >> buffer_cursor_) & ((1 << W) - 1);
-  buffer_cursor_ += W;
-  return result;
+uint32_t BitReader<R>::next_word() {
+  return next_word(W);
 }
 
-uint32_t ArrayBitReader::next_word(uint32_t word_size) {
-  if (buffer_cursor_ + word_size > 64)
-    return next_word_fallback(word_size);
-  uint32_t result = (buffer_ >> buffer_cursor_) & ((1 << word_size) - 1);
-  buffer_cursor_ += word_size;
+template <typename R>
+uint32_t BitReader<R>::next_word(uint32_t word_size) {
+  if (buffer_bits_ < word_size)
+    refill();
+  uint32_t result = static_cast<uint32_t>(buffer_ & ((1ULL << word_size) - 1));
+  buffer_ >>= word_size;
+  buffer_bits_ -= word_size;
   return result;
 }
 
-uint16_t ArrayBitReader::next_short() {
+template <typename R>
+uint16_t BitReader<R>::next_short() {
+  // Shorts are read from the buffer like everything else rather than directly
+  // from the data, so reads near the end never go past it.
   ASSERT(bit_cursor() == 0);
-  if (buffer_cursor_ > (64 - 16))
-    return next_byte() | (next_byte() << 8);
-  uint16_t result = reinterpret_cast<const uint16_t*>(data_.begin() + data_cursor_ + (buffer_cursor_ >> 3))[0];
-  buffer_cursor_ += 16;
-  return result;
-
+  return static_cast<uint16_t>(next_word(16));
 }
 
-uint8_t ArrayBitReader::next_byte() {
+template <typename R>
+uint8_t BitReader<R>::next_byte() {
   ASSERT(bit_cursor() == 0);
-  if (buffer_cursor_ > (64 - 8))
-    fetch_next_block();
-  uint8_t result = data_[data_cursor_ + (buffer_cursor_ >> 3)];
-  buffer_cursor_ += 8;
-  return result;
+  return static_cast<uint8_t>(next_word(8));
+}
+
+template <typename R>
+uint32_t BitReader<R>::peek_word(uint32_t word_size) {
+  if (buffer_bits_ < word_size)
+    refill();
+  return static_cast<uint32_t>(buffer_ & ((1ULL << word_size) - 1));
+}
+
+template <typename R>
+void BitReader<R>::skip_bits(uint32_t word_size) {
+  if (buffer_bits_ < word_size)
+    refill();
+  buffer_ >>= word_size;
+  buffer_bits_ -= word_size;
+}
+
+template <typename R>
+void BitReader<R>::refill_fast() {
+  // Loads a whole word but only counts the bytes that fit; the bits of any
+  // byte that only partly fit are loaded again by the next refill.
+  const uint8_t *data = reader().loaded().begin();
+  uint64_t word = reinterpret_cast<const uint64_t*>(data + data_cursor_)[0];
+  buffer_ |= word << buffer_bits_;
+  data_cursor_ += (63 - buffer_bits_) >> 3;
+  buffer_bits_ |= kFastBits;
+}
+
+template <typename R>
+uint32_t BitReader<R>::peek_word_fast(uint32_t word_size) {
+  return static_cast<uint32_t>(buffer_ & ((1ULL << word_size) - 1));
+}
+
+template <typename R>
+void BitReader<R>::skip_bits_fast(uint32_t word_size) {
+  buffer_ >>= word_size;
+  buffer_bits_ -= word_size;
+}
+
+bool StreamBitReader::has_slack(uint32_t bytes) {
+  if (data_cursor_ + bytes <= data_size_)
+    return true;
+  return fill(bytes);
 }
 
 void ProfilingByteWriter::copy(uint8_t value, uint32_t source, uint32_t copy, uint32_t bit_size) {
@@ -58,8 +94,7 @@ void ProfilingByteWriter::copy(uint8_t value, uint32_t source, uint32_t copy, ui
   stat.source = source;
   stat.copy = (copy + 1);
   stat.bit_size = bit_size;
-  stat.value = value;
-  add_stat(stat);
+  add_stat(stat, value);
 }
 
 void ProfilingByteWriter::append(uint8_t value, uint32_t bit_size) {
@@ -67,15 +102,113 @@ void ProfilingByteWriter::append(uint8_t value, uint32_t bit_size) {
   stat.source = cursor_;
   stat.copy = 0;
   stat.bit_size = bit_size;
-  stat.value = value;
   literal_count_++;
-  add_stat(stat);
+  add_stat(stat, value);
+}
+
+void ProfilingByteWriter::match(uint64_t pos, uint32_t dist, uint32_t len, uint32_t bit_size) {
+  BlockStat &block = blocks_.back();
+  block.match_count++;
+  block.max_match_length = std::max(block.max_match_length, len);
+  block.max_match_distance = std::max(block.max_match_distance, dist);
+  length_sum_ += len;
+  distance_sum_ += dist;
+  ASSERT(len <= MatchStats::kMaxLength);
+  // Same as MatchStats::distance_bucket, given that distances are at least
+  // 1 and at most 32K.
+  uint32_t bucket = bit_length(dist - 1);
+  ASSERT(bucket < MatchStats::kDistanceBucketCount);
+  match_stats_.length_histogram[len]++;
+  match_stats_.distance_histogram[bucket]++;
+  match_stats_.distance_bytes[bucket] += len;
+}
+
+void ProfilingByteWriter::borrow(uint8_t value, uint32_t copy, uint32_t bit_size) {
+  ByteStat stat;
+  stat.source = cursor_;
+  stat.copy = (copy + 1);
+  stat.bit_size = bit_size;
+  add_stat(stat, value);
 }
 
-void ProfilingByteWriter::add_stat(const ByteStat &stat) {
+void ProfilingByteWriter::add_stat(const ByteStat &stat, uint8_t value) {
   if (cursor_ >= bytes_.size())
     grow_buffer();
-  bytes_[cursor_++] = stat;
+  bytes_[cursor_] = stat;
+  contents_[cursor_] = value;
+  cursor_++;
+}
+
+void SummaryByteWriter::copy(uint8_t value, uint32_t source, uint32_t copy, uint32_t bit_size) {
+  // The source may be the byte about to leave the window so it has to be
+  // referenced before anything is released.
+  uint16_t origin = window_[source & (kWindowSize - 1)];
+  ASSERT(origin != kNoOrigin);
+  origins_[origin].weight++;
+  origins_[origin].refs++;
+  uint16_t dropped = shift(origin);
+  if (dropped != kNoOrigin)
+    release(dropped);
+}
+
+void SummaryByteWriter::append(uint8_t value, uint32_t bit_size) {
+  literal_count_++;
+  add_origin();
+}
+
+void SummaryByteWriter::borrow(uint8_t value, uint32_t copy, uint32_t bit_size) {
+  add_origin();
+}
+
+void SummaryByteWriter::add_origin() {
+  uint16_t &slot = window_[cursor_ & (kWindowSize - 1)];
+  if (slot != kNoOrigin)
+    release(slot);
+  uint16_t origin = free_[--free_count_];
+  origins_[origin].weight = 1;
+  origins_[origin].refs = 1;
+  slot = origin;
+  cursor_++;
+}
+
+uint16_t SummaryByteWriter::shift(uint16_t origin) {
+  uint16_t &slot = window_[cursor_ & (kWindowSize - 1)];
+  uint16_t result = slot;
+  slot = origin;
+  cursor_++;
+  return result;
+}
+
+void SummaryByteWriter::release(uint16_t origin) {
+  Origin &entry = origins_[origin];
+  if (--entry.refs > 0)
+    return;
+  double contribution = 1.0 / entry.weight;
+  histogram_[DeflateSummary::contribution_bucket(contribution)] += entry.weight;
+  free_[free_count_++] = origin;
+}
+
+void VisitingByteWriter::append(uint8_t value, uint32_t bit_size) {
+  if (wants_literals_)
+    add(cursor_++, 0, 1, bit_size, value);
+}
+
+void VisitingByteWriter::match(uint64_t pos, uint32_t dist, uint32_t len, uint32_t bit_size) {
+  if (wants_copies_)
+    add(pos, dist, len, bit_size, 0);
+  cursor_ = pos + len;
+}
+
+void VisitingByteWriter::add(uint64_t pos, uint32_t dist, uint32_t len, uint32_t bit_size,
+    uint8_t value) {
+  ProfileToken &token = tokens_[token_count_];
+  token.pos = pos;
+  token.dist = dist;
+  token.len = len;
+  token.bits = bit_size;
+  token.value = value;
+  if (++token_count_ == kBatchSize)
+    flush();
 }
 
 } // namespace impl
@@ -0,0 +1,402 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "kernels.hh"
+#include "utils_inl.hh"
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+#ifdef ZIPPROF_HAVE_AVX2
+#  include <cpuid.h>
+#  include <immintrin.h>
+#endif
+
+using namespace zipprof;
+using namespace zipprof::impl;
+
+namespace {
+
+typedef void (*ResolveOrigins)(const ByteStat *stats, uint32_t start, uint32_t count,
+    uint32_t *origins);
+typedef void (*FixUpOrigins)(uint32_t *origins, uint32_t chunk_start, uint32_t start,
+    uint32_t end);
+typedef void (*ResolveDepths)(const ByteStat *stats, uint32_t count, uint32_t *origins,
+    uint32_t *depths);
+typedef void (*CountWeights)(const uint32_t *origins, uint32_t count, uint32_t *weights);
+
+// The variants the kernels are currently dispatched to.
+struct Kernels {
+  CpuLevel level;
+  ResolveOrigins resolve_origins;
+  FixUpOrigins fix_up_origins;
+  ResolveDepths resolve_depths;
+  CountWeights count_weights;
+};
+
+// Resolves the origins of the bytes from first up to count, assuming the ones
+// from start up to first have already been resolved. Bytes copied from
+// before start are left pointing at their source, as are the ones copied
+// from those; when start is 0 there are none.
+void resolve_origins_from(const ByteStat *stats, uint32_t start, uint32_t first,
+    uint32_t count, uint32_t *origins) {
+  for (uint32_t i = first; i < count; i++) {
+    uint32_t source = stats[i].source;
+    origins[i] = (source == i || source < start) ? source : origins[source];
+  }
+}
+
+void resolve_origins_portable(const ByteStat *stats, uint32_t start, uint32_t count,
+    uint32_t *origins) {
+  resolve_origins_from(stats, start, start, count, origins);
+}
+
+// Replaces the positions before chunk_start that the bytes from start up to
+// end were left pointing at with their origins, which must be final.
+void fix_up_origins_portable(uint32_t *origins, uint32_t chunk_start, uint32_t start,
+    uint32_t end) {
+  for (uint32_t i = start; i < end; i++) {
+    if (origins[i] < chunk_start)
+      origins[i] = origins[origins[i]];
+  }
+}
+
+void resolve_depths_from(const ByteStat *stats, uint32_t first, uint32_t count,
+    uint32_t *origins, uint32_t *depths) {
+  for (uint32_t i = first; i < count; i++) {
+    uint32_t source = stats[i].source;
+    if (source == i) {
+      origins[i] = i;
+      depths[i] = 0;
+    } else {
+      origins[i] = origins[source];
+      depths[i] = depths[source] + 1;
+    }
+  }
+}
+
+void resolve_depths_portable(const ByteStat *stats, uint32_t count, uint32_t *origins,
+    uint32_t *depths) {
+  resolve_depths_from(stats, 0, count, origins, depths);
+}
+
+// The increments depend on each other through memory whenever two origins
+// coincide, which they do all the time, so there is nothing to vectorize.
+void count_weights_portable(const uint32_t *origins, uint32_t count, uint32_t *weights) {
+  for (uint32_t i = 0; i < count; i++)
+    weights[origins[i]]++;
+}
+
+// A number of copies of the same origin, as collected by
+// count_weights_parallel.
+struct WeightRun {
+  uint32_t origin;
+  uint32_t count;
+};
+
+// The origins count_weights_parallel counts at a time, and the number of
+// runs it buffers per part before handing them over. That bounds the memory
+// it takes to about part_count^2 / 2 buffers of 8K, however the origins are
+// distributed.
+const uint32_t kCountBatch = 256;
+const uint32_t kSpillCapacity = 4 * kCountBatch;
+
+#ifdef ZIPPROF_HAVE_AVX2
+
+// The gathers below read fields of a ByteStat as 32-bit lanes.
+static_assert(sizeof(ByteStat) == 12, "unexpected byte stat layout");
+static_assert(offsetof(ByteStat, source) == 0, "unexpected byte stat layout");
+static const uint32_t kStatWords = sizeof(ByteStat) / 4;
+
+// The gathers take signed 32-bit indices so everything they read has to lie
+// below 2^31; the bytes past that are left to the portable loops.
+static const uint32_t kMaxGatherEnd = 1U << 31;
+
+// Returns the end of the whole groups of 8 from start up to end that can be
+// handled with gathers, or start if there are none.
+inline uint32_t gather_end(uint32_t start, uint32_t end) {
+  uint32_t limit = std::min(end, kMaxGatherEnd);
+  return (start < limit) ? (start + (limit - start) / 8 * 8) : start;
+}
+
+// Returns the word offsets of a field in 8 consecutive byte stats.
+ZIPPROF_TARGET_AVX2 inline __m256i stat_field_offsets(uint32_t field) {
+  return _mm256_add_epi32(_mm256_set1_epi32(field),
+      _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21));
+}
+
+// Resolves 8 bytes at a time by gathering the origins of their sources. That
+// only works when none of them is copied from within the same group, which
+// is true for all but the shortest distances; those groups are resolved one
+// byte at a time. Literals and bytes copied from before start keep their
+// source so only the others are gathered.
+ZIPPROF_TARGET_AVX2 void resolve_origins_avx2(const ByteStat *stats, uint32_t start,
+    uint32_t count, uint32_t *origins) {
+  const int *words = reinterpret_cast<const int*>(stats);
+  const int *origin_words = reinterpret_cast<const int*>(origins);
+  __m256i offsets = stat_field_offsets(offsetof(ByteStat, source) / 4);
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i start_lanes = _mm256_set1_epi32(start);
+  uint32_t i = start;
+  for (uint32_t end = gather_end(start, count); i < end; i += 8) {
+    __m256i sources = _mm256_i32gather_epi32(words + static_cast<size_t>(i) * kStatWords,
+        offsets, 4);
+    __m256i first = _mm256_set1_epi32(i);
+    __m256i positions = _mm256_add_epi32(first, lanes);
+    __m256i literal = _mm256_cmpeq_epi32(sources, positions);
+    __m256i in_group = _mm256_cmpeq_epi32(_mm256_max_epu32(sources, first), sources);
+    if (!_mm256_testc_si256(literal, in_group)) {
+      resolve_origins_from(stats, start, i, i + 8, origins);
+      continue;
+    }
+    __m256i in_range = _mm256_cmpeq_epi32(_mm256_max_epu32(sources, start_lanes), sources);
+    __m256i copied = _mm256_mask_i32gather_epi32(sources, origin_words, sources,
+        _mm256_andnot_si256(literal, in_range), 4);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(origins + i), copied);
+  }
+  resolve_origins_from(stats, start, i, count, origins);
+}
+
+// Like resolve_origins_avx2 but also gathers the depths of the sources,
+// adding one to those of the copies.
+ZIPPROF_TARGET_AVX2 void resolve_depths_avx2(const ByteStat *stats, uint32_t count,
+    uint32_t *origins, uint32_t *depths) {
+  const int *words = reinterpret_cast<const int*>(stats);
+  const int *origin_words = reinterpret_cast<const int*>(origins);
+  const int *depth_words = reinterpret_cast<const int*>(depths);
+  __m256i offsets = stat_field_offsets(offsetof(ByteStat, source) / 4);
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  uint32_t i = 0;
+  for (uint32_t end = gather_end(0, count); i < end; i += 8) {
+    __m256i sources = _mm256_i32gather_epi32(words + static_cast<size_t>(i) * kStatWords,
+        offsets, 4);
+    __m256i first = _mm256_set1_epi32(i);
+    __m256i positions = _mm256_add_epi32(first, lanes);
+    __m256i literal = _mm256_cmpeq_epi32(sources, positions);
+    __m256i in_group = _mm256_cmpeq_epi32(_mm256_max_epu32(sources, first), sources);
+    if (!_mm256_testc_si256(literal, in_group)) {
+      resolve_depths_from(stats, i, i + 8, origins, depths);
+      continue;
+    }
+    __m256i copied_mask = _mm256_andnot_si256(literal, _mm256_set1_epi32(-1));
+    __m256i copied = _mm256_mask_i32gather_epi32(positions, origin_words, sources,
+        copied_mask, 4);
+    __m256i source_depths = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+        depth_words, sources, copied_mask, 4);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(origins + i), copied);
+    // The mask is -1 in the lanes of copies so subtracting it adds one.
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(depths + i),
+        _mm256_sub_epi32(source_depths, copied_mask));
+  }
+  resolve_depths_from(stats, i, count, origins, depths);
+}
+
+// Fixes up 8 bytes at a time by gathering the origins of the ones that still
+// point before the chunk. Those are always in earlier chunks, never in the
+// same group, so there is nothing to resolve one byte at a time. They are
+// also below the group itself, so the groups gather_end allows never gather
+// from 2^31 on.
+ZIPPROF_TARGET_AVX2 void fix_up_origins_avx2(uint32_t *origins, uint32_t chunk_start,
+    uint32_t start, uint32_t end) {
+  const int *origin_words = reinterpret_cast<const int*>(origins);
+  __m256i chunk_lanes = _mm256_set1_epi32(chunk_start);
+  __m256i all = _mm256_set1_epi32(-1);
+  uint32_t i = start;
+  for (uint32_t group_end = gather_end(start, end); i < group_end; i += 8) {
+    __m256i *group = reinterpret_cast<__m256i*>(origins + i);
+    __m256i current = _mm256_loadu_si256(group);
+    __m256i resolved = _mm256_cmpeq_epi32(_mm256_max_epu32(current, chunk_lanes), current);
+    if (_mm256_testc_si256(resolved, all))
+      continue;
+    __m256i fixed = _mm256_mask_i32gather_epi32(current, origin_words, current,
+        _mm256_andnot_si256(resolved, all), 4);
+    _mm256_storeu_si256(group, fixed);
+  }
+  fix_up_origins_portable(origins, chunk_start, i, end);
+}
+
+#endif
+
+Kernels select_kernels(CpuLevel level) {
+  Kernels result = {CpuLevel::PORTABLE, resolve_origins_portable, fix_up_origins_portable,
+      resolve_depths_portable, count_weights_portable};
+#ifdef ZIPPROF_HAVE_AVX2
+  if (level >= CpuLevel::AVX2) {
+    result.level = CpuLevel::AVX2;
+    result.resolve_origins = resolve_origins_avx2;
+    result.fix_up_origins = fix_up_origins_avx2;
+    result.resolve_depths = resolve_depths_avx2;
+  }
+#endif
+  return result;
+}
+
+// Selected once when the library is loaded.
+Kernels kernels = select_kernels(detect_cpu_level());
+
+} // namespace
+
+CpuLevel impl::detect_cpu_level() {
+#ifdef ZIPPROF_HAVE_AVX2
+  uint32_t eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return CpuLevel::PORTABLE;
+  // The os has to save the ymm registers for avx to be usable, not just the
+  // cpu supporting it.
+  static const uint32_t kOsxsave = 1 << 27;
+  static const uint32_t kAvx = 1 << 28;
+  if ((ecx & kOsxsave) == 0 || (ecx & kAvx) == 0)
+    return CpuLevel::PORTABLE;
+  uint32_t xcr0_low, xcr0_high;
+  __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+  if ((xcr0_low & 0x6) != 0x6)
+    return CpuLevel::PORTABLE;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return CpuLevel::PORTABLE;
+  static const uint32_t kAvx2 = 1 << 5;
+  static const uint32_t kBmi2 = 1 << 8;
+  if ((ebx & kAvx2) != 0 && (ebx & kBmi2) != 0)
+    return CpuLevel::AVX2;
+#endif
+  return CpuLevel::PORTABLE;
+}
+
+CpuLevel impl::cpu_level() {
+  return kernels.level;
+}
+
+bool impl::set_cpu_level(CpuLevel level) {
+  Kernels selected = select_kernels(level);
+  if (selected.level != level || level > detect_cpu_level())
+    return false;
+  kernels = selected;
+  return true;
+}
+
+void impl::resolve_origins(array<const ByteStat> stats, array<uint32_t> origins) {
+  ASSERT(stats.size() == origins.size());
+  kernels.resolve_origins(stats.begin(), 0, stats.size(), origins.begin());
+}
+
+void impl::resolve_chunk_origins(array<const ByteStat> stats, uint32_t start,
+    array<uint32_t> origins) {
+  ASSERT(stats.size() == origins.size());
+  ASSERT(start <= stats.size());
+  kernels.resolve_origins(stats.begin(), start, stats.size(), origins.begin());
+}
+
+void impl::fix_up_origins(array<uint32_t> origins, uint32_t chunk_start, uint32_t start,
+    uint32_t end) {
+  ASSERT(chunk_start <= start && start <= end && end <= origins.size());
+  kernels.fix_up_origins(origins.begin(), chunk_start, start, end);
+}
+
+void impl::resolve_depths(array<const ByteStat> stats, array<uint32_t> origins,
+    array<uint32_t> depths) {
+  ASSERT(stats.size() == origins.size());
+  ASSERT(stats.size() == depths.size());
+  kernels.resolve_depths(stats.begin(), stats.size(), origins.begin(), depths.begin());
+}
+
+void impl::count_weights(array<const uint32_t> origins, array<uint32_t> weights) {
+  kernels.count_weights(origins.begin(), origins.size(), weights.begin());
+}
+
+void impl::resolve_origins_parallel(array<const ByteStat> stats, array<uint32_t> origins,
+    uint32_t chunk_size) {
+  ASSERT(stats.size() == origins.size());
+  ASSERT(chunk_size > 0);
+  uint32_t size = stats.size();
+  uint32_t chunk_count = (size + chunk_size - 1) / chunk_size;
+  // Within a chunk a byte copied from before it gets the position it was
+  // copied from, which is always below the chunk's start, instead of its
+  // origin. Bytes copied from those get the same.
+  parallel_for(chunk_count, [&](uint32_t chunk) {
+    uint32_t start = chunk * chunk_size;
+    uint32_t end = std::min(size, start + chunk_size);
+    kernels.resolve_origins(stats.begin(), start, end, origins.begin());
+  });
+  if (chunk_count <= 1)
+    return;
+  // Once the chunks before one are final its references into them can be
+  // replaced with their origins, which is a plain gather that's split into
+  // blocks to run in parallel. The blocks are handed out in order so the
+  // ones of a chunk only have to wait for those of the chunk before it,
+  // which have all been started by then, to finish.
+  static const uint32_t kFixUpBlocks = 64;
+  std::vector<std::atomic<uint32_t>> blocks_done(chunk_count);
+  for (uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    blocks_done[chunk].store((chunk == 0) ? kFixUpBlocks : 0);
+  parallel_for((chunk_count - 1) * kFixUpBlocks, [&](uint32_t index) {
+    uint32_t chunk = 1 + index / kFixUpBlocks;
+    uint32_t block = index % kFixUpBlocks;
+    while (blocks_done[chunk - 1].load(std::memory_order_acquire) < kFixUpBlocks)
+      std::this_thread::yield();
+    uint32_t start = chunk * chunk_size;
+    uint32_t end = std::min(size, start + chunk_size);
+    uint32_t block_size = (end - start + kFixUpBlocks - 1) / kFixUpBlocks;
+    uint32_t block_start = std::min(end, start + block * block_size);
+    uint32_t block_end = std::min(end, block_start + block_size);
+    kernels.fix_up_origins(origins.begin(), start, block_start, block_end);
+    blocks_done[chunk].fetch_add(1, std::memory_order_release);
+  });
+}
+
+void impl::count_weights_parallel(array<const uint32_t> origins, array<uint32_t> weights,
+    uint32_t part_count) {
+  ASSERT(part_count > 0);
+  uint32_t size = origins.size();
+  uint32_t part_size = (size + part_count - 1) / part_count;
+  if (part_size == 0)
+    return;
+  // Each part's weights are only touched while holding its lock, by the part
+  // itself a batch at a time and by the others when they hand over what they
+  // found in it.
+  std::unique_ptr<std::mutex[]> locks(new std::mutex[part_count]);
+  parallel_for(part_count, [&](uint32_t part) {
+    uint32_t start = std::min(size, part * part_size);
+    uint32_t end = std::min(size, start + part_size);
+    // The origins found in each of the parts before this one, as runs of
+    // the same origin, that haven't been handed over yet. Buffers that might
+    // not have room for another batch are handed over before it starts, so
+    // no more than one lock is ever held at a time.
+    size_t run_capacity = static_cast<size_t>(part) * kSpillCapacity;
+    std::unique_ptr<WeightRun[]> runs(new WeightRun[run_capacity]);
+    std::vector<uint32_t> run_counts(part);
+    auto hand_over = [&](uint32_t to) {
+      WeightRun *buffer = runs.get() + static_cast<size_t>(to) * kSpillCapacity;
+      std::lock_guard<std::mutex> lock(locks[to]);
+      for (uint32_t i = 0; i < run_counts[to]; i++)
+        weights[buffer[i].origin] += buffer[i].count;
+      run_counts[to] = 0;
+    };
+    for (uint32_t batch = start; batch < end; batch += kCountBatch) {
+      for (uint32_t to = 0; to < part; to++) {
+        if (run_counts[to] + kCountBatch > kSpillCapacity)
+          hand_over(to);
+      }
+      uint32_t batch_end = std::min(end, batch + kCountBatch);
+      std::lock_guard<std::mutex> lock(locks[part]);
+      for (uint32_t i = batch; i < batch_end; i++) {
+        uint32_t origin = origins[i];
+        if (origin >= start) {
+          weights[origin]++;
+          continue;
+        }
+        uint32_t to = origin / part_size;
+        WeightRun *buffer = runs.get() + static_cast<size_t>(to) * kSpillCapacity;
+        uint32_t &count = run_counts[to];
+        if (count > 0 && buffer[count - 1].origin == origin) {
+          buffer[count - 1].count++;
+        } else {
+          buffer[count].origin = origin;
+          buffer[count].count = 1;
+          count++;
+        }
+      }
+    }
+    for (uint32_t to = 0; to < part; to++)
+      hand_over(to);
+  });
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#pragma once
+
+#include "io.hh"
+#include "utils.hh"
+
+// Compilers that can build individual functions for instruction sets beyond
+// the baseline the rest of the code is built for. Functions marked with
+// ZIPPROF_TARGET_AVX2 must only be called when cpu_level() says so.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#  define ZIPPROF_HAVE_AVX2 1
+#  define ZIPPROF_TARGET_AVX2 __attribute__((target("avx2,bmi2")))
+#endif
+
+namespace zipprof {
+namespace impl {
+
+// The instruction sets the kernels below have variants for, in increasing
+// order. AVX2 includes BMI2 since every cpu that has one has the other.
+enum class CpuLevel {
+  PORTABLE = 0,
+  AVX2 = 1
+};
+
+// Returns the best level the cpu supports, as reported by cpuid.
+CpuLevel detect_cpu_level();
+
+// Returns the level the kernels are currently dispatched to. This is the
+// detected level unless it has been lowered using set_cpu_level.
+CpuLevel cpu_level();
+
+// Dispatches the kernels to the given level, returning false and leaving them
+// unchanged if the cpu doesn't support it. Not thread safe; meant for tests
+// and benchmarks that compare the variants.
+bool set_cpu_level(CpuLevel level);
+
+// Fills origins with the index of the literal each of the given bytes was
+// ultimately copied from.
+void resolve_origins(array<const ByteStat> stats, array<uint32_t> origins);
+
+// Fills origins like resolve_origins and, in the same pass, depths with the
+// number of copies between each byte and its origin.
+void resolve_depths(array<const ByteStat> stats, array<uint32_t> origins,
+    array<uint32_t> depths);
+
+// Adds one to weights[origin] for each of the given origins.
+void count_weights(array<const uint32_t> origins, array<uint32_t> weights);
+
+// Resolves the origins of the bytes from start up to the end of stats the way
+// resolve_origins_parallel does for a single chunk, leaving the ones copied
+// from before start pointing at where they were copied from. Only the entries
+// from start on are touched.
+void resolve_chunk_origins(array<const ByteStat> stats, uint32_t start,
+    array<uint32_t> origins);
+
+// Replaces the positions before chunk_start that the bytes from start up to
+// end were left pointing at by resolve_chunk_origins with their origins,
+// which must already be final.
+void fix_up_origins(array<uint32_t> origins, uint32_t chunk_start, uint32_t start,
+    uint32_t end);
+
+// Does the same as resolve_origins but spreads the work over multiple
+// threads. Each chunk of chunk_size bytes is first resolved on its own,
+// leaving the bytes copied from earlier chunks pointing into them, then
+// those are fixed up one chunk at a time, in order.
+void resolve_origins_parallel(array<const ByteStat> stats, array<uint32_t> origins,
+    uint32_t chunk_size);
+
+// Does the same as count_weights but splits the origins into part_count
+// parts that are counted in parallel. Each part counts the origins that
+// fall within it into weights directly and buffers the others in a fixed
+// amount of memory, adding them to the weights of the parts they fall within
+// whenever a buffer fills up.
+void count_weights_parallel(array<const uint32_t> origins, array<uint32_t> weights,
+    uint32_t part_count);
+
+} // namespace impl
+} // namespace zipprof
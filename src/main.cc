@@ -11,32 +11,64 @@
 #include <vector>
 #include <cstring>
 #include <algorithm>
-
+#include <iomanip>
+#include <cctype>
+#include <cerrno>
 
 using namespace zipprof;
 
 class Arguments {
 public:
+  Arguments() : timings_(false), summary_(false), top_count_(0), top_window_(4096) { }
   void parse(Array<char*> cmdline);
 
   std::vector<std::string> &args() { return args_; }
+  bool timings() { return timings_; }
+  bool summary() { return summary_; }
+  uint32_t top_count() { return top_count_; }
+  uint32_t top_window() { return top_window_; }
 
 private:
   static error_t dispatch_parse_option(int key, char *arg, argp_state *state);
   error_t parse_option(int key, char *arg, argp_state *state);
 
-  static const argp_option kOptions[2];
+  // Parses a number greater than zero, returning false if arg isn't one.
+  static bool parse_positive(const char *arg, uint32_t *value_out);
+
+  static const argp_option kOptions[6];
   static const argp kParser;
 
   std::vector<std::string> args_;
+  bool timings_;
+  bool summary_;
+  uint32_t top_count_;
+  uint32_t top_window_;
 };
 
 
-const argp_option Arguments::kOptions[2] = {
+const argp_option Arguments::kOptions[6] = {
     {"histogram", 'h', 0, 0, "b"},
+    {"timings", 't', 0, 0, "Show how long each phase of decoding took"},
+    {"summary", 's', 0, 0, "Only show aggregates, which take constant memory to collect"},
+    {"top", 'k', "COUNT", OPTION_ARG_OPTIONAL,
+        "Show the COUNT (default 50) regions with the most literal bytes and the most copied bytes"},
+    {"window", 'w', "BYTES", 0, "The size of the regions shown by --top, 4096 by default"},
     {NULL}
 };
 
+bool Arguments::parse_positive(const char *arg, uint32_t *value_out) {
+  // strtoul happily negates and skips whitespace so only digits are let in.
+  if (!isdigit(static_cast<unsigned char>(arg[0])))
+    return false;
+  char *end = NULL;
+  errno = 0;
+  unsigned long value = strtoul(arg, &end, 10);
+  if (*end != '\0' || errno != 0 || value == 0 || value > UINT32_MAX)
+    return false;
+  *value_out = static_cast<uint32_t>(value);
+  return true;
+}
+
 error_t Arguments::dispatch_parse_option(int key, char *arg, struct argp_state *state) {
   return static_cast<Arguments*>(state->input)->parse_option(key, arg, state);
 }
@@ -45,6 +77,22 @@ error_t Arguments::parse_option(int key, char *arg, struct argp_state *state) {
   switch (key) {
   case 'h':
     break;
+  case 't':
+    timings_ = true;
+    break;
+  case 's':
+    summary_ = true;
+    break;
+  case 'k':
+    if (arg == NULL)
+      top_count_ = 50;
+    else if (!parse_positive(arg, &top_count_))
+      argp_error(state, "invalid count '%s'", arg);
+    break;
+  case 'w':
+    if (!parse_positive(arg, &top_window_))
+      argp_error(state, "invalid window size '%s'", arg);
+    break;
   case ARGP_KEY_ARG:
     args_.push_back(arg);
     break;
@@ -62,6 +110,24 @@ void Arguments::parse(Array<char*> cmdline) {
 
 const argp Arguments::kParser = { kOptions, dispatch_parse_option, "", NULL };
 
+// Reads a file a fixed-size block at a time.
+class FileSource : public ByteSource {
+public:
+  FileSource(const std::string &path) : file_(path, std::ios::binary) { }
+  bool is_open() { return static_cast<bool>(file_); }
+  virtual Array<const uint8_t> next_chunk() override;
+
+private:
+  static const uint32_t kBlockSize = 64 * 1024;
+  std::ifstream file_;
+  uint8_t block_[kBlockSize];
+};
+
+Array<const uint8_t> FileSource::next_chunk() {
+  file_.read(reinterpret_cast<char*>(block_), kBlockSize);
+  return Array<const uint8_t>(block_, file_.gcount());
+}
+
 class ZProf {
 public:
   int main(Array<char*> cmdline);
@@ -69,6 +135,12 @@ public:
 private:
   static std::string read_file(std::string path);
   void profile_file(std::string path);
+  void summarize_file(std::string path);
+  static void print_histogram(const uint64_t *buckets);
+  static void print_blocks(DeflateProfile &profile);
+  static void print_matches(DeflateProfile &profile);
+  static void print_timings(DeflateProfile &profile);
+  static void print_top(DeflateProfile &profile, uint32_t count, uint32_t window);
 
   Arguments args_;
 };
@@ -92,16 +164,73 @@ void ZProf::profile_file(std::string path) {
   std::cout << "=== " << path << " ===" << std::endl;
   std::cout << "deflated_size: " << profile.deflated_size() << "b" << std::endl;
   std::cout << "inflated_size: " << profile.inflated_size() << "b" << std::endl;
-  constexpr uint32_t kBucketCount = 16;
-  uint32_t buckets[kBucketCount];
-  uint32_t high_water_mark = 0;
+  print_blocks(profile);
+  print_matches(profile);
+  uint64_t buckets[DeflateSummary::kContributionBucketCount];
   memset(buckets, 0, sizeof(buckets));
-  for (uint32_t i = 0; i < profile.inflated_size(); i++) {
-    double contrib = profile.literal_contribution(i);
-    uint32_t bucket = static_cast<uint32_t>(contrib * (kBucketCount - 1));
-    buckets[bucket]++;
-    high_water_mark = std::max(high_water_mark, buckets[bucket]);
+  for (uint32_t i = 0; i < profile.inflated_size(); i++)
+    buckets[DeflateSummary::contribution_bucket(profile.literal_contribution(i))]++;
+  print_histogram(buckets);
+  if (args_.top_count() > 0)
+    print_top(profile, args_.top_count(), args_.top_window());
+  if (args_.timings())
+    print_timings(profile);
+}
+
+void ZProf::summarize_file(std::string path) {
+  FileSource source(path);
+  if (!source.is_open()) {
+    std::cerr << "Couldn't open file " << path << std::endl;
+    return;
+  }
+  DeflateSummary summary = Profiler::summarize_zlib(source);
+  std::cout << "=== " << path << " ===" << std::endl;
+  std::cout << "deflated_size: " << summary.deflated_size << "b" << std::endl;
+  std::cout << "inflated_size: " << summary.inflated_size << "b" << std::endl;
+  std::cout << "literal_count: " << summary.literal_count << std::endl;
+  std::cout << "block_count: " << summary.block_count << std::endl;
+  std::cout << "bits_per_byte: " << std::fixed << std::setprecision(3)
+      << summary.bits_per_byte() << std::endl;
+  print_histogram(summary.contribution_histogram);
+}
+
+void ZProf::print_blocks(DeflateProfile &profile) {
+  Array<const BlockStat> blocks = profile.blocks();
+  uint64_t header_bits = 0;
+  uint64_t total_bits = 0;
+  for (uint32_t i = 0; i < blocks.size(); i++) {
+    header_bits += blocks.begin()[i].header_bits;
+    total_bits += blocks.begin()[i].bit_count;
+  }
+  double share = (total_bits == 0) ? 0 : 100.0 * header_bits / total_bits;
+  std::cout << "blocks: " << blocks.size() << ", " << header_bits
+      << " header bits (" << std::fixed << std::setprecision(1) << share << "%)"
+      << std::endl;
+}
+
+void ZProf::print_matches(DeflateProfile &profile) {
+  MatchStats stats = profile.match_stats();
+  double mean_length = (stats.match_count == 0)
+      ? 0
+      : static_cast<double>(stats.copied_bytes) / stats.match_count;
+  std::cout << "matches: " << stats.match_count << ", mean length " << std::fixed
+      << std::setprecision(1) << mean_length << std::endl;
+  // The share of copied bytes a decoder with each of these windows would
+  // still get from copies.
+  static const uint32_t kWindowBits[] = {10, 12, 13, 14, 15};
+  std::cout << "copied within:";
+  for (uint32_t i = 0; i < sizeof(kWindowBits) / sizeof(kWindowBits[0]); i++) {
+    std::cout << " " << (1 << (kWindowBits[i] - 10)) << "K "
+        << (100.0 * stats.copied_share_within(kWindowBits[i])) << "%";
   }
+  std::cout << std::endl;
+}
+
+void ZProf::print_histogram(const uint64_t *buckets) {
+  constexpr uint32_t kBucketCount = DeflateSummary::kContributionBucketCount;
+  uint64_t high_water_mark = 0;
+  for (uint32_t ib = 0; ib < kBucketCount; ib++)
+    high_water_mark = std::max(high_water_mark, buckets[ib]);
   constexpr uint32_t kBarHeight = 16;
   for (uint32_t ih = 0; ih < kBarHeight; ih++) {
     double limit = static_cast<double>(kBarHeight - ih) / kBarHeight;
@@ -114,10 +243,75 @@ void ZProf::profile_file(std::string path) {
   }
 }
 
+void ZProf::print_top(DeflateProfile &profile, uint32_t count, uint32_t window) {
+  std::vector<HotRegion> regions = profile.hottest_regions(window, count);
+  std::cout << "hottest regions (" << window << "b):" << std::endl;
+  for (auto it = regions.begin(); it != regions.end(); it++) {
+    std::cout << "  " << std::setw(10) << it->offset << std::fixed << std::setprecision(1)
+        << std::setw(12) << it->literal_contribution << " literal bytes" << std::endl;
+  }
+  std::vector<CopiedByte> copied = profile.most_copied(count);
+  Array<const uint8_t> contents = profile.contents();
+  std::cout << "most copied:" << std::endl;
+  for (auto it = copied.begin(); it != copied.end(); it++) {
+    uint8_t value = contents.begin()[it->offset];
+    std::cout << "  " << std::setw(10) << it->offset << std::setw(12) << it->weight
+        << " occurrences of 0x" << std::hex << std::setw(2) << std::setfill('0')
+        << static_cast<uint32_t>(value) << std::dec << std::setfill(' ');
+    if (isprint(value))
+      std::cout << " '" << static_cast<char>(value) << "'";
+    std::cout << std::endl;
+  }
+}
+
+void ZProf::print_timings(DeflateProfile &profile) {
+  DeflateTimings timings = profile.timings();
+  uint64_t lookups = timings.table_cache_lookups();
+  double hit_rate = (lookups == 0) ? 0 : 100.0 * timings.table_cache_hits() / lookups;
+  std::cout << "table_cache: " << timings.table_cache_hits() << " hits in "
+      << lookups << " lookups (" << std::fixed << std::setprecision(1)
+      << hit_rate << "%)" << std::endl;
+  uint32_t decoder_blocks[DeflateTimings::kDecoderCount] = {0};
+  for (uint32_t i = 0; i < profile.block_count(); i++)
+    decoder_blocks[static_cast<uint32_t>(timings.decoder(i))]++;
+  std::cout << "decoders:";
+  for (uint32_t i = 0; i < DeflateTimings::kDecoderCount; i++) {
+    std::cout << ((i == 0) ? " " : ", ") << decoder_blocks[i] << " "
+        << DeflateTimings::decoder_name(static_cast<BlockDecoder>(i));
+  }
+  std::cout << std::endl;
+  if (!DeflateTimings::enabled()) {
+    std::cout << "timings: not collected, rebuild with -DZIPPROF_TIMINGS=ON" << std::endl;
+    return;
+  }
+  uint64_t total_cycles = 0;
+  for (uint32_t i = 0; i < DeflateTimings::kPhaseCount; i++)
+    total_cycles += timings.total(static_cast<DecodePhase>(i)).cycles;
+  std::cout << "timings: " << total_cycles << " cycles over "
+      << timings.block_count() << " blocks" << std::endl;
+  for (uint32_t i = 0; i < DeflateTimings::kPhaseCount; i++) {
+    DecodePhase phase = static_cast<DecodePhase>(i);
+    PhaseCounters counters = timings.total(phase);
+    double share = (total_cycles == 0) ? 0 : 100.0 * counters.cycles / total_cycles;
+    double per_event = (counters.events == 0)
+        ? 0
+        : static_cast<double>(counters.cycles) / counters.events;
+    std::cout << "  " << std::left << std::setw(12) << DeflateTimings::phase_name(phase)
+        << std::right << std::setw(14) << counters.cycles << " cycles"
+        << std::fixed << std::setprecision(1) << std::setw(7) << share << "%"
+        << std::setw(12) << counters.events << " events"
+        << std::setw(10) << per_event << " cycles/event" << std::endl;
+  }
+}
+
 int ZProf::main(Array<char*> cmdline) {
   args_.parse(cmdline);
-  for (auto it = args_.args().begin(); it != args_.args().end(); it++)
-    profile_file(*it);
+  for (auto it = args_.args().begin(); it != args_.args().end(); it++) {
+    if (args_.summary())
+      summarize_file(*it);
+    else
+      profile_file(*it);
+  }
   return 0;
 }
 
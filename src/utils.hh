@@ -6,6 +6,7 @@
 #include <cstring>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "zipprof.h"
 
@@ -46,6 +47,58 @@ private:
   T stack_elms_[S];
 };
 
+// A bump allocator for state that only lives as long as a block. Allocations
+// are carved out of a single buffer which is reused after each reset, so in
+// the steady state nothing touches the heap. If the buffer runs out the excess
+// is allocated separately and the buffer grows to fit at the next reset.
+class Arena {
+public:
+  explicit Arena(uint32_t capacity);
+  ~Arena();
+
+  // Returns uninitialized space for count values of type T, which must not
+  // need destruction. Valid until the next reset.
+  template <typename T>
+  array<T> alloc(uint32_t count);
+
+  // Releases everything allocated since the last reset.
+  inline void reset();
+
+  uint32_t capacity() { return capacity_; }
+
+  // The number of bytes allocated since the last reset.
+  uint32_t used() { return used_; }
+
+private:
+  inline uint8_t *alloc_bytes(uint32_t size);
+  uint8_t *alloc_overflow(uint32_t size);
+
+  static const uint32_t kAlignment = 16;
+
+  uint8_t *buf_;
+  uint32_t capacity_;
+  uint32_t used_;
+  // The most that was ever allocated between two resets.
+  uint32_t peak_;
+  std::vector<uint8_t*> overflow_;
+};
+
+// Returns the number of threads to use for work that can be done in parallel.
+inline uint32_t thread_count();
+
+// Calls fn(i) for every i from 0 to count, spreading the calls across up to
+// thread_count() threads. If any of the calls throw the first exception is
+// rethrown once all threads are done.
+template <typename F>
+void parallel_for(uint32_t count, F fn);
+
+// Returns the number of bits it takes to represent the given value, 0 for 0.
+inline uint32_t bit_length(uint32_t value);
+
+// Returns the value of the cpu's cycle counter, or a nanosecond clock on
+// platforms that don't have one.
+inline uint64_t cycle_count();
+
 static array<const char> c_str_to_array(const char *str) {
   return array<const char>(str, ::strlen(str) + 1);
 }
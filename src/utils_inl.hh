@@ -5,7 +5,18 @@
 
 #include "utils.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#endif
 
 namespace zipprof {
 namespace impl {
@@ -39,6 +50,110 @@ template <typename T, uint32_t S>
 stack_array<T, S>::stack_array()
     : array<T>(stack_elms_, S) { array<T>::fill(0); }
 
+inline Arena::Arena(uint32_t capacity)
+    : buf_(new uint8_t[capacity])
+    , capacity_(capacity)
+    , used_(0)
+    , peak_(0) { }
+
+inline Arena::~Arena() {
+  reset();
+  delete[] buf_;
+}
+
+template <typename T>
+array<T> Arena::alloc(uint32_t count) {
+  static_assert(alignof(T) <= kAlignment, "arena alignment too small");
+  uint8_t *bytes = alloc_bytes(count * sizeof(T));
+  return array<T>(reinterpret_cast<T*>(bytes), count);
+}
+
+uint8_t *Arena::alloc_bytes(uint32_t size) {
+  uint32_t start = used_;
+  used_ += (size + kAlignment - 1) & ~(kAlignment - 1);
+  if (used_ > capacity_)
+    return alloc_overflow(size);
+  return buf_ + start;
+}
+
+inline uint8_t *Arena::alloc_overflow(uint32_t size) {
+  uint8_t *result = new uint8_t[size];
+  overflow_.push_back(result);
+  return result;
+}
+
+void Arena::reset() {
+  peak_ = std::max(peak_, used_);
+  used_ = 0;
+  if (overflow_.empty())
+    return;
+  for (auto it = overflow_.begin(); it != overflow_.end(); it++)
+    delete[] *it;
+  overflow_.clear();
+  delete[] buf_;
+  capacity_ = peak_;
+  buf_ = new uint8_t[capacity_];
+}
+
+inline uint32_t thread_count() {
+  uint32_t count = std::thread::hardware_concurrency();
+  return (count == 0) ? 1 : count;
+}
+
+template <typename F>
+void parallel_for(uint32_t count, F fn) {
+  uint32_t threads = std::min(thread_count(), count);
+  if (threads <= 1) {
+    for (uint32_t i = 0; i < count; i++)
+      fn(i);
+    return;
+  }
+  std::atomic<uint32_t> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto work = [&]() {
+    while (true) {
+      uint32_t i = next++;
+      if (i >= count)
+        return;
+      try {
+        fn(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t i = 1; i < threads; i++)
+    workers.push_back(std::thread(work));
+  work();
+  for (auto it = workers.begin(); it != workers.end(); it++)
+    it->join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+inline uint32_t bit_length(uint32_t value) {
+#ifdef __GNUC__
+  return (value == 0) ? 0 : (32 - __builtin_clz(value));
+#else
+  uint32_t result = 0;
+  for (; value != 0; value >>= 1)
+    result++;
+  return result;
+#endif
+}
+
+inline uint64_t cycle_count() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+#endif
+}
 
 } // namespace impl
 } // namespace zipprof
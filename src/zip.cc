@@ -4,6 +4,13 @@
 
 using namespace zipprof;
 
+const uint32_t PhaseTimer::kNoPhase;
+
+void PhaseTimer::open_block() {
+  PhaseCounters zero = {0, 0};
+  counters_.insert(counters_.end(), DeflateTimings::kPhaseCount, zero);
+}
+
 Archive::Impl::Impl() { }
 
 Array<std::string> Archive::Impl::entries() {
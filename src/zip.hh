@@ -12,6 +12,9 @@ namespace impl {
 
 class DeflateError : public std::exception { };
 
+// Gives benchmarks access to the internals of the deflater.
+class DeflaterAccess;
+
 class Account {
 public:
   inline Account() : bit_count_(0) { }
@@ -23,6 +26,52 @@ private:
   uint32_t bit_count_;
 };
 
+// Charges elapsed cycles to whichever decoding phase is currently active,
+// keeping a row of counters for each block. Phases are entered and left
+// through PhaseScopes which are only compiled in with ZIPPROF_TIMINGS.
+class PhaseTimer {
+public:
+  PhaseTimer() : current_(kNoPhase), last_(0) { }
+
+  // Starts a new row of counters.
+  void open_block();
+
+  // Makes the given phase the active one, returning the one that was active
+  // before.
+  inline uint32_t switch_to(uint32_t phase);
+
+  // Counts an event for the given phase.
+  inline void count(uint32_t phase);
+
+  // Returns the counters, DeflateTimings::kPhaseCount per block.
+  std::vector<PhaseCounters> &counters() { return counters_; }
+
+  static const uint32_t kNoPhase = static_cast<uint32_t>(-1);
+
+private:
+  std::vector<PhaseCounters> counters_;
+  uint32_t current_;
+  uint64_t last_;
+};
+
+// Makes a phase active for as long as it is in scope and counts an event for
+// it. A NULL timer is ignored.
+class PhaseScope {
+public:
+  inline PhaseScope(PhaseTimer *timer, DecodePhase phase);
+  inline ~PhaseScope();
+
+private:
+  PhaseTimer *timer_;
+  uint32_t previous_;
+};
+
+#ifdef ZIPPROF_TIMINGS
+#  define ZIPPROF_PHASE(TIMER, PHASE) PhaseScope zipprof_phase_scope((TIMER), (PHASE))
+#else
+#  define ZIPPROF_PHASE(TIMER, PHASE)
+#endif
+
 // A utility wrapped around a bit reader that takes care of accounting the
 // number of bits read to some account.
 template <typename Reader>
@@ -37,25 +86,70 @@ public:
   inline uint16_t next_short(Account &account);
   inline uint8_t ensure_aligned(Account &account);
 
+  // Reads count whole bytes starting at a byte boundary, accounting them.
+  // Throws a DeflateError if the input ends first.
+  inline array<const uint8_t> next_bytes(uint32_t count, Account &account);
+
+  // Returns the next width bits without consuming or accounting them.
+  inline uint32_t peek_word(uint32_t width);
+
+  // Consumes width bits, accounting them.
+  inline void skip(uint32_t width, Account &account);
+
+  // Returns the number of bits consumed since the start of the input.
+  uint64_t bit_offset() { return reader().bit_offset(); }
+
+  // Returns true if at least the given number of input bytes remain.
+  bool has_slack(uint32_t bytes) { return reader().has_slack(bytes); }
+
+  // Buffers enough input to read kFastBits bits without any further checks.
+  // Only valid when has_slack(8).
+  void refill_fast() { reader().refill_fast(); }
+
+  // Like peek_word and skip but only read what refill_fast buffered.
+  template <bool kFast> inline uint32_t peek_word(uint32_t width);
+  template <bool kFast> inline void skip(uint32_t width, Account &account);
+
 private:
   Reader &reader() { return reader_; }
   Reader &reader_;
 };
 
 // A utility wrapped around a byte writer that keeps track of positions and
-// buffers data so it can be copied.
+// buffers data so it can be copied. Writers that retain their output are
+// copied from directly and no buffer is kept.
 template <typename Writer>
 class OutputTracker {
 public:
-  OutputTracker(uint32_t size, Writer &out);
+  // If a timer is given the time spent copying and writing is charged to it.
+  OutputTracker(uint32_t size, Writer &out, PhaseTimer *timer = NULL);
   ~OutputTracker();
 
   // Adds a single byte to the output.
   void add(uint8_t c, uint32_t bit_size);
 
-  // Copies a previously seen range.
+  // Adds the literals of the given literal table entry. All of the entry's
+  // literal slots are stored in the history, whether used or not, to avoid
+  // branching on the count so the history must be at least kMaxLiteralRun - 1
+  // bytes larger than the largest distance.
+  void add_literals(uint64_t entry);
+
+  // Copies a previously seen range. The history is copied in whole chunks of
+  // kCopyChunk bytes where possible, which may write up to kCopyChunk - 1
+  // bytes past the end of the range, so the history must be at least that
+  // much larger than the largest distance.
   void copy(uint32_t dist, uint32_t len, uint32_t bit_size);
 
+  // The size of the chunks copies move at once; the width of an avx2 register
+  // so the avx2 build moves each in one instruction.
+  static const uint32_t kCopyChunk = 32;
+
+  // Fills the history with the given preset dictionary such that subsequent
+  // copies can refer back into it. Only the last size bytes are kept. If the
+  // writer retains its output the dictionary is referred to rather than
+  // copied so it must outlive the tracker.
+  void prime(array<const uint8_t> dictionary);
+
   Writer &out() { return out_; }
 
 private:
@@ -64,12 +158,35 @@ private:
   // add is part of, if it is part of one otherwise -1.
   void add(uint8_t c, uint32_t pos, int32_t copy);
 
+  // Copies len bytes of history starting at start to the current position in
+  // whole chunks, without advancing it. Returns false without copying
+  // anything if the range can't be copied that way.
+  bool copy_chunks(uint64_t start, uint32_t len);
+
+  // Reports a byte of the current copy, copied from the given position, to
+  // the writer.
+  inline void copied(uint8_t value, uint64_t pos, uint32_t bit_size);
+
+  // Whether the history is kept in buf_ rather than read from the writer.
+  static const bool kOwnHistory = !Writer::kRetainsOutput;
+  static_assert(kOwnHistory || !Writer::kWholeCopies,
+      "a writer that only sees whole copies can't provide the history");
+
+  // NULL unless kOwnHistory.
   uint8_t *buf_;
   uint32_t size_;
   uint32_t mask_;
-  uint32_t out_cur_;
+  // Wide enough for streams that inflate to more than 4G. The positions the
+  // writer sees wrap around at that point.
+  uint64_t out_cur_;
   uint32_t copy_cur_;
+  // The number of positions at the start of the history that come from the
+  // preset dictionary rather than from the output.
+  uint32_t base_;
+  // The preset dictionary, if the history isn't kept in buf_.
+  array<const uint8_t> dictionary_;
   Writer &out_;
+  PhaseTimer *timer_;
 };
 
 template <typename Reader, typename Writer>
@@ -81,7 +198,43 @@ public:
   // Deflates input from the reader, writing it to the writer.
   void deflate();
 
+  // Sets the preset dictionary the input was compressed with. Must be called
+  // before deflating and the dictionary must stay alive until it's done.
+  void set_dictionary(array<const uint8_t> dictionary);
+
+  // Sets whether dynamic blocks decode runs of short literal codes with a
+  // single lookup in a literal table. The bit size of each literal is still
+  // reported separately. Off by default since building the table only pays
+  // off for blocks with enough literals.
+  void set_multi_literal(bool value) { multi_literal_ = value; }
+
+  // Returns the phase counters collected while deflating. Empty unless built
+  // with ZIPPROF_TIMINGS.
+  std::vector<PhaseCounters> &timings() { return timer_.counters(); }
+
+  // Sets the number of symbols below which dynamic blocks whose tables aren't
+  // cached are decoded with canonical codes instead of building tables. The
+  // number of symbols in a block isn't known up front so it's estimated from
+  // the longest literal/length code: the rarest symbol occurs at least once
+  // and a code of length n usually means a frequency of about 2^-n. Zero
+  // always builds tables.
+  void set_canonical_limit(uint32_t value) { canonical_limit_ = value; }
+
+  // Returns the cache the literal/length and distance tables of dynamic
+  // blocks are looked up in.
+  CodeTableCache &table_cache() { return table_cache_; }
+
+  // Returns how the symbols of each block so far were decoded.
+  std::vector<BlockDecoder> &block_decoders() { return block_decoders_; }
+
+  // The default canonical limit. The estimate runs a few times below the
+  // actual count; blocks of a couple of hundred bytes decode faster without
+  // tables while blocks of a few kilobytes, estimated at 1024, already don't.
+  static const uint32_t kDefaultCanonicalLimit = 128;
+
 private:
+  friend class DeflaterAccess;
+
   enum class encoding_method {
     RAW = 0,
     HUFFMAN_STATIC = 1,
@@ -90,30 +243,93 @@ private:
   };
 
   void decompress_raw(Account &block_account);
-  void decompress_huffman(Account &block_account, HuffCode *code, HuffNode len_root, HuffNode dist_root);
-  uint32_t decode_symbol(Account &account, HuffCode *code, HuffNode root);
-  uint32_t decode_run_length(Account &account, uint32_t symbol);
-  uint32_t decode_distance(Account &account, uint32_t symbol);
-  void decode_huffman_codes(Account &account, HuffCode *code,
-      HuffNode *len_root_out, HuffNode *dist_root_out);
+  // The input, in bytes, the fast decode loops need to have left. Each pass
+  // refills the reader once and then decodes at most a length, a distance
+  // and their extra bits, 48 bits, which fits in what's buffered.
+  static const uint32_t kFastInputSlack = 8;
 
-  InputTracker<Reader> in_;
-  InputTracker<Reader> &in() { return in_; }
+  // Decodes a dynamic block, choosing between tables and canonical codes.
+  void decompress_dynamic(Account &block_account);
 
-  // Returns the fixed length code tree, creating it on first call.
-  HuffNode fixed_len_root();
-  HuffNode fixed_len_root_;
-  bool has_fixed_len_root_;
+  // Decodes a dynamic block using the given tables. If literals is non-NULL
+  // runs of literals are decoded through it. Like zlib's inflate_fast it
+  // decodes without checking for the end of input while there's enough slack
+  // and then finishes the block carefully.
+  void decompress_huffman(Account &block_account, CodeTable &lit_len, CodeTable &dist,
+      LiteralTable *literals);
 
-  // Returns the fixed distance code tree, creating it on first call.
-  HuffNode fixed_dist_root();
-  HuffNode fixed_dist_root_;
-  bool has_fixed_dist_root_;
+  // Decodes a block using the fixed huffman code, looking symbols up in the
+  // tables that are built at compile time.
+  void decompress_fixed(Account &block_account);
+
+  // Decodes the next literal, run of literals or copy of a dynamic or fixed
+  // block, returning true at the end of the block. If kFast is set the input
+  // must have been refilled by refill_fast just before.
+  template <bool kFast>
+  bool decode_huffman_step(Account &block_account, CodeTable &lit_len, CodeTable &dist,
+      LiteralTable *literals);
+  template <bool kFast>
+  bool decode_fixed_step(Account &block_account);
+
+  // Like decompress_huffman but decodes each symbol by walking its canonical
+  // code.
+  void decompress_canonical(Account &block_account, CanonicalCode &lit_len,
+      CanonicalCode &dist);
+  template <bool kFast>
+  bool decode_canonical_step(Account &block_account, CanonicalCode &lit_len,
+      CanonicalCode &dist);
+
+  // Returns the entry of the next symbol of the given canonical code without
+  // consuming anything.
+  template <bool kFast>
+  uint32_t find_canonical_entry(CanonicalCode &code);
+
+  // Decodes a symbol using the given table, returning its value plus any
+  // extra bits that follow it.
+  template <bool kFast>
+  uint32_t decode_symbol(Account &account, CodeTable &table);
+
+  // Like decode_symbol but for a table with the given number of index bits
+  // and no subtables.
+  template <bool kFast>
+  uint32_t decode_table_symbol(Account &account, const uint32_t *table, uint32_t bits);
+
+  // Returns the entry for the next symbol in the given table. If the symbol
+  // is in a subtable the root bits are consumed, otherwise nothing is.
+  template <bool kFast>
+  uint32_t lookup_entry(Account &account, CodeTable &table);
+
+  // Like lookup_entry but where the root entry has already been looked up.
+  template <bool kFast>
+  uint32_t find_entry(Account &account, CodeTable &table, uint32_t entry);
+
+  // Consumes the code of the given entry along with its extra bits and
+  // returns the entry's value plus the extra bits.
+  template <bool kFast>
+  uint32_t consume_entry(Account &account, uint32_t entry);
+  // Reads the code lengths of a dynamic block into the arena, the first of
+  // which belong to the literal/length code and the rest to the distance code.
+  array<uint32_t> decode_code_lengths(Account &account, uint32_t *lit_len_count_out);
+
+  // Returns the number of symbols a dynamic block with the given
+  // literal/length code lengths is expected to hold.
+  static uint32_t expected_symbol_count(array<uint32_t> lit_len_lengths);
+
+  InputTracker<Reader> in_;
+  InputTracker<Reader> &in() { return in_; }
 
-  HuffCode *fixed_code() { return &fixed_code_; }
-  HuffCode fixed_code_;
   OutputTracker<Writer> &out() { return *out_; }
   OutputTracker<Writer> *out_;
+  PhaseTimer timer_;
+
+  // Holds the state of the current block, the code lengths and the code
+  // length table. It is reset whenever a block is closed.
+  Arena arena_;
+  CodeTable code_len_table_;
+  CodeTableCache table_cache_;
+  bool multi_literal_;
+  uint32_t canonical_limit_;
+  std::vector<BlockDecoder> block_decoders_;
 };
 
 } // namespace impl
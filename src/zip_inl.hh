@@ -12,12 +12,13 @@ using namespace impl;
 template <typename R, typename W>
 Deflater<R, W>::Deflater(R &in, W &out)
     : in_(in)
-    , fixed_len_root_(0, 0)
-    , has_fixed_len_root_(false)
-    , fixed_dist_root_(0, 0)
-    , has_fixed_dist_root_(false)
-    , out_(NULL) {
-  out_ = new OutputTracker<W>(32 * 1024, out);
+    , out_(NULL)
+    , arena_(16 * 1024)
+    , multi_literal_(false)
+    , canonical_limit_(kDefaultCanonicalLimit) {
+  // Twice the window since the history must have some slack beyond it for
+  // literal runs and chunked copies and has to be a power of two.
+  out_ = new OutputTracker<W>(64 * 1024, out, &timer_);
 }
 
 template <typename R, typename W>
@@ -26,127 +27,292 @@ Deflater<R, W>::~Deflater() {
 }
 
 template <typename R, typename W>
-HuffNode Deflater<R, W>::fixed_len_root() {
-  if (!has_fixed_len_root_) {
-    stack_array<uint32_t, 288> table;
-    table.slice(0, 144).fill(8);
-    table.slice(144, 256).fill(9);
-    table.slice(256, 280).fill(7);
-    table.slice(280, 288).fill(8);
-    fixed_len_root_ = fixed_code()->new_code_tree(table);
-    has_fixed_len_root_ = true;
-  }
-  return fixed_len_root_;
-}
-
-template <typename R, typename W>
-HuffNode Deflater<R, W>::fixed_dist_root() {
-  if (!has_fixed_dist_root_) {
-    stack_array<uint32_t, 32> table;
-    table.fill(5);
-    fixed_dist_root_ = fixed_code()->new_code_tree(table);
-    has_fixed_dist_root_ = true;
-  }
-  return fixed_dist_root_;
+void Deflater<R, W>::set_dictionary(array<const uint8_t> dictionary) {
+  out().prime(dictionary);
 }
 
 template <typename R, typename W>
 void Deflater<R, W>::deflate() {
   bool keep_going = true;
   while (keep_going) {
+#ifdef ZIPPROF_TIMINGS
+    timer_.open_block();
+#endif
+    ZIPPROF_PHASE(&timer_, DecodePhase::HEADERS);
+    uint64_t block_offset = in().bit_offset();
     Account block_account;
     uint8_t last_block_bit = in().next_bit(block_account);
     keep_going = (last_block_bit != 1);
     encoding_method method = encoding_method(in().template next_word<2>(block_account));
-    out().out().open_block(static_cast<uint8_t>(method));
+    {
+      ZIPPROF_PHASE(&timer_, DecodePhase::WRITER);
+      out().out().open_block(static_cast<uint8_t>(method));
+    }
     switch (method) {
     case encoding_method::RAW:
+      block_decoders_.push_back(BlockDecoder::STORED);
       decompress_raw(block_account);
       break;
     case encoding_method::HUFFMAN_STATIC:
-      decompress_huffman(block_account, fixed_code(), fixed_len_root(), fixed_dist_root());
+      block_decoders_.push_back(BlockDecoder::FIXED);
+      decompress_fixed(block_account);
       break;
-    case encoding_method::HUFFMAN: {
-      HuffCode container;
-      HuffNode len_root(0, 0);
-      HuffNode dist_root(0, 0);
-      decode_huffman_codes(block_account, &container, &len_root, &dist_root);
-      decompress_huffman(block_account, &container, len_root, dist_root);
+    case encoding_method::HUFFMAN:
+      decompress_dynamic(block_account);
       break;
-    }
     case encoding_method::RESERVED:
       throw DeflateError();
     }
-    out().out().close_block(block_account.close());
+    {
+      ZIPPROF_PHASE(&timer_, DecodePhase::WRITER);
+      out().out().block_span(block_offset, in().bit_offset() - block_offset);
+      out().out().close_block(block_account.close());
+    }
+    arena_.reset();
   }
 }
 
 template <typename R, typename W>
-void Deflater<R, W>::decompress_huffman(Account &block_account, HuffCode *code,
-    HuffNode len_root, HuffNode dist_root) {
-  while (true) {
-    Account account;
-    uint32_t symbol = decode_symbol(account, code, len_root);
-    if (symbol < 256) {
-      uint8_t value = static_cast<uint8_t>(symbol);
-      out().add(value, account.close());
-    } else if (symbol == 256) {
-      block_account.inc(account.close());
-      break;
-    } else {
-      uint32_t run = decode_run_length(account, symbol);
-      uint32_t dist_sym = decode_symbol(account, code, dist_root);
-      uint32_t dist = decode_distance(account, dist_sym);
-      out().copy(dist, run, account.close());
+const uint32_t Deflater<R, W>::kDefaultCanonicalLimit;
+
+template <typename R, typename W>
+void Deflater<R, W>::decompress_dynamic(Account &block_account) {
+  uint32_t lit_len_count = 0;
+  array<uint32_t> lengths = decode_code_lengths(block_account, &lit_len_count);
+  CodeTable *lit_len = NULL;
+  CodeTable *dist = NULL;
+  LiteralTable *literals = NULL;
+  LiteralTable **literals_out = multi_literal_ ? &literals : NULL;
+  CanonicalCode lit_len_code;
+  CanonicalCode dist_code;
+  BlockDecoder decoder = BlockDecoder::CACHED_TABLE;
+  {
+    ZIPPROF_PHASE(&timer_, DecodePhase::CODE_TREES);
+    // Recording the lengths counts as handling the code tables, which keeps
+    // the writer to its events for bytes and block boundaries.
+    out().out().code_lengths(lengths, lit_len_count);
+    // Cached tables are free so they always win.
+    if (!table_cache_.find(lengths, lit_len_count, &lit_len, &dist, literals_out)) {
+      array<uint32_t> lit_len_lengths = lengths.slice(0, lit_len_count);
+      bool canonical = expected_symbol_count(lit_len_lengths) < canonical_limit_;
+      decoder = canonical ? BlockDecoder::CANONICAL : BlockDecoder::TABLE;
+      bool valid = canonical
+          ? (lit_len_code.build(lit_len_lengths, arena_.alloc<uint32_t>(lit_len_count),
+                 DeflateSymbols::kLitLen.entries)
+             && dist_code.build(lengths.slice(lit_len_count),
+                 arena_.alloc<uint32_t>(lengths.size() - lit_len_count),
+                 DeflateSymbols::kDist.entries))
+          : table_cache_.build(lengths, lit_len_count, &lit_len, &dist, literals_out);
+      if (!valid)
+        throw DeflateError();
     }
   }
+  block_decoders_.push_back(decoder);
+  if (decoder == BlockDecoder::CANONICAL) {
+    decompress_canonical(block_account, lit_len_code, dist_code);
+  } else {
+    decompress_huffman(block_account, *lit_len, *dist, literals);
+  }
 }
 
 template <typename R, typename W>
-uint32_t Deflater<R, W>::decode_symbol(Account &account, HuffCode *code,
-    HuffNode root) {
-  HuffNode current = root;
-  while (true) {
-    ASSERT(current.is_branch());
-    HuffNode next = (in().next_bit(account) == 0)
-        ? current.branch_left(code)
-        : current.branch_right(code);
-    if (next.is_leaf())
-      return next.leaf_value();
-    else
-      current = next;
+uint32_t Deflater<R, W>::expected_symbol_count(array<uint32_t> lit_len_lengths) {
+  uint32_t max_length = 0;
+  for (uint32_t i = 0; i < lit_len_lengths.size(); i++)
+    max_length = std::max(max_length, lit_len_lengths[i]);
+  return 1 << max_length;
+}
+
+template <typename R, typename W>
+void Deflater<R, W>::decompress_huffman(Account &block_account, CodeTable &lit_len,
+    CodeTable &dist, LiteralTable *literals) {
+  while (in().has_slack(kFastInputSlack)) {
+    in().refill_fast();
+    if (decode_huffman_step<true>(block_account, lit_len, dist, literals))
+      return;
   }
+  while (!decode_huffman_step<false>(block_account, lit_len, dist, literals))
+    ;
 }
 
 template <typename R, typename W>
-uint32_t Deflater<R, W>::decode_run_length(Account &account, uint32_t symbol) {
-  if (symbol <= 264) {
-    return symbol - 254;
-  } else if (symbol <= 284) {
-    uint32_t extra_bits = (symbol - 261) >> 2;
-    return ((((symbol - 265) & 0x3) + 4) << extra_bits) + 3 + in().next_word(extra_bits, account);
-  } else if (symbol == 285) {
-    return 258;
+template <bool kFast>
+bool Deflater<R, W>::decode_huffman_step(Account &block_account, CodeTable &lit_len,
+    CodeTable &dist, LiteralTable *literals) {
+  ZIPPROF_PHASE(&timer_, DecodePhase::SYMBOLS);
+  Account account;
+  uint32_t entry;
+  if (literals != NULL) {
+    uint64_t literal_entry =
+        literals->entries()[in().template peek_word<kFast>(literals->root_bits())];
+    if (literal_entry_count(literal_entry) > 0) {
+      // Consume all the literals' bits at once but report them separately.
+      in().template skip<kFast>(literal_entry_total_length(literal_entry), account);
+      account.close();
+      ZIPPROF_PHASE(&timer_, DecodePhase::WRITER);
+      out().add_literals(literal_entry);
+      return false;
+    }
+    entry = find_entry<kFast>(account, lit_len, literal_entry_code(literal_entry));
   } else {
-    throw DeflateError();
+    entry = lookup_entry<kFast>(account, lit_len);
+  }
+  if ((entry & (kHuffLength | kHuffEnd)) == 0) {
+    in().template skip<kFast>(huff_entry_length(entry), account);
+    uint8_t value = static_cast<uint8_t>(huff_entry_value(entry));
+    ZIPPROF_PHASE(&timer_, DecodePhase::WRITER);
+    out().add(value, account.close());
+    return false;
+  } else if ((entry & kHuffEnd) != 0) {
+    in().template skip<kFast>(huff_entry_length(entry), account);
+    block_account.inc(account.close());
+    return true;
+  } else {
+    uint32_t run = consume_entry<kFast>(account, entry);
+    uint32_t distance = consume_entry<kFast>(account, lookup_entry<kFast>(account, dist));
+    ZIPPROF_PHASE(&timer_, DecodePhase::COPIES);
+    out().copy(distance, run, account.close());
+    return false;
   }
 }
 
 template <typename R, typename W>
-uint32_t Deflater<R, W>::decode_distance(Account &account, uint32_t symbol) {
-  if (symbol <= 3) {
-    return symbol + 1;
-  } else if (symbol <= 29) {
-    uint32_t extra_bits = (symbol >> 1) - 1;
-    return (((symbol & 1) + 2) << extra_bits) + 1 + in().next_word(extra_bits, account);
+void Deflater<R, W>::decompress_fixed(Account &block_account) {
+  while (in().has_slack(kFastInputSlack)) {
+    in().refill_fast();
+    if (decode_fixed_step<true>(block_account))
+      return;
+  }
+  while (!decode_fixed_step<false>(block_account))
+    ;
+}
+
+template <typename R, typename W>
+template <bool kFast>
+bool Deflater<R, W>::decode_fixed_step(Account &block_account) {
+  ZIPPROF_PHASE(&timer_, DecodePhase::SYMBOLS);
+  Account account;
+  uint32_t entry = FixedHuffman::kLitLen.entries[
+      in().template peek_word<kFast>(FixedHuffman::kLitLenBits)];
+  if ((entry & (kHuffLength | kHuffEnd | kHuffInvalid)) == 0) {
+    in().template skip<kFast>(huff_entry_length(entry), account);
+    uint8_t value = static_cast<uint8_t>(huff_entry_value(entry));
+    ZIPPROF_PHASE(&timer_, DecodePhase::WRITER);
+    out().add(value, account.close());
+    return false;
+  } else if ((entry & kHuffEnd) != 0) {
+    in().template skip<kFast>(huff_entry_length(entry), account);
+    block_account.inc(account.close());
+    return true;
   } else {
+    if ((entry & kHuffInvalid) != 0)
+      throw DeflateError();
+    uint32_t run = consume_entry<kFast>(account, entry);
+    uint32_t distance = decode_table_symbol<kFast>(account, FixedHuffman::kDist.entries,
+        FixedHuffman::kDistBits);
+    ZIPPROF_PHASE(&timer_, DecodePhase::COPIES);
+    out().copy(distance, run, account.close());
+    return false;
+  }
+}
+
+template <typename R, typename W>
+void Deflater<R, W>::decompress_canonical(Account &block_account, CanonicalCode &lit_len,
+    CanonicalCode &dist) {
+  while (in().has_slack(kFastInputSlack)) {
+    in().refill_fast();
+    if (decode_canonical_step<true>(block_account, lit_len, dist))
+      return;
+  }
+  while (!decode_canonical_step<false>(block_account, lit_len, dist))
+    ;
+}
+
+template <typename R, typename W>
+template <bool kFast>
+bool Deflater<R, W>::decode_canonical_step(Account &block_account, CanonicalCode &lit_len,
+    CanonicalCode &dist) {
+  ZIPPROF_PHASE(&timer_, DecodePhase::SYMBOLS);
+  Account account;
+  uint32_t entry = find_canonical_entry<kFast>(lit_len);
+  if ((entry & (kHuffLength | kHuffEnd)) == 0) {
+    in().template skip<kFast>(huff_entry_length(entry), account);
+    uint8_t value = static_cast<uint8_t>(huff_entry_value(entry));
+    ZIPPROF_PHASE(&timer_, DecodePhase::WRITER);
+    out().add(value, account.close());
+    return false;
+  } else if ((entry & kHuffEnd) != 0) {
+    in().template skip<kFast>(huff_entry_length(entry), account);
+    block_account.inc(account.close());
+    return true;
+  } else {
+    uint32_t run = consume_entry<kFast>(account, entry);
+    uint32_t distance = consume_entry<kFast>(account, find_canonical_entry<kFast>(dist));
+    ZIPPROF_PHASE(&timer_, DecodePhase::COPIES);
+    out().copy(distance, run, account.close());
+    return false;
+  }
+}
+
+template <typename R, typename W>
+template <bool kFast>
+uint32_t Deflater<R, W>::find_canonical_entry(CanonicalCode &code) {
+  uint32_t entry = code.find(in().template peek_word<kFast>(CanonicalCode::kPeekBits));
+  if ((entry & kHuffInvalid) != 0)
+    throw DeflateError();
+  return entry;
+}
+
+template <typename R, typename W>
+template <bool kFast>
+uint32_t Deflater<R, W>::decode_table_symbol(Account &account,
+    const uint32_t *table, uint32_t bits) {
+  uint32_t entry = table[in().template peek_word<kFast>(bits)];
+  if ((entry & kHuffInvalid) != 0)
     throw DeflateError();
+  return consume_entry<kFast>(account, entry);
+}
+
+template <typename R, typename W>
+template <bool kFast>
+uint32_t Deflater<R, W>::decode_symbol(Account &account, CodeTable &table) {
+  return consume_entry<kFast>(account, lookup_entry<kFast>(account, table));
+}
+
+template <typename R, typename W>
+template <bool kFast>
+uint32_t Deflater<R, W>::lookup_entry(Account &account, CodeTable &table) {
+  uint32_t index = in().template peek_word<kFast>(table.root_bits());
+  return find_entry<kFast>(account, table, table.entries()[index]);
+}
+
+template <typename R, typename W>
+template <bool kFast>
+uint32_t Deflater<R, W>::find_entry(Account &account, CodeTable &table, uint32_t entry) {
+  if ((entry & kHuffSubtable) != 0) {
+    in().template skip<kFast>(huff_entry_length(entry), account);
+    uint32_t index = in().template peek_word<kFast>(huff_entry_sub_bits(entry));
+    entry = table.entries()[huff_entry_value(entry) + index];
   }
+  if ((entry & kHuffInvalid) != 0)
+    throw DeflateError();
+  return entry;
 }
 
 template <typename R, typename W>
-void Deflater<R, W>::decode_huffman_codes(Account &account, HuffCode *code,
-    HuffNode *len_root_out, HuffNode *dist_root_out) {
+template <bool kFast>
+uint32_t Deflater<R, W>::consume_entry(Account &account, uint32_t entry) {
+  // The extra bits follow the code so both are read with a single peek.
+  uint32_t length = huff_entry_length(entry);
+  uint32_t width = length + huff_entry_extra_bits(entry);
+  uint32_t value = huff_entry_value(entry) + (in().template peek_word<kFast>(width) >> length);
+  in().template skip<kFast>(width, account);
+  return value;
+}
+
+template <typename R, typename W>
+array<uint32_t> Deflater<R, W>::decode_code_lengths(Account &account,
+    uint32_t *lit_len_count_out) {
   uint32_t num_lit_len_codes = in().template next_word<5>(account) + 257;
   uint32_t num_dist_codes = in().template next_word<5>(account) + 1;
   uint32_t num_code_len_codes = in().template next_word<4>(account) + 4;
@@ -160,10 +326,14 @@ void Deflater<R, W>::decode_huffman_codes(Account &account, HuffCode *code,
     uint32_t index = ((i & 1) == 0) ? (8 + i / 2) : (7 - i / 2);
     code_len_code_len[index] = in().template next_word<3>(account);
   }
-  HuffNode code_len_code = code->new_code_tree(code_len_code_len);
+  {
+    ZIPPROF_PHASE(&timer_, DecodePhase::CODE_TREES);
+    if (!code_len_table_.build(code_len_code_len, CodeTable::kCodeLenRootBits,
+        arena_.alloc<uint32_t>(CodeTable::kCodeLenCapacity)))
+      throw DeflateError();
+  }
   uint32_t code_lens_len = num_lit_len_codes + num_dist_codes;
-  uint32_t *code_lens_buf = new uint32_t[code_lens_len];
-  array<uint32_t> code_lens(code_lens_buf, code_lens_len);
+  array<uint32_t> code_lens = arena_.alloc<uint32_t>(code_lens_len);
   code_lens.fill(0);
   int32_t run_val = -1;
   int32_t run_len = 0;
@@ -173,7 +343,7 @@ void Deflater<R, W>::decode_huffman_codes(Account &account, HuffCode *code,
       run_len--;
       i++;
     } else {
-      uint32_t symbol = decode_symbol(account, code, code_len_code);
+      uint32_t symbol = decode_symbol<false>(account, code_len_table_);
       if (0 <= symbol && symbol <= 15) {
         code_lens[i] = symbol;
         run_val = symbol;
@@ -189,22 +359,24 @@ void Deflater<R, W>::decode_huffman_codes(Account &account, HuffCode *code,
       }
     }
   }
-  *len_root_out = code->new_code_tree(code_lens.slice(0, num_lit_len_codes));
-  *dist_root_out = code->new_code_tree(code_lens.slice(num_lit_len_codes));
-  delete[] code_lens_buf;
+  *lit_len_count_out = num_lit_len_codes;
+  return code_lens;
 }
 
 template <typename R, typename W>
 void Deflater<R, W>::decompress_raw(Account &block_account) {
+  ZIPPROF_PHASE(&timer_, DecodePhase::STORED);
   in().ensure_aligned(block_account);
   uint32_t len = in().next_short(block_account);
   uint32_t nlen = in().next_short(block_account);
   if ((nlen ^ 0xFFFF) != len)
     throw DeflateError();
+  Account bytes_account;
+  array<const uint8_t> bytes = in().next_bytes(len, bytes_account);
+  bytes_account.close();
   for (uint32_t i = 0; i < len; i++) {
-    Account next_account;
-    uint8_t next = in().next_byte(next_account);
-    out().add(next, next_account.close());
+    ZIPPROF_PHASE(&timer_, DecodePhase::WRITER);
+    out().add(bytes[i], 8);
   }
 }
 
@@ -219,7 +391,40 @@ uint32_t Account::close() {
 }
 
 Account::~Account() {
-  ASSERT(bit_count_ == 0);
+  // Bits may be left unaccounted when decoding is abandoned on an error.
+  ASSERT(bit_count_ == 0 || std::uncaught_exception());
+}
+
+uint32_t PhaseTimer::switch_to(uint32_t phase) {
+  uint64_t now = cycle_count();
+  if (current_ != kNoPhase && !counters_.empty()) {
+    PhaseCounters *row = &counters_[counters_.size() - DeflateTimings::kPhaseCount];
+    row[current_].cycles += now - last_;
+  }
+  last_ = now;
+  uint32_t previous = current_;
+  current_ = phase;
+  return previous;
+}
+
+void PhaseTimer::count(uint32_t phase) {
+  if (!counters_.empty())
+    counters_[counters_.size() - DeflateTimings::kPhaseCount + phase].events++;
+}
+
+PhaseScope::PhaseScope(PhaseTimer *timer, DecodePhase phase)
+    : timer_(timer)
+    , previous_(PhaseTimer::kNoPhase) {
+  if (timer_ == NULL)
+    return;
+  uint32_t index = static_cast<uint32_t>(phase);
+  previous_ = timer_->switch_to(index);
+  timer_->count(index);
+}
+
+PhaseScope::~PhaseScope() {
+  if (timer_ != NULL)
+    timer_->switch_to(previous_);
 }
 
 template <typename R>
@@ -232,7 +437,7 @@ template <typename R>
 template <uint32_t W>
 uint32_t InputTracker<R>::next_word(Account &account) {
   account.inc(W);
-  return reader().next_word<W>();
+  return reader().template next_word<W>();
 }
 
 template <typename R>
@@ -260,14 +465,52 @@ uint8_t InputTracker<R>::ensure_aligned(Account &account) {
   return result;
 }
 
+template <typename R>
+array<const uint8_t> InputTracker<R>::next_bytes(uint32_t count, Account &account) {
+  array<const uint8_t> result;
+  if (!reader().next_bytes(count, &result))
+    throw DeflateError();
+  account.inc(count * 8);
+  return result;
+}
+
+template <typename R>
+uint32_t InputTracker<R>::peek_word(uint32_t width) {
+  return reader().peek_word(width);
+}
+
+template <typename R>
+void InputTracker<R>::skip(uint32_t width, Account &account) {
+  account.inc(width);
+  reader().skip_bits(width);
+}
+
+template <typename R>
+template <bool kFast>
+uint32_t InputTracker<R>::peek_word(uint32_t width) {
+  return kFast ? reader().peek_word_fast(width) : reader().peek_word(width);
+}
+
+template <typename R>
+template <bool kFast>
+void InputTracker<R>::skip(uint32_t width, Account &account) {
+  account.inc(width);
+  if (kFast)
+    reader().skip_bits_fast(width);
+  else
+    reader().skip_bits(width);
+}
+
 template <typename W>
-OutputTracker<W>::OutputTracker(uint32_t size, W &out)
-    : buf_(new uint8_t[size])
+OutputTracker<W>::OutputTracker(uint32_t size, W &out, PhaseTimer *timer)
+    : buf_(kOwnHistory ? new uint8_t[size] : NULL)
     , size_(size)
     , mask_(size - 1)
     , out_cur_(0)
     , copy_cur_(0)
-    , out_(out) { }
+    , base_(0)
+    , out_(out)
+    , timer_(timer) { }
 
 template <typename W>
 OutputTracker<W>::~OutputTracker() {
@@ -277,18 +520,89 @@ OutputTracker<W>::~OutputTracker() {
 template <typename W>
 void OutputTracker<W>::add(uint8_t value, uint32_t bit_size) {
   out().append(value, bit_size);
-  buf_[out_cur_++ & mask_] = value;
+  if (kOwnHistory)
+    buf_[out_cur_ & mask_] = value;
+  out_cur_++;
+}
+
+template <typename W>
+void OutputTracker<W>::add_literals(uint64_t entry) {
+  uint32_t count = literal_entry_count(entry);
+  if (kOwnHistory) {
+    buf_[out_cur_ & mask_] = literal_entry_value(entry, 0);
+    buf_[(out_cur_ + 1) & mask_] = literal_entry_value(entry, 1);
+    buf_[(out_cur_ + 2) & mask_] = literal_entry_value(entry, 2);
+  }
+  for (uint32_t i = 0; i < count; i++)
+    out().append(literal_entry_value(entry, i), literal_entry_length(entry, i));
+  out_cur_ += count;
 }
 
 template <typename W>
 void OutputTracker<W>::copy(uint32_t dist, uint32_t len, uint32_t bit_size) {
-  uint32_t start = out_cur_ - dist;
-  for (uint32_t i = 0; i < len; i++) {
-    uint32_t pos = start + i;
-    uint8_t value = buf_[pos & mask_];
-    out().copy(value, pos, copy_cur_, bit_size);
-    buf_[out_cur_++ & mask_] = value;
+  if (dist > out_cur_)
+    throw DeflateError();
+  out().match(out_cur_ - base_, dist, len, bit_size);
+  uint64_t start = out_cur_ - dist;
+  if (!kOwnHistory) {
+    // Overlapping copies read what earlier iterations wrote, which the
+    // writer has by then.
+    for (uint32_t i = 0; i < len; i++) {
+      uint64_t pos = start + i;
+      copied((pos < base_) ? dictionary_[pos] : out().history(pos - base_), pos, bit_size);
+    }
+    out_cur_ += len;
+  } else if (copy_chunks(start, len)) {
+    for (uint32_t i = 0; i < len; i++)
+      copied(buf_[(out_cur_ + i) & mask_], start + i, bit_size);
+    out_cur_ += len;
+  } else {
+    for (uint32_t i = 0; i < len; i++) {
+      uint8_t value = buf_[(start + i) & mask_];
+      copied(value, start + i, bit_size);
+      buf_[out_cur_++ & mask_] = value;
+    }
   }
   copy_cur_++;
 }
 
+template <typename W>
+bool OutputTracker<W>::copy_chunks(uint64_t start, uint32_t len) {
+  uint32_t from = start & mask_;
+  uint32_t to = out_cur_ & mask_;
+  uint32_t end = len + kCopyChunk;
+  // Every chunk must only read bytes that are in place before it is written,
+  // which is the case when the distance is at least the chunk size, and
+  // neither range may wrap.
+  if (out_cur_ - start < kCopyChunk || from + end > size_ || to + end > size_)
+    return false;
+  for (uint32_t i = 0; i < len; i += kCopyChunk)
+    memcpy(buf_ + to + i, buf_ + from + i, kCopyChunk);
+  return true;
+}
+
+template <typename W>
+void OutputTracker<W>::copied(uint8_t value, uint64_t pos, uint32_t bit_size) {
+  if (W::kWholeCopies)
+    return;
+  ZIPPROF_PHASE(timer_, DecodePhase::WRITER);
+  if (pos < base_)
+    out().borrow(value, copy_cur_, bit_size);
+  else
+    out().copy(value, pos - base_, copy_cur_, bit_size);
+}
+
+template <typename W>
+void OutputTracker<W>::prime(array<const uint8_t> dictionary) {
+  ASSERT(out_cur_ == 0);
+  uint32_t start = (dictionary.size() > size_) ? (dictionary.size() - size_) : 0;
+  if (kOwnHistory) {
+    for (uint32_t i = start; i < dictionary.size(); i++)
+      buf_[out_cur_++ & mask_] = dictionary[i];
+  } else {
+    dictionary_ = dictionary.slice(start);
+    out_cur_ = dictionary_.size();
+  }
+  base_ = out_cur_;
+}
+
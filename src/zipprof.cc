@@ -2,12 +2,15 @@
 // Use of this code is governed by the terms defined in LICENSE.
 
 #include "zipprof_impl.hh"
+#include "kernels.hh"
 #include "zip_inl.hh"
 #include "utils_inl.hh"
 
 #define ZLIB_CONST 1
 #include <zlib.h>
 
+#include <algorithm>
+
 using namespace zipprof;
 
 class ZlibOutput : public Compressor::Output {
@@ -31,9 +34,20 @@ static Array<const uint8_t> strip_zlib_header(Array<const uint8_t> data_arr) {
   uint8_t flg = data[1];
   ASSERT(((cmf * 256) + flg) % 31 == 0);
   uint8_t fdict = (flg >> 5) & 0x1;
-  ASSERT(fdict == 0);
   uint8_t level = (flg >> 6) & 0x3;
-  return Array<const uint8_t>(data.begin() + 2, data.size());
+  // If a preset dictionary was used the header is followed by its adler32.
+  uint32_t header_size = (fdict == 0) ? 2 : 6;
+  return Array<const uint8_t>(data.begin() + header_size, data.size() - header_size);
+}
+
+// Like strip_zlib_header but reads the header off the start of the reader.
+static void skip_zlib_header(impl::StreamBitReader &reader) {
+  uint8_t cmf = reader.next_byte();
+  ASSERT(cmf == 0x78);
+  uint8_t flg = reader.next_byte();
+  ASSERT(((cmf * 256) + flg) % 31 == 0);
+  if ((flg >> 5) & 0x1)
+    reader.skip_bits(32);
 }
 
 Array<const uint8_t> ZlibOutput::contents() {
@@ -45,6 +59,8 @@ public:
   ZlibCompressor(uint32_t level)
       : level_(level) { }
   virtual ZlibOutput *compress(Array<const uint8_t> data) const override;
+  virtual ZlibOutput *compress_with_dictionary(Array<const uint8_t> data,
+      Array<const uint8_t> dictionary) const override;
 
 private:
   friend class Compressor;
@@ -56,6 +72,11 @@ private:
 };
 
 ZlibOutput *ZlibCompressor::compress(Array<const uint8_t> input) const {
+  return compress_with_dictionary(input, Array<const uint8_t>(NULL, 0));
+}
+
+ZlibOutput *ZlibCompressor::compress_with_dictionary(Array<const uint8_t> input,
+    Array<const uint8_t> dictionary) const {
   z_stream stream;
   memset(&stream, 0, sizeof(stream));
   stream.zalloc = Z_NULL;
@@ -64,23 +85,30 @@ ZlibOutput *ZlibCompressor::compress(Array<const uint8_t> input) const {
   stream.avail_in = input.size();
   stream.next_in = reinterpret_cast<const Bytef*>(input.begin());
   uint8_t buf[4096];
-  stream.next_out = buf;
-  stream.avail_out = 4096;
   if (deflateInit(&stream, level_) != Z_OK)
     return NULL;
+  if (dictionary.size() > 0) {
+    const Bytef *dict = reinterpret_cast<const Bytef*>(dictionary.begin());
+    if (deflateSetDictionary(&stream, dict, dictionary.size()) != Z_OK) {
+      ::deflateEnd(&stream);
+      return NULL;
+    }
+  }
   ZlibOutput *output = new ZlibOutput();
-  uint32_t last_total_out = 0;
   bool keep_going = true;
   while (keep_going) {
+    // The buffer is flushed to the output after each call so it can be reused.
+    stream.next_out = buf;
+    stream.avail_out = sizeof(buf);
     int res = deflate(&stream, Z_FINISH);
-    if (res < 0) {
+    if (res == Z_STREAM_ERROR) {
+      ::deflateEnd(&stream);
       delete output;
       return NULL;
     } else if (res == Z_STREAM_END) {
       keep_going = false;
     }
-    output->append(Array<uint8_t>(buf, stream.total_out - last_total_out));
-    last_total_out = stream.total_out;
+    output->append(Array<uint8_t>(buf, sizeof(buf) - stream.avail_out));
   }
   ::deflateEnd(&stream);
   return output;
@@ -90,6 +118,11 @@ const ZlibCompressor ZlibCompressor::kBestSpeed(Z_BEST_SPEED);
 const ZlibCompressor ZlibCompressor::kBestCompression(Z_BEST_COMPRESSION);
 const ZlibCompressor ZlibCompressor::kNoCompression(Z_NO_COMPRESSION);
 
+Compressor::Output *Compressor::compress_with_dictionary(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary) const {
+  return (dictionary.size() == 0) ? compress(data) : NULL;
+}
+
 const Compressor &Compressor::zlib_best_speed() {
   return ZlibCompressor::kBestSpeed;
 }
@@ -102,17 +135,148 @@ const Compressor &Compressor::zlib_no_compression() {
   return ZlibCompressor::kNoCompression;
 }
 
-DeflateProfile Profiler::profile_deflated(Array<const uint8_t> data) {
+typedef impl::Deflater<impl::ArrayBitReader, impl::ProfilingByteWriter> ProfilingDeflater;
+typedef impl::Deflater<impl::ArrayBitReader, impl::SummaryByteWriter> SummaryDeflater;
+typedef impl::Deflater<impl::ArrayBitReader, impl::VisitingByteWriter> VisitingDeflater;
+typedef impl::Deflater<impl::StreamBitReader, impl::SummaryByteWriter> StreamSummaryDeflater;
+
+#ifdef ZIPPROF_HAVE_AVX2
+// The whole decoder inlined into one function built for avx2 and bmi2, which
+// turns bit extraction into bzhi and shrx and match copies into 32-byte moves.
+template <typename D>
+ZIPPROF_TARGET_AVX2 __attribute__((flatten))
+static void deflate_avx2(D &deflater) {
+  deflater.deflate();
+}
+#endif
+
+template <typename D>
+static void deflate(D &deflater) {
+#ifdef ZIPPROF_HAVE_AVX2
+  if (impl::cpu_level() >= impl::CpuLevel::AVX2) {
+    deflate_avx2(deflater);
+    return;
+  }
+#endif
+  deflater.deflate();
+}
+
+DeflateProfile Profiler::profile(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary, uint32_t deflated_size) {
   impl::ArrayBitReader reader(data);
   impl::ProfilingByteWriter writer;
-  impl::Deflater<impl::ArrayBitReader, impl::ProfilingByteWriter> deflater(reader, writer);
-  deflater.deflate();
-  return writer.flush(data.size());
+  ProfilingDeflater deflater(reader, writer);
+  deflater.set_dictionary(dictionary);
+  deflate(deflater);
+  DeflateProfile::Impl *impl = writer.flush(deflated_size);
+  impl->timings_.swap(deflater.timings());
+  impl->table_cache_hits_ = deflater.table_cache().hits();
+  impl->table_cache_misses_ = deflater.table_cache().misses();
+  impl->block_decoders_.swap(deflater.block_decoders());
+  return DeflateProfile(impl);
+}
+
+DeflateProfile Profiler::profile_deflated(Array<const uint8_t> data) {
+  return profile_deflated(data, Array<const uint8_t>(NULL, 0));
+}
+
+DeflateProfile Profiler::profile_deflated(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary) {
+  return profile(data, dictionary, data.size());
 }
 
 DeflateProfile Profiler::profile_zlib(Array<const uint8_t> data) {
+  return profile_zlib(data, Array<const uint8_t>(NULL, 0));
+}
+
+DeflateProfile Profiler::profile_zlib(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary) {
+  Array<const uint8_t> stripped = strip_zlib_header(data);
+  return profile(stripped, dictionary, data.size());
+}
+
+DeflateSummary Profiler::summarize(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary, uint64_t deflated_size) {
+  impl::ArrayBitReader reader(data);
+  impl::SummaryByteWriter writer;
+  SummaryDeflater deflater(reader, writer);
+  deflater.set_dictionary(dictionary);
+  deflate(deflater);
+  return writer.flush(deflated_size);
+}
+
+DeflateSummary Profiler::summarize_deflated(Array<const uint8_t> data) {
+  return summarize_deflated(data, Array<const uint8_t>(NULL, 0));
+}
+
+DeflateSummary Profiler::summarize_deflated(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary) {
+  return summarize(data, dictionary, data.size());
+}
+
+DeflateSummary Profiler::summarize_zlib(Array<const uint8_t> data) {
+  return summarize_zlib(data, Array<const uint8_t>(NULL, 0));
+}
+
+DeflateSummary Profiler::summarize_zlib(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary) {
   Array<const uint8_t> stripped = strip_zlib_header(data);
-  return profile_deflated(stripped);
+  return summarize(stripped, dictionary, data.size());
+}
+
+DeflateSummary Profiler::summarize(ByteSource &source,
+    Array<const uint8_t> dictionary, bool zlib) {
+  impl::StreamBitReader reader(source);
+  if (zlib)
+    skip_zlib_header(reader);
+  impl::SummaryByteWriter writer;
+  StreamSummaryDeflater deflater(reader, writer);
+  deflater.set_dictionary(dictionary);
+  deflate(deflater);
+  // Like the in-memory version the deflated size includes what comes after
+  // the deflated data, such as zlib's checksum.
+  return writer.flush(reader.drain());
+}
+
+DeflateSummary Profiler::summarize_deflated(ByteSource &source) {
+  return summarize_deflated(source, Array<const uint8_t>(NULL, 0));
+}
+
+DeflateSummary Profiler::summarize_deflated(ByteSource &source,
+    Array<const uint8_t> dictionary) {
+  return summarize(source, dictionary, false);
+}
+
+DeflateSummary Profiler::summarize_zlib(ByteSource &source) {
+  return summarize_zlib(source, Array<const uint8_t>(NULL, 0));
+}
+
+DeflateSummary Profiler::summarize_zlib(ByteSource &source,
+    Array<const uint8_t> dictionary) {
+  return summarize(source, dictionary, true);
+}
+
+void Profiler::visit_deflated(Array<const uint8_t> data, ProfileVisitor &visitor) {
+  visit_deflated(data, Array<const uint8_t>(NULL, 0), visitor);
+}
+
+void Profiler::visit_deflated(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary, ProfileVisitor &visitor) {
+  impl::ArrayBitReader reader(data);
+  impl::VisitingByteWriter writer(visitor);
+  VisitingDeflater deflater(reader, writer);
+  deflater.set_dictionary(dictionary);
+  deflate(deflater);
+  writer.flush();
+}
+
+void Profiler::visit_zlib(Array<const uint8_t> data, ProfileVisitor &visitor) {
+  visit_zlib(data, Array<const uint8_t>(NULL, 0), visitor);
+}
+
+void Profiler::visit_zlib(Array<const uint8_t> data,
+    Array<const uint8_t> dictionary, ProfileVisitor &visitor) {
+  visit_deflated(strip_zlib_header(data), dictionary, visitor);
 }
 
 DeflateProfile Profiler::profile_string(std::string str, const Compressor &compressor) {
@@ -146,6 +310,15 @@ uint32_t DeflateProfile::block_count() {
   return impl().block_stats_.size();
 }
 
+Array<const BlockStat> DeflateProfile::blocks() {
+  std::vector<BlockStat> &stats = impl().block_stats_;
+  return Array<const BlockStat>(stats.data(), stats.size());
+}
+
+MatchStats DeflateProfile::match_stats() {
+  return impl().match_stats_;
+}
+
 uint32_t DeflateProfile::literal_weight(uint32_t index) {
   return impl().literal_weights()[impl().origins()[index]];
 }
@@ -154,58 +327,664 @@ double DeflateProfile::literal_contribution(uint32_t index) {
   return 1.0 / literal_weight(index);
 }
 
+uint32_t DeflateProfile::origin(uint32_t index) {
+  return impl().origins()[index];
+}
+
+void DeflateProfile::build_copy_index() {
+  impl().build_copy_index();
+}
+
+CopyPositions DeflateProfile::copies_of(uint32_t index) {
+  impl().build_copy_index();
+  array<uint32_t> offsets = impl().copy_offsets_;
+  const uint32_t *positions = impl().copy_positions_.begin();
+  return CopyPositions(positions + offsets[index], positions + offsets[index + 1]);
+}
+
+uint32_t DeflateProfile::copy_depth(uint32_t index) {
+  return impl().copy_depths()[index];
+}
+
+DepthStats DeflateProfile::depth_stats() {
+  return depth_stats(0, inflated_size());
+}
+
+DepthStats DeflateProfile::depth_stats(uint32_t start, uint32_t end) {
+  ASSERT(start <= end && end <= inflated_size());
+  array<uint32_t> depths = impl().copy_depths();
+  DepthStats result;
+  memset(&result, 0, sizeof(result));
+  uint64_t depth_sum = 0;
+  for (uint32_t i = start; i < end; i++) {
+    uint32_t depth = depths[i];
+    result.histogram[DepthStats::depth_bucket(depth)]++;
+    result.max_depth = std::max(result.max_depth, depth);
+    depth_sum += depth;
+  }
+  if (end > start)
+    result.mean_depth = static_cast<double>(depth_sum) / (end - start);
+  return result;
+}
+
+double DeflateProfile::bit_cost(uint32_t index) {
+  return static_cast<double>(impl().bit_costs()[index]) / Impl::kBitCostUnit;
+}
+
+void DeflateProfile::bit_costs(uint32_t start, Array<double> costs) {
+  array<uint64_t> fixed = impl().bit_costs().slice(start, start + costs.size());
+  for (uint32_t i = 0; i < fixed.size(); i++)
+    costs.begin()[i] = static_cast<double>(fixed[i]) / Impl::kBitCostUnit;
+}
+
+void DeflateProfile::build_range_index() {
+  impl().build_range_index();
+}
+
+RangeTotals DeflateProfile::range_totals(uint32_t start, uint32_t end) {
+  impl().build_range_index();
+  return impl().range_totals(start, end);
+}
+
+void DeflateProfile::segment_totals(Array<const Segment> segments, Array<RangeTotals> totals) {
+  ASSERT(segments.size() <= totals.size());
+  impl().build_range_index();
+  for (size_t i = 0; i < segments.size(); i++) {
+    Segment segment = segments.begin()[i];
+    totals.begin()[i] = impl().range_totals(segment.offset, segment.offset + segment.length);
+  }
+}
+
+std::vector<HotRegion> DeflateProfile::hottest_regions(uint32_t window, uint32_t k) {
+  return impl().hottest_regions(window, k);
+}
+
+std::vector<CopiedByte> DeflateProfile::most_copied(uint32_t k) {
+  return impl().most_copied(k);
+}
+
 Array<const uint8_t> DeflateProfile::contents() {
-  array<const uint8_t> raw_contents = impl().contents();
+  array<const uint8_t> raw_contents = impl().contents_;
   return Array<const uint8_t>(raw_contents.begin(), raw_contents.size());
 }
 
+DeflateTimings DeflateProfile::timings() {
+  return DeflateTimings(impl_);
+}
+
+const uint32_t DeflateSummary::kContributionBucketCount;
+
+double DeflateSummary::bits_per_byte() {
+  return (inflated_size == 0) ? 0 : (deflated_size * 8.0) / inflated_size;
+}
+
+uint32_t DeflateSummary::contribution_bucket(double contribution) {
+  return static_cast<uint32_t>(contribution * (kContributionBucketCount - 1));
+}
+
+const uint32_t MatchStats::kMaxLength;
+const uint32_t MatchStats::kDistanceBucketCount;
+
+uint64_t MatchStats::copied_within(uint32_t window_bits) {
+  uint64_t result = 0;
+  for (uint32_t i = 0; i <= window_bits && i < kDistanceBucketCount; i++)
+    result += distance_bytes[i];
+  return result;
+}
+
+double MatchStats::copied_share_within(uint32_t window_bits) {
+  if (copied_bytes == 0)
+    return 1;
+  return static_cast<double>(copied_within(window_bits)) / copied_bytes;
+}
+
+uint32_t MatchStats::distance_bucket(uint32_t distance) {
+  uint32_t result = bit_length((distance > 0) ? (distance - 1) : 0);
+  return std::min(result, kDistanceBucketCount - 1);
+}
+
+const uint32_t DepthStats::kBucketCount;
+
+uint32_t DepthStats::depth_bucket(uint32_t depth) {
+  return bit_length(depth);
+}
+
+void ProfileVisitor::on_tokens(Array<const ProfileToken> tokens) {
+  const ProfileToken *token = tokens.begin();
+  for (size_t i = 0; i < tokens.size(); i++, token++) {
+    if (token->dist == 0)
+      on_literal(token->pos, token->value, token->bits);
+    else
+      on_copy(token->pos, token->pos - token->dist, token->len, token->dist, token->bits);
+  }
+}
+
+const uint32_t DeflateTimings::kPhaseCount;
+const uint32_t DeflateTimings::kDecoderCount;
+
+bool DeflateTimings::enabled() {
+#ifdef ZIPPROF_TIMINGS
+  return true;
+#else
+  return false;
+#endif
+}
+
+uint32_t DeflateTimings::block_count() {
+  if (!impl_)
+    return 0;
+  return impl_->timings_.size() / kPhaseCount;
+}
+
+PhaseCounters DeflateTimings::total(DecodePhase phase) {
+  PhaseCounters result = {0, 0};
+  for (uint32_t i = 0; i < block_count(); i++) {
+    PhaseCounters counters = block(i, phase);
+    result.cycles += counters.cycles;
+    result.events += counters.events;
+  }
+  return result;
+}
+
+PhaseCounters DeflateTimings::block(uint32_t index, DecodePhase phase) {
+  ASSERT(index < block_count());
+  return impl_->timings_[index * kPhaseCount + static_cast<uint32_t>(phase)];
+}
+
+uint64_t DeflateTimings::table_cache_lookups() {
+  if (!impl_)
+    return 0;
+  return impl_->table_cache_hits_ + impl_->table_cache_misses_;
+}
+
+uint64_t DeflateTimings::table_cache_hits() {
+  if (!impl_)
+    return 0;
+  return impl_->table_cache_hits_;
+}
+
+BlockDecoder DeflateTimings::decoder(uint32_t index) {
+  ASSERT(impl_ && index < impl_->block_decoders_.size());
+  return impl_->block_decoders_[index];
+}
+
+const char *DeflateTimings::decoder_name(BlockDecoder decoder) {
+  switch (decoder) {
+  case BlockDecoder::STORED: return "stored";
+  case BlockDecoder::FIXED: return "fixed";
+  case BlockDecoder::TABLE: return "table";
+  case BlockDecoder::CACHED_TABLE: return "cached_table";
+  case BlockDecoder::CANONICAL: return "canonical";
+  }
+  return NULL;
+}
+
+const char *DeflateTimings::phase_name(DecodePhase phase) {
+  switch (phase) {
+  case DecodePhase::HEADERS: return "headers";
+  case DecodePhase::CODE_TREES: return "code_trees";
+  case DecodePhase::SYMBOLS: return "symbols";
+  case DecodePhase::COPIES: return "copies";
+  case DecodePhase::STORED: return "stored";
+  case DecodePhase::WRITER: return "writer";
+  }
+  return NULL;
+}
+
 DeflateProfile::Impl::Impl(uint32_t deflated_size, uint32_t inflated_size,
-    uint32_t literal_count, array<ByteStat> byte_stats, array<BlockStat> block_stats)
+    uint32_t literal_count, array<ByteStat> byte_stats, array<uint8_t> contents)
     : deflated_size_(deflated_size)
     , inflated_size_(inflated_size)
     , literal_count_(literal_count)
     , byte_stats_(byte_stats)
-    , block_stats_(block_stats) { }
+    , contents_(contents)
+    , table_cache_hits_(0)
+    , table_cache_misses_(0) {
+  memset(&match_stats_, 0, sizeof(match_stats_));
+}
 
 array<uint32_t> DeflateProfile::Impl::origins() {
   if (origins_.begin() == NULL) {
     origins_ = array<uint32_t>(new uint32_t[inflated_size_], inflated_size_);
-    memset(origins_.begin(), 0, origins_.size() * sizeof(uint32_t));
-    for (uint32_t i = 0; i < inflated_size_; i++) {
-      ByteStat stat = byte_stats_[i];
-      origins_[i] = (stat.source == i)
-          ? i
-          : origins_[stat.source];
-    }
+    if (thread_count() > 1 && inflated_size_ > kParallelColumnChunk)
+      resolve_origins_parallel(byte_stats_, origins_, kParallelColumnChunk);
+    else
+      resolve_origins(byte_stats_, origins_);
   }
   return origins_;
 }
 
+array<uint32_t> DeflateProfile::Impl::copy_depths() {
+  if (copy_depths_.begin() == NULL) {
+    copy_depths_ = array<uint32_t>(new uint32_t[inflated_size_], inflated_size_);
+    // The origins come out of the same pass whether they're needed or not.
+    if (origins_.begin() == NULL)
+      origins_ = array<uint32_t>(new uint32_t[inflated_size_], inflated_size_);
+    resolve_depths(byte_stats_, origins_, copy_depths_);
+  }
+  return copy_depths_;
+}
+
 array<uint32_t> DeflateProfile::Impl::literal_weights() {
   if (literal_weights_.begin() == NULL) {
     literal_weights_ = array<uint32_t>(new uint32_t[inflated_size_], inflated_size_);
     memset(literal_weights_.begin(), 0, literal_weights_.size() * sizeof(uint32_t));
-    array<uint32_t> origins = this->origins();
-    for (uint32_t i = 0; i < inflated_size_; i++)
-      literal_weights_[origins[i]]++;
+    if (thread_count() > 1 && inflated_size_ > kParallelColumnChunk)
+      count_weights_parallel(origins(), literal_weights_, thread_count());
+    else
+      count_weights(origins(), literal_weights_);
   }
   return literal_weights_;
 }
 
-array<uint8_t> DeflateProfile::Impl::contents() {
-  if (contents_.begin() == NULL) {
-    contents_ = array<uint8_t>(new uint8_t[inflated_size_], inflated_size_);
-    for (uint32_t i = 0; i < inflated_size_; i++)
-      contents_[i] = byte_stats_[i].value;
+const uint32_t DeflateProfile::Impl::kBitCostUnit;
+
+// Adds an even share of the given amount to each of the costs, the remainder
+// going one unit each to the first ones.
+static void spread_bit_cost(uint64_t amount, array<uint64_t> costs) {
+  if (costs.size() == 0)
+    return;
+  uint64_t share = amount / costs.size();
+  uint64_t remainder = amount % costs.size();
+  for (uint32_t i = 0; i < costs.size(); i++)
+    costs[i] += share + (i < remainder ? 1 : 0);
+}
+
+array<uint64_t> DeflateProfile::Impl::bit_costs() {
+  if (bit_costs_.begin() != NULL)
+    return bit_costs_;
+  bit_costs_ = array<uint64_t>(new uint64_t[inflated_size_], inflated_size_);
+  memset(bit_costs_.begin(), 0, bit_costs_.size() * sizeof(uint64_t));
+  uint64_t unspent = static_cast<uint64_t>(deflated_size_) * 8;
+  for (auto block = block_stats_.begin(); block != block_stats_.end(); block++) {
+    // The bits of empty blocks are left for the stream as a whole.
+    if (block->inflated_size == 0)
+      continue;
+    uint32_t start = block->inflated_offset;
+    uint32_t end = start + block->inflated_size;
+    uint64_t token_bits = 0;
+    for (uint32_t i = start; i < end;) {
+      ByteStat &stat = byte_stats_[i];
+      token_bits += stat.bit_size;
+      if (stat.copy == 0) {
+        bit_costs_[i++] = static_cast<uint64_t>(stat.bit_size) * kBitCostUnit;
+        continue;
+      }
+      // The bytes of a copy are consecutive and each has the bits of the
+      // whole copy.
+      uint32_t next = i + 1;
+      while (next < end && byte_stats_[next].copy == stat.copy)
+        next++;
+      spread_bit_cost(static_cast<uint64_t>(stat.bit_size) * kBitCostUnit,
+          bit_costs_.slice(i, next));
+      i = next;
+    }
+    ASSERT(token_bits <= block->bit_count && block->bit_count <= unspent);
+    spread_bit_cost((block->bit_count - token_bits) * kBitCostUnit,
+        bit_costs_.slice(start, end));
+    unspent -= block->bit_count;
+  }
+  spread_bit_cost(unspent * kBitCostUnit, bit_costs_);
+  return bit_costs_;
+}
+
+const uint64_t DeflateProfile::Impl::kContributionUnit;
+const uint32_t DeflateProfile::Impl::kRangeIndexChunk;
+const uint32_t DeflateProfile::Impl::kParallelColumnChunk;
+const uint32_t DeflateProfile::Impl::kCopyIndexChunk;
+const uint32_t DeflateProfile::Impl::kCopyIndexParts;
+const uint32_t DeflateProfile::Impl::kSelectionChunk;
+
+void DeflateProfile::Impl::build_range_index() {
+  if (literal_sums_.begin() != NULL)
+    return;
+  // The columns the sums are built from are built lazily which isn't thread
+  // safe so they have to be in place first.
+  array<uint32_t> origins = this->origins();
+  array<uint32_t> weights = literal_weights();
+  array<uint64_t> costs = bit_costs();
+  uint32_t size = inflated_size_;
+  array<uint32_t> literal_sums(new uint32_t[size + 1], size + 1);
+  array<uint64_t> contribution_sums(new uint64_t[size + 1], size + 1);
+  array<uint64_t> bit_cost_sums(new uint64_t[size + 1], size + 1);
+  // Each chunk is summed separately, leaving the sums relative to the start
+  // of the chunk, then the totals of the chunks before it are added.
+  uint32_t chunk_count = (size + kRangeIndexChunk - 1) / kRangeIndexChunk;
+  parallel_for(chunk_count, [&](uint32_t chunk) {
+    uint32_t start = chunk * kRangeIndexChunk;
+    uint32_t end = std::min(size, start + kRangeIndexChunk);
+    uint32_t literals = 0;
+    uint64_t contribution = 0;
+    uint64_t cost = 0;
+    for (uint32_t i = start; i < end; i++) {
+      literals += (byte_stats_[i].copy == 0);
+      contribution += (kContributionUnit + weights[origins[i]] / 2) / weights[origins[i]];
+      cost += costs[i];
+      literal_sums[i + 1] = literals;
+      contribution_sums[i + 1] = contribution;
+      bit_cost_sums[i + 1] = cost;
+    }
+  });
+  std::vector<uint32_t> literal_offsets(chunk_count);
+  std::vector<uint64_t> contribution_offsets(chunk_count);
+  std::vector<uint64_t> bit_cost_offsets(chunk_count);
+  literal_sums[0] = 0;
+  contribution_sums[0] = 0;
+  bit_cost_sums[0] = 0;
+  for (uint32_t chunk = 1; chunk < chunk_count; chunk++) {
+    uint32_t last = chunk * kRangeIndexChunk;
+    literal_offsets[chunk] = literal_offsets[chunk - 1] + literal_sums[last];
+    contribution_offsets[chunk] = contribution_offsets[chunk - 1] + contribution_sums[last];
+    bit_cost_offsets[chunk] = bit_cost_offsets[chunk - 1] + bit_cost_sums[last];
+  }
+  parallel_for(chunk_count, [&](uint32_t chunk) {
+    if (chunk == 0)
+      return;
+    uint32_t start = chunk * kRangeIndexChunk;
+    uint32_t end = std::min(size, start + kRangeIndexChunk);
+    for (uint32_t i = start; i < end; i++) {
+      literal_sums[i + 1] += literal_offsets[chunk];
+      contribution_sums[i + 1] += contribution_offsets[chunk];
+      bit_cost_sums[i + 1] += bit_cost_offsets[chunk];
+    }
+  });
+  literal_sums_ = literal_sums;
+  contribution_sums_ = contribution_sums;
+  bit_cost_sums_ = bit_cost_sums;
+}
+
+RangeTotals DeflateProfile::Impl::range_totals(uint32_t start, uint32_t end) {
+  ASSERT(start <= end && end <= inflated_size_);
+  RangeTotals result;
+  result.size = end - start;
+  result.literal_count = literal_sums_[end] - literal_sums_[start];
+  result.literal_contribution =
+      static_cast<double>(contribution_sums_[end] - contribution_sums_[start]) / kContributionUnit;
+  result.bit_cost =
+      static_cast<double>(bit_cost_sums_[end] - bit_cost_sums_[start]) / kBitCostUnit;
+  return result;
+}
+
+// Sorts count positions, listed in ascending order by position(j), into the
+// copy index by their origins, which all lie from first up to last. The
+// positions with those origins start at base. The offsets of the origins
+// count the positions with them and then where the next one goes, so they
+// end up one origin ahead and are shifted back at the end.
+template <typename F>
+static void scatter_by_origin(array<uint32_t> origins, uint32_t count, F position,
+    uint32_t first, uint32_t last, uint32_t base, array<uint32_t> offsets,
+    array<uint32_t> positions) {
+  if (first == last)
+    return;
+  for (uint32_t origin = first; origin < last; origin++)
+    offsets[origin] = 0;
+  for (uint32_t j = 0; j < count; j++)
+    offsets[origins[position(j)]]++;
+  uint32_t total = base;
+  for (uint32_t origin = first; origin < last; origin++) {
+    uint32_t origin_count = offsets[origin];
+    offsets[origin] = total;
+    total += origin_count;
+  }
+  for (uint32_t j = 0; j < count; j++) {
+    uint32_t i = position(j);
+    positions[offsets[origins[i]]++] = i;
+  }
+  for (uint32_t origin = last - 1; origin > first; origin--)
+    offsets[origin] = offsets[origin - 1];
+  offsets[first] = base;
+}
+
+// Fills in the copy index by splitting the bytes into part_count parts, both
+// by position and by origin. The positions of each part are first moved to
+// the parts their origins fall within, in order, then each of those parts
+// is sorted into the index on its own. Nothing is ever out of order so the
+// index comes out the same as from a single pass, without any sorting.
+static void fill_copy_index(array<uint32_t> origins, uint32_t part_count,
+    array<uint32_t> offsets, array<uint32_t> positions) {
+  uint32_t size = origins.size();
+  uint32_t part_size = (size + part_count - 1) / part_count;
+  // The number of bytes in each part whose origins fall within each part,
+  // which then become where they're moved to in the buffer.
+  std::vector<uint32_t> moves(static_cast<size_t>(part_count) * part_count);
+  parallel_for(part_count, [&](uint32_t from) {
+    uint32_t start = std::min(size, from * part_size);
+    uint32_t end = std::min(size, start + part_size);
+    uint32_t *counts = moves.data() + static_cast<size_t>(from) * part_count;
+    for (uint32_t i = start; i < end; i++)
+      counts[origins[i] / part_size]++;
+  });
+  // The buffer holds the positions with the origins of each part together,
+  // so they start at the same place as they do in the index.
+  std::vector<uint32_t> part_starts(part_count + 1);
+  uint32_t total = 0;
+  for (uint32_t to = 0; to < part_count; to++) {
+    part_starts[to] = total;
+    for (uint32_t from = 0; from < part_count; from++) {
+      uint32_t &move = moves[static_cast<size_t>(from) * part_count + to];
+      uint32_t count = move;
+      move = total;
+      total += count;
+    }
+  }
+  part_starts[part_count] = total;
+  std::unique_ptr<uint32_t[]> buffer(new uint32_t[size]);
+  parallel_for(part_count, [&](uint32_t from) {
+    uint32_t start = std::min(size, from * part_size);
+    uint32_t end = std::min(size, start + part_size);
+    uint32_t *cursors = moves.data() + static_cast<size_t>(from) * part_count;
+    for (uint32_t i = start; i < end; i++)
+      buffer[cursors[origins[i] / part_size]++] = i;
+  });
+  parallel_for(part_count, [&](uint32_t to) {
+    uint32_t first = std::min(size, to * part_size);
+    uint32_t last = std::min(size, first + part_size);
+    const uint32_t *moved = buffer.get() + part_starts[to];
+    scatter_by_origin(origins, part_starts[to + 1] - part_starts[to],
+        [&](uint32_t j) { return moved[j]; }, first, last, part_starts[to], offsets,
+        positions);
+  });
+}
+
+void DeflateProfile::Impl::build_copy_index() {
+  if (copy_offsets_.begin() != NULL)
+    return;
+  array<uint32_t> origins = this->origins();
+  uint32_t size = inflated_size_;
+  array<uint32_t> offsets(new uint32_t[size + 1], size + 1);
+  array<uint32_t> positions(new uint32_t[size], size);
+  uint32_t part_count = std::min(kCopyIndexParts,
+      (size + kCopyIndexChunk - 1) / kCopyIndexChunk);
+  if (part_count > 1) {
+    fill_copy_index(origins, part_count, offsets, positions);
+  } else {
+    scatter_by_origin(origins, size, [](uint32_t j) { return j; }, 0, size, 0, offsets,
+        positions);
+  }
+  offsets[size] = size;
+  copy_offsets_ = offsets;
+  copy_positions_ = positions;
+}
+
+// A position scored by one of the top-k queries.
+struct Candidate {
+  uint64_t score;
+  uint32_t offset;
+};
+
+// Orders candidates best first: by descending score, then ascending offset.
+static bool is_better(const Candidate &a, const Candidate &b) {
+  return (a.score != b.score) ? (a.score > b.score) : (a.offset < b.offset);
+}
+
+// Returns the best count of the positions up to size as scored by score(i),
+// leaving out any that score 0, in no particular order. The positions are
+// split into chunks that are scanned in parallel, each keeping a heap of its
+// best count with the worst of them on top, so most positions are dismissed
+// with a single comparison and only the survivors of each chunk are merged.
+template <typename F>
+static std::vector<Candidate> select_best(uint32_t size, uint64_t count, F score) {
+  if (count == 0)
+    return std::vector<Candidate>();
+  static const uint32_t kChunk = DeflateProfile::Impl::kSelectionChunk;
+  uint32_t chunk_count = (size + kChunk - 1) / kChunk;
+  std::vector<std::vector<Candidate>> chunks(chunk_count);
+  parallel_for(chunk_count, [&](uint32_t chunk) {
+    std::vector<Candidate> &best = chunks[chunk];
+    uint32_t start = chunk * kChunk;
+    uint32_t end = std::min(size, start + kChunk);
+    for (uint32_t i = start; i < end; i++) {
+      Candidate candidate = {score(i), i};
+      if (candidate.score == 0)
+        continue;
+      if (best.size() < count) {
+        best.push_back(candidate);
+        std::push_heap(best.begin(), best.end(), is_better);
+      } else if (is_better(candidate, best.front())) {
+        std::pop_heap(best.begin(), best.end(), is_better);
+        best.back() = candidate;
+        std::push_heap(best.begin(), best.end(), is_better);
+      }
+    }
+  });
+  std::vector<Candidate> result;
+  for (auto it = chunks.begin(); it != chunks.end(); it++)
+    result.insert(result.end(), it->begin(), it->end());
+  if (count < result.size()) {
+    std::nth_element(result.begin(), result.begin() + count, result.end(), is_better);
+    result.resize(count);
+  }
+  return result;
+}
+
+// Finds the best windows within ranges of window starts. Each window's score
+// is its literal contribution, read off the range index, and the best of
+// each block of starts is found up front so a range only has to be scanned
+// at its ends.
+class WindowScores {
+public:
+  static const uint32_t kBlockSize = 1024;
+
+  WindowScores(array<uint64_t> sums, uint32_t window)
+      : sums_(sums)
+      , window_(window)
+      , start_count_(sums.size() - window)
+      , blocks_((start_count_ + kBlockSize - 1) / kBlockSize) {
+    parallel_for(blocks_.size(), [&](uint32_t block) {
+      uint32_t start = block * kBlockSize;
+      blocks_[block] = scan(start, std::min(start_count_, start + kBlockSize));
+    });
+  }
+
+  uint32_t start_count() { return start_count_; }
+
+  // Returns the best window starting from start up to but not including end,
+  // which must not be empty.
+  Candidate best(uint32_t start, uint32_t end) {
+    uint32_t first_block = (start + kBlockSize - 1) / kBlockSize;
+    uint32_t last_block = end / kBlockSize;
+    if (first_block >= last_block)
+      return scan(start, end);
+    Candidate result = blocks_[first_block];
+    for (uint32_t block = first_block + 1; block < last_block; block++)
+      result = better(result, blocks_[block]);
+    if (start < first_block * kBlockSize)
+      result = better(result, scan(start, first_block * kBlockSize));
+    if (last_block * kBlockSize < end)
+      result = better(result, scan(last_block * kBlockSize, end));
+    return result;
+  }
+
+private:
+  static Candidate better(const Candidate &a, const Candidate &b) {
+    return is_better(b, a) ? b : a;
+  }
+
+  Candidate scan(uint32_t start, uint32_t end) {
+    Candidate result = {0, start};
+    for (uint32_t i = start; i < end; i++) {
+      Candidate candidate = {sums_[i + window_] - sums_[i], i};
+      if (i == start || is_better(candidate, result))
+        result = candidate;
+    }
+    return result;
+  }
+
+  array<uint64_t> sums_;
+  uint32_t window_;
+  uint32_t start_count_;
+  std::vector<Candidate> blocks_;
+};
+
+const uint32_t WindowScores::kBlockSize;
+
+std::vector<HotRegion> DeflateProfile::Impl::hottest_regions(uint32_t window, uint32_t k) {
+  std::vector<HotRegion> result;
+  window = std::min(window, inflated_size_);
+  if (window == 0 || k == 0)
+    return result;
+  build_range_index();
+  WindowScores scores(contribution_sums_, window);
+  // The starts of the windows that don't overlap any picked so far form
+  // disjoint ranges. The greedy pick is the best of the ranges' bests, which
+  // splits its range into the starts before and after the windows it
+  // overlaps.
+  struct Range {
+    Candidate best;
+    uint32_t start;
+    uint32_t end;
+  };
+  auto is_worse = [](const Range &a, const Range &b) { return is_better(b.best, a.best); };
+  std::vector<Range> ranges;
+  auto add_range = [&](uint32_t start, uint32_t end) {
+    if (start >= end)
+      return;
+    Range range = {scores.best(start, end), start, end};
+    ranges.push_back(range);
+    std::push_heap(ranges.begin(), ranges.end(), is_worse);
+  };
+  add_range(0, scores.start_count());
+  while (!ranges.empty() && result.size() < k) {
+    std::pop_heap(ranges.begin(), ranges.end(), is_worse);
+    Range range = ranges.back();
+    ranges.pop_back();
+    uint32_t offset = range.best.offset;
+    HotRegion region;
+    region.offset = offset;
+    region.length = window;
+    region.literal_contribution = static_cast<double>(range.best.score) / kContributionUnit;
+    result.push_back(region);
+    add_range(range.start, (offset >= window) ? (offset - window + 1) : 0);
+    add_range(offset + window, range.end);
+  }
+  return result;
+}
+
+std::vector<CopiedByte> DeflateProfile::Impl::most_copied(uint32_t k) {
+  // Only origins have weights so the rest score 0 and are left out.
+  array<uint32_t> weights = literal_weights();
+  std::vector<Candidate> candidates = select_best(inflated_size_, k,
+      [&](uint32_t i) { return static_cast<uint64_t>(weights[i]); });
+  std::sort(candidates.begin(), candidates.end(), is_better);
+  std::vector<CopiedByte> result(candidates.size());
+  for (size_t i = 0; i < candidates.size(); i++) {
+    result[i].offset = candidates[i].offset;
+    result[i].weight = static_cast<uint32_t>(candidates[i].score);
   }
-  return contents_;
+  return result;
 }
 
 DeflateProfile::Impl::~Impl() {
   delete[] byte_stats_.begin();
-  delete[] block_stats_.begin();
   delete[] origins_.begin();
   delete[] literal_weights_.begin();
+  delete[] copy_depths_.begin();
+  delete[] copy_offsets_.begin();
+  delete[] copy_positions_.begin();
+  delete[] bit_costs_.begin();
+  delete[] literal_sums_.begin();
+  delete[] contribution_sums_.begin();
+  delete[] bit_cost_sums_.begin();
   delete[] contents_.begin();
 }
 
@@ -7,26 +7,86 @@
 #include "zip.hh"
 #include "zipprof.h"
 
+#include <vector>
+
 namespace zipprof {
 
 class DeflateProfile::Impl {
 public:
   Impl(uint32_t deflated_size, uint32_t inflated_size, uint32_t literal_count,
-      impl::array<impl::ByteStat> byte_stats, impl::array<impl::BlockStat> block_stats);
+      impl::array<impl::ByteStat> byte_stats, impl::array<uint8_t> contents);
   ~Impl();
 
   impl::array<uint32_t> origins();
   impl::array<uint32_t> literal_weights();
-  impl::array<uint8_t> contents();
+
+  // The copy depth of each byte. Resolves the origins along the way.
+  impl::array<uint32_t> copy_depths();
+
+  // The bit cost of each byte in units of 1/kBitCostUnit bits. Fixed point
+  // so the costs can be made to add up exactly.
+  impl::array<uint64_t> bit_costs();
+  static const uint32_t kBitCostUnit = 1 << 16;
+
+  // Builds the range index if it hasn't been already.
+  void build_range_index();
+  RangeTotals range_totals(uint32_t start, uint32_t end);
+
+  // Builds the copy index if it hasn't been already.
+  void build_copy_index();
+
+  std::vector<HotRegion> hottest_regions(uint32_t window, uint32_t k);
+  std::vector<CopiedByte> most_copied(uint32_t k);
+
+  // Literal contributions are summed in units of 1/kContributionUnit.
+  static const uint64_t kContributionUnit = 1ULL << 32;
+
+  // The number of bytes the range index is built for by each task.
+  static const uint32_t kRangeIndexChunk = 64 * 1024;
+
+  // The number of bytes whose origins are resolved by each task. Profiles
+  // no larger than this, or when there's only one thread, resolve origins
+  // and count weights with the sequential kernels instead.
+  static const uint32_t kParallelColumnChunk = 1024 * 1024;
+
+  // The fewest bytes the copy index is built for by each task, and the most
+  // parts it's split into. The bytes of each part are counted by the part
+  // their origins fall within so the counts grow with the square of that.
+  static const uint32_t kCopyIndexChunk = 64 * 1024;
+  static const uint32_t kCopyIndexParts = 256;
+
+  // The number of positions the top-k queries select candidates from in
+  // each task.
+  static const uint32_t kSelectionChunk = 1024 * 1024;
 
   uint32_t deflated_size_;
   uint32_t inflated_size_;
   uint32_t literal_count_;
   impl::array<impl::ByteStat> byte_stats_;
-  impl::array<impl::BlockStat> block_stats_;
+  impl::array<uint8_t> contents_;
+  std::vector<BlockStat> block_stats_;
+  // The code lengths the block stats point to.
+  std::vector<uint8_t> code_lengths_;
+  MatchStats match_stats_;
   impl::array<uint32_t> origins_;
   impl::array<uint32_t> literal_weights_;
-  impl::array<uint8_t> contents_;
+  impl::array<uint32_t> copy_depths_;
+  impl::array<uint64_t> bit_costs_;
+  // The range index, inflated_size_ + 1 sums each, of literal counts,
+  // contributions in kContributionUnits and bit costs in kBitCostUnits.
+  impl::array<uint32_t> literal_sums_;
+  impl::array<uint64_t> contribution_sums_;
+  impl::array<uint64_t> bit_cost_sums_;
+  // The copy index: the positions of the bytes with each origin, in order,
+  // and where each origin's start, inflated_size_ + 1 of them.
+  impl::array<uint32_t> copy_offsets_;
+  impl::array<uint32_t> copy_positions_;
+  // DeflateTimings::kPhaseCount counters per block, if timings were collected.
+  std::vector<PhaseCounters> timings_;
+  uint64_t table_cache_hits_;
+  uint64_t table_cache_misses_;
+  // How each block was decoded.
+  std::vector<BlockDecoder> block_decoders_;
 };
 
 } // namespace zipprof
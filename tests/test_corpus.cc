@@ -0,0 +1,127 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "corpus.hh"
+#include "zip_inl.hh"
+#include "io_inl.hh"
+#include "gtest/gtest.h"
+
+#include "testutils_inl.hh"
+
+#include <algorithm>
+
+using namespace zipprof;
+using namespace zipprof::gen;
+using namespace zipprof::impl;
+
+// A writer that records the shape of the deflated stream.
+class ShapeWriter : public ByteWriter {
+public:
+  ShapeWriter()
+      : cursor_(0)
+      , last_copy_(static_cast<uint32_t>(-1))
+      , max_distance_(0)
+      , max_run_copies_(0) { }
+
+  void copy(uint8_t data, uint32_t source, uint32_t copy, uint32_t bit_size) {
+    if (copy != last_copy_) {
+      max_distance_ = std::max(max_distance_, cursor_ - source);
+      if (cursor_ - source == 1)
+        max_run_copies_++;
+      last_copy_ = copy;
+    }
+    contents_.push_back(data);
+    cursor_++;
+  }
+
+  void append(uint8_t data, uint32_t bit_size) {
+    contents_.push_back(data);
+    cursor_++;
+  }
+
+  void borrow(uint8_t data, uint32_t copy, uint32_t bit_size) { append(data, bit_size); }
+  void open_block(uint8_t type) { block_types_.push_back(type); }
+  void close_block(uint32_t bit_count) { }
+
+  std::string contents() { return std::string(contents_.begin(), contents_.end()); }
+  std::vector<uint8_t> &block_types() { return block_types_; }
+  uint32_t max_distance() { return max_distance_; }
+  uint32_t run_copies() { return max_run_copies_; }
+
+  // Returns how many blocks have the given type.
+  uint32_t count_blocks(uint8_t type) {
+    return std::count(block_types_.begin(), block_types_.end(), type);
+  }
+
+private:
+  std::vector<char> contents_;
+  std::vector<uint8_t> block_types_;
+  uint32_t cursor_;
+  uint32_t last_copy_;
+  uint32_t max_distance_;
+  uint32_t max_run_copies_;
+};
+
+static void record_shape(Shape shape, uint64_t size, ShapeWriter &writer,
+    std::string *inflated_out) {
+  std::string zlib;
+  StringSink zlib_sink(zlib);
+  StringSink inflated_sink(*inflated_out);
+  ASSERT_TRUE(Corpus(shape, 7).generate(size, zlib_sink, &inflated_sink));
+  Array<const uint8_t> data = string_to_data(zlib);
+  ArrayBitReader reader(Array<const uint8_t>(data.begin() + 2, data.size() - 6));
+  Deflater<ArrayBitReader, ShapeWriter> deflater(reader, writer);
+  deflater.deflate();
+  EXPECT_EQ(*inflated_out, writer.contents());
+  EXPECT_EQ(size, inflated_out->size());
+}
+
+TEST(corpus, stored) {
+  ShapeWriter writer;
+  std::string inflated;
+  record_shape(Shape::STORED, 256 * 1024, writer, &inflated);
+  EXPECT_LT(0, writer.block_types().size());
+  EXPECT_EQ(writer.block_types().size(), writer.count_blocks(0));
+}
+
+TEST(corpus, runs) {
+  ShapeWriter writer;
+  std::string inflated;
+  record_shape(Shape::RUNS, 256 * 1024, writer, &inflated);
+  // Nearly everything should be copied from one byte back.
+  EXPECT_LT(256 * 1024 / 258 / 2, writer.run_copies());
+}
+
+TEST(corpus, far_copies) {
+  ShapeWriter writer;
+  std::string inflated;
+  record_shape(Shape::FAR_COPIES, 256 * 1024, writer, &inflated);
+  EXPECT_EQ(Corpus::kFarDistance, writer.max_distance());
+}
+
+TEST(corpus, tiny_blocks) {
+  ShapeWriter writer;
+  std::string inflated;
+  record_shape(Shape::TINY_BLOCKS, 64 * 1024, writer, &inflated);
+  EXPECT_LT(64 * 1024 / Corpus::kTinyBlockSize / 2, writer.count_blocks(2));
+}
+
+TEST(corpus, fixed) {
+  ShapeWriter writer;
+  std::string inflated;
+  record_shape(Shape::FIXED, 256 * 1024, writer, &inflated);
+  EXPECT_EQ(writer.block_types().size(), writer.count_blocks(1));
+}
+
+TEST(corpus, deterministic) {
+  std::vector<Shape> shapes = Corpus::all_shapes();
+  for (auto it = shapes.begin(); it != shapes.end(); it++) {
+    Shape shape;
+    EXPECT_TRUE(Corpus::parse_shape(Corpus::shape_name(*it), &shape));
+    EXPECT_EQ(*it, shape);
+    std::string first = Corpus(*it, 1).generate(100000);
+    EXPECT_LT(0, first.size());
+    EXPECT_EQ(first, Corpus(*it, 1).generate(100000));
+    EXPECT_NE(first, Corpus(*it, 2).generate(100000));
+  }
+}
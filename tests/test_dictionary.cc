@@ -0,0 +1,76 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "zipprof.h"
+#include "gtest/gtest.h"
+
+#include "testutils_inl.hh"
+
+using namespace zipprof;
+
+TEST(dictionary, profile_with_dictionary) {
+  std::string lipsum = read_file("../tests/data/lipsum.txt");
+  Array<const uint8_t> data = string_to_data(lipsum);
+  Compressor::Output *output =
+      Compressor::zlib_best_compression().compress_with_dictionary(data, data);
+  DeflateProfile profile = Profiler::profile_deflated(output->contents(), data);
+  delete output;
+  EXPECT_EQ(lipsum.size(), profile.inflated_size());
+  EXPECT_EQ(lipsum, data_to_string(profile.contents()));
+  // Almost everything can be copied straight from the dictionary.
+  EXPECT_GT(4, profile.literal_count());
+}
+
+static std::string make_message(uint32_t index) {
+  std::stringstream buf;
+  buf << "{\"event\": \"session_update\", \"user_id\": " << (index * 7919 % 10007)
+      << ", \"client\": \"mobile-android\", \"locale\": \"en_US\", "
+      << "\"status\": \"" << ((index % 3 == 0) ? "active" : "idle") << "\"}";
+  return buf.str();
+}
+
+TEST(dictionary, train) {
+  DictionaryTrainer trainer;
+  std::vector<std::string> messages;
+  for (uint32_t i = 0; i < 64; i++)
+    messages.push_back(make_message(i));
+  for (uint32_t i = 0; i < messages.size(); i++)
+    trainer.add_sample(string_to_data(messages[i]));
+  EXPECT_EQ(64, trainer.sample_count());
+
+  std::string dictionary = trainer.train(1024);
+  EXPECT_LT(0, dictionary.size());
+  EXPECT_GE(1024, dictionary.size());
+  EXPECT_NE(std::string::npos, dictionary.find("mobile-android"));
+
+  DictionarySavings savings = trainer.evaluate(dictionary);
+  EXPECT_EQ(64, savings.sample_count);
+  EXPECT_LT(savings.dictionary_deflated_size, savings.deflated_size / 2);
+  EXPECT_LT(savings.dictionary_literal_count, savings.literal_count / 2);
+}
+
+// A compressor written against the interface before it took dictionaries,
+// which only overrides plain compress.
+class PlainCompressor : public Compressor {
+public:
+  virtual Output *compress(Array<const uint8_t> data) const override {
+    return Compressor::zlib_best_speed().compress(data);
+  }
+};
+
+TEST(dictionary, plain_compressor) {
+  PlainCompressor compressor;
+  std::string lipsum = read_file("../tests/data/lipsum.txt");
+  Array<const uint8_t> data = string_to_data(lipsum);
+  Compressor::Output *output = compressor.compress_with_dictionary(data,
+      Array<const uint8_t>(NULL, 0));
+  ASSERT_TRUE(output != NULL);
+  EXPECT_EQ(lipsum, data_to_string(Profiler::profile_deflated(output->contents()).contents()));
+  delete output;
+  EXPECT_TRUE(compressor.compress_with_dictionary(data, data) == NULL);
+
+  // The trainer can still train with it but has nothing to evaluate.
+  DictionaryTrainer trainer(compressor);
+  trainer.add_sample(data);
+  EXPECT_EQ(0, trainer.evaluate(lipsum.substr(0, 100)).sample_count);
+}
@@ -0,0 +1,239 @@
+// Copyright (c) 2018 Tundra. All right reserved.
+// Use of this code is governed by the terms defined in LICENSE.
+
+#include "corpus.hh"
+#include "kernels.hh"
+#include "gtest/gtest.h"
+
+#include "testutils_inl.hh"
+
+#include <vector>
+
+using namespace zipprof;
+using namespace zipprof::gen;
+using namespace zipprof::impl;
+
+// Lists the levels the cpu supports so a test can try each, restoring the
+// detected level when it goes out of scope.
+class CpuLevels {
+public:
+  ~CpuLevels() { set_cpu_level(detect_cpu_level()); }
+
+  std::vector<CpuLevel> supported() {
+    std::vector<CpuLevel> result;
+    result.push_back(CpuLevel::PORTABLE);
+    if (detect_cpu_level() >= CpuLevel::AVX2)
+      result.push_back(CpuLevel::AVX2);
+    return result;
+  }
+};
+
+TEST(kernels, set_cpu_level) {
+  CpuLevels levels;
+  EXPECT_EQ(detect_cpu_level(), cpu_level());
+  EXPECT_TRUE(set_cpu_level(CpuLevel::PORTABLE));
+  EXPECT_EQ(CpuLevel::PORTABLE, cpu_level());
+  EXPECT_EQ(detect_cpu_level() >= CpuLevel::AVX2, set_cpu_level(CpuLevel::AVX2));
+}
+
+// Builds byte stats for a mix of literals and copies at every distance up to
+// max_dist, including copies from within the same group of 8.
+static std::vector<ByteStat> make_stats(uint32_t count, uint32_t max_dist) {
+  std::vector<ByteStat> stats(count);
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < count; i++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t dist = (seed >> 16) % (max_dist + 1);
+    ByteStat &stat = stats[i];
+    stat.source = (dist == 0 || dist > i) ? i : (i - dist);
+    stat.copy = (stat.source == i) ? 0 : 1;
+    stat.bit_size = 8;
+  }
+  return stats;
+}
+
+TEST(kernels, variants_agree) {
+  static const uint32_t kCount = 10007;
+  static const uint32_t kMaxDists[] = {1, 7, 8, 9, 40, 5000};
+  CpuLevels levels;
+  std::vector<CpuLevel> supported = levels.supported();
+  for (uint32_t d = 0; d < sizeof(kMaxDists) / sizeof(kMaxDists[0]); d++) {
+    std::vector<ByteStat> stats = make_stats(kCount, kMaxDists[d]);
+    array<const ByteStat> stat_array(stats.data(), kCount);
+    std::vector<uint32_t> expected_origins(kCount);
+    std::vector<uint32_t> expected_depths(kCount);
+    std::vector<uint32_t> expected_weights(kCount);
+    for (uint32_t i = 0; i < kCount; i++) {
+      uint32_t source = stats[i].source;
+      expected_origins[i] = (source == i) ? i : expected_origins[source];
+      expected_depths[i] = (source == i) ? 0 : (expected_depths[source] + 1);
+      expected_weights[expected_origins[i]]++;
+    }
+    for (auto it = supported.begin(); it != supported.end(); it++) {
+      ASSERT_TRUE(set_cpu_level(*it));
+      std::vector<uint32_t> origins(kCount);
+      resolve_origins(stat_array, array<uint32_t>(origins.data(), kCount));
+      EXPECT_EQ(expected_origins, origins);
+      std::vector<uint32_t> depth_origins(kCount);
+      std::vector<uint32_t> depths(kCount);
+      resolve_depths(stat_array, array<uint32_t>(depth_origins.data(), kCount),
+          array<uint32_t>(depths.data(), kCount));
+      EXPECT_EQ(expected_origins, depth_origins);
+      EXPECT_EQ(expected_depths, depths);
+      std::vector<uint32_t> weights(kCount);
+      count_weights(array<const uint32_t>(origins.data(), kCount),
+          array<uint32_t>(weights.data(), kCount));
+      EXPECT_EQ(expected_weights, weights);
+    }
+  }
+}
+
+// Returns an array whose element at base is the first of the given vector,
+// so kernels can be run on positions beyond what a test can allocate. Only
+// the elements from base on may be touched.
+template <typename T>
+static array<T> shifted_array(std::vector<T> &elms, uint32_t base) {
+  return array<T>(elms.data() - base, base + static_cast<uint32_t>(elms.size()));
+}
+
+TEST(kernels, high_positions) {
+  // The gathers index with signed 32-bit integers so the positions from 2^31
+  // on have to be handled without them.
+  static const uint32_t kCount = 4096;
+  static const uint32_t kBases[] = {(1U << 31) - kCount / 2 - 3, (1U << 31) + 5,
+      0xFFFFFFFFU - kCount};
+  CpuLevels levels;
+  std::vector<CpuLevel> supported = levels.supported();
+  std::vector<ByteStat> local = make_stats(kCount, 40);
+  std::vector<uint32_t> local_origins(kCount);
+  resolve_origins(array<const ByteStat>(local.data(), kCount),
+      array<uint32_t>(local_origins.data(), kCount));
+  for (uint32_t b = 0; b < sizeof(kBases) / sizeof(kBases[0]); b++) {
+    uint32_t base = kBases[b];
+    std::vector<ByteStat> stats = local;
+    std::vector<uint32_t> expected(kCount);
+    for (uint32_t i = 0; i < kCount; i++) {
+      stats[i].source += base;
+      expected[i] = local_origins[i] + base;
+    }
+    for (auto it = supported.begin(); it != supported.end(); it++) {
+      ASSERT_TRUE(set_cpu_level(*it));
+      std::vector<uint32_t> origins(kCount);
+      resolve_chunk_origins(shifted_array(stats, base), base, shifted_array(origins, base));
+      EXPECT_EQ(expected, origins) << base;
+    }
+  }
+}
+
+TEST(kernels, high_fix_ups) {
+  // A chunk starting beyond 2^31 whose bytes were left pointing into the
+  // chunk before it, also beyond 2^31, and so have to be fixed up without
+  // gathers.
+  static const uint32_t kChunkSize = 2048;
+  static const uint32_t kBases[] = {(1U << 31) - kChunkSize - 5, (1U << 31) + 3,
+      0xFFFFFFFFU - 2 * kChunkSize};
+  CpuLevels levels;
+  std::vector<CpuLevel> supported = levels.supported();
+  for (uint32_t b = 0; b < sizeof(kBases) / sizeof(kBases[0]); b++) {
+    uint32_t base = kBases[b];
+    uint32_t chunk_start = base + kChunkSize;
+    std::vector<uint32_t> unfixed(2 * kChunkSize);
+    std::vector<uint32_t> expected(2 * kChunkSize);
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < 2 * kChunkSize; i++) {
+      seed = seed * 1103515245 + 12345;
+      // The earlier chunk is final, its bytes copied from the few first.
+      uint32_t pos = base + i;
+      if (i < kChunkSize) {
+        unfixed[i] = expected[i] = base + (seed >> 16) % 16;
+      } else if ((seed >> 16) % 3 == 0) {
+        unfixed[i] = expected[i] = pos;
+      } else {
+        unfixed[i] = base + (seed >> 16) % kChunkSize;
+        expected[i] = expected[unfixed[i] - base];
+      }
+    }
+    for (auto it = supported.begin(); it != supported.end(); it++) {
+      ASSERT_TRUE(set_cpu_level(*it));
+      std::vector<uint32_t> origins = unfixed;
+      fix_up_origins(shifted_array(origins, base), chunk_start, chunk_start,
+          chunk_start + kChunkSize);
+      EXPECT_EQ(expected, origins) << base;
+    }
+  }
+}
+
+TEST(kernels, parallel_variants_agree) {
+  // Chunks and parts small enough for most copies to cross them, and ones
+  // that don't divide the count evenly.
+  static const uint32_t kCount = 10007;
+  static const uint32_t kMaxDists[] = {1, 9, 5000};
+  static const uint32_t kChunkSizes[] = {1, 7, 64, 1000, 20000};
+  static const uint32_t kPartCounts[] = {1, 2, 3, 8, 13};
+  CpuLevels levels;
+  std::vector<CpuLevel> supported = levels.supported();
+  std::vector<std::vector<ByteStat>> stat_sets;
+  for (uint32_t d = 0; d < sizeof(kMaxDists) / sizeof(kMaxDists[0]); d++)
+    stat_sets.push_back(make_stats(kCount, kMaxDists[d]));
+  // Everything copied from the first byte, so all parts but the first find
+  // nothing but origins that fall within it.
+  std::vector<ByteStat> skewed = make_stats(kCount, 0);
+  for (uint32_t i = 1; i < kCount; i++) {
+    skewed[i].source = 0;
+    skewed[i].copy = 1;
+  }
+  stat_sets.push_back(skewed);
+  for (uint32_t d = 0; d < stat_sets.size(); d++) {
+    std::vector<ByteStat> &stats = stat_sets[d];
+    array<const ByteStat> stat_array(stats.data(), kCount);
+    std::vector<uint32_t> expected_origins(kCount);
+    resolve_origins(stat_array, array<uint32_t>(expected_origins.data(), kCount));
+    std::vector<uint32_t> expected_weights(kCount);
+    count_weights(array<const uint32_t>(expected_origins.data(), kCount),
+        array<uint32_t>(expected_weights.data(), kCount));
+    for (auto it = supported.begin(); it != supported.end(); it++) {
+      ASSERT_TRUE(set_cpu_level(*it));
+      for (uint32_t c = 0; c < sizeof(kChunkSizes) / sizeof(kChunkSizes[0]); c++) {
+        std::vector<uint32_t> origins(kCount);
+        resolve_origins_parallel(stat_array, array<uint32_t>(origins.data(), kCount),
+            kChunkSizes[c]);
+        EXPECT_EQ(expected_origins, origins) << d << " " << kChunkSizes[c];
+      }
+    }
+    for (uint32_t p = 0; p < sizeof(kPartCounts) / sizeof(kPartCounts[0]); p++) {
+      std::vector<uint32_t> weights(kCount);
+      count_weights_parallel(array<const uint32_t>(expected_origins.data(), kCount),
+          array<uint32_t>(weights.data(), kCount), kPartCounts[p]);
+      EXPECT_EQ(expected_weights, weights) << d << " " << kPartCounts[p];
+    }
+  }
+}
+
+TEST(kernels, profiles_agree) {
+  // Every level has to produce exactly the same profile, including the
+  // decoder which is built separately for each.
+  CpuLevels levels;
+  std::vector<CpuLevel> supported = levels.supported();
+  std::vector<Shape> shapes = Corpus::all_shapes();
+  for (auto shape = shapes.begin(); shape != shapes.end(); shape++) {
+    Corpus corpus(*shape, 7);
+    std::string zlib;
+    std::string inflated;
+    StringSink zlib_sink(zlib);
+    StringSink inflated_sink(inflated);
+    ASSERT_TRUE(corpus.generate(256 * 1024, zlib_sink, &inflated_sink));
+    for (auto it = supported.begin(); it != supported.end(); it++) {
+      ASSERT_TRUE(set_cpu_level(*it));
+      DeflateProfile profile = Profiler::profile_zlib(string_to_data(zlib));
+      EXPECT_EQ(inflated, data_to_string(profile.contents())) << Corpus::shape_name(*shape);
+      // The weights are computed lazily so make sure that happens at this
+      // level before switching.
+      profile.literal_weight(0);
+      set_cpu_level(CpuLevel::PORTABLE);
+      DeflateProfile reference = Profiler::profile_zlib(string_to_data(zlib));
+      EXPECT_EQ(reference.literal_count(), profile.literal_count());
+      for (uint32_t i = 0; i < reference.inflated_size(); i++)
+        ASSERT_EQ(reference.literal_weight(i), profile.literal_weight(i)) << i;
+    }
+  }
+}
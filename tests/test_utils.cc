@@ -13,3 +13,26 @@ TEST(utils, array) {
   EXPECT_EQ(4, arr.size());
   EXPECT_EQ(1, arr[0]);
 }
+
+TEST(utils, arena) {
+  Arena arena(64);
+  array<uint32_t> first = arena.alloc<uint32_t>(4);
+  array<uint8_t> second = arena.alloc<uint8_t>(3);
+  EXPECT_EQ(4, first.size());
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(second.begin()) % 16);
+  EXPECT_EQ(32, arena.used());
+
+  // Running out spills onto the heap until the next reset, after which the
+  // buffer is big enough.
+  array<uint64_t> large = arena.alloc<uint64_t>(16);
+  large.fill(7);
+  EXPECT_EQ(7, large[15]);
+  arena.reset();
+  EXPECT_EQ(0, arena.used());
+  EXPECT_EQ(160, arena.capacity());
+  array<uint64_t> again = arena.alloc<uint64_t>(16);
+  arena.alloc<uint32_t>(8);
+  arena.reset();
+  EXPECT_EQ(160, arena.capacity());
+  EXPECT_EQ(again.begin(), arena.alloc<uint64_t>(16).begin());
+}
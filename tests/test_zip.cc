@@ -70,6 +70,234 @@ TEST(zip, array_bit_reader) {
     }
   }
 
+  {
+    // Shorts and bytes at the very end come from the buffer, never from
+    // beyond the data, and reads past the end are zero.
+    ArrayBitReader reader(array<uint8_t>(elms + 5, 3));
+    EXPECT_EQ(255, reader.next_byte());
+    EXPECT_EQ(0xFF00, reader.next_short());
+    EXPECT_EQ(0, reader.next_short());
+  }
+
+  {
+    // The fast path is only allowed while a whole word remains.
+    ArrayBitReader reader(array<uint8_t>(elms, 8));
+    ASSERT_TRUE(reader.has_slack(8));
+    reader.refill_fast();
+    EXPECT_EQ(213, reader.peek_word_fast(8));
+    reader.skip_bits_fast(8);
+    EXPECT_EQ(154, reader.peek_word_fast(8));
+    EXPECT_FALSE(reader.has_slack(8));
+    // Stored bytes are read straight from the data.
+    reader.skip_bits(8);
+    array<const uint8_t> bytes;
+    ASSERT_TRUE(reader.next_bytes(4, &bytes));
+    EXPECT_EQ(elms + 2, bytes.begin());
+    EXPECT_EQ(0, reader.next_word(8));
+    EXPECT_EQ(255, reader.next_word(8));
+    EXPECT_FALSE(reader.next_bytes(1, &bytes));
+  }
+}
+
+// Checks that the table decodes the canonical code for the given lengths. If
+// symbols is non-NULL the entries must match it rather than hold the symbols.
+static void check_code_table(const uint32_t *table, uint32_t root_bits,
+    array<uint32_t> lengths, const uint32_t *symbols = NULL) {
+  uint32_t bl_count[16] = {0};
+  for (uint32_t i = 0; i < lengths.size(); i++)
+    bl_count[lengths[i]]++;
+  bl_count[0] = 0;
+  uint32_t next_code[16] = {0};
+  for (uint32_t len = 1, code = 0; len < 16; len++) {
+    code = (code + bl_count[len - 1]) << 1;
+    next_code[len] = code;
+  }
+  for (uint32_t symbol = 0; symbol < lengths.size(); symbol++) {
+    uint32_t len = lengths[symbol];
+    if (len == 0)
+      continue;
+    uint32_t code = next_code[len]++;
+    uint32_t expected = (symbols == NULL) ? huff_entry(symbol, 0) : symbols[symbol];
+    uint32_t reversed = 0;
+    for (uint32_t i = 0; i < len; i++)
+      reversed |= ((code >> i) & 1) << (len - 1 - i);
+    if (len <= root_bits) {
+      for (uint32_t index = reversed; index < (1u << root_bits); index += (1u << len)) {
+        EXPECT_EQ(expected | len, table[index]);
+      }
+    } else {
+      uint32_t root = table[reversed & ((1u << root_bits) - 1)];
+      ASSERT_NE(0, root & kHuffSubtable);
+      EXPECT_EQ(root_bits, huff_entry_length(root));
+      uint32_t sub_bits = huff_entry_sub_bits(root);
+      uint32_t sub_len = len - root_bits;
+      ASSERT_LE(sub_len, sub_bits);
+      for (uint32_t index = reversed >> root_bits; index < (1u << sub_bits);
+          index += (1u << sub_len)) {
+        uint32_t entry = table[huff_entry_value(root) + index];
+        EXPECT_EQ(expected | sub_len, entry);
+      }
+    }
+  }
+}
+
+TEST(zip, fixed_tables) {
+  stack_array<uint32_t, 288> len_table;
+  len_table.slice(0, 144).fill(8);
+  len_table.slice(144, 256).fill(9);
+  len_table.slice(256, 280).fill(7);
+  len_table.slice(280, 288).fill(8);
+  check_code_table(FixedHuffman::kLitLen.entries, FixedHuffman::kLitLenBits, len_table,
+      DeflateSymbols::kLitLen.entries);
+  stack_array<uint32_t, 32> dist_table;
+  dist_table.fill(5);
+  check_code_table(FixedHuffman::kDist.entries, FixedHuffman::kDistBits, dist_table,
+      DeflateSymbols::kDist.entries);
+
+  // Building the fixed code at runtime gives the same tables.
+  stack_array<uint32_t, CodeTable::kLitLenCapacity> storage;
+  CodeTable table;
+  ASSERT_TRUE(table.build(len_table, FixedHuffman::kLitLenBits, storage,
+      DeflateSymbols::kLitLen.entries));
+  EXPECT_EQ(1u << FixedHuffman::kLitLenBits, table.size());
+  for (uint32_t i = 0; i < table.size(); i++)
+    EXPECT_EQ(FixedHuffman::kLitLen.entries[i], table.entries()[i]);
+}
+
+TEST(zip, code_table) {
+  // Symbol i has a code of length i + 1, except the last two which share the
+  // longest length, so the long codes go into subtables.
+  stack_array<uint32_t, 20> lengths;
+  for (uint32_t i = 0; i < 15; i++)
+    lengths[i] = i + 1;
+  lengths[15] = 15;
+  lengths[19] = 0;
+  stack_array<uint32_t, CodeTable::kLitLenCapacity> storage;
+  CodeTable table;
+  ASSERT_TRUE(table.build(lengths, CodeTable::kLitLenRootBits, storage));
+  EXPECT_LT(1u << CodeTable::kLitLenRootBits, table.size());
+  check_code_table(table.entries(), CodeTable::kLitLenRootBits, lengths);
+
+  // Over-subscribed codes are rejected.
+  lengths[16] = 1;
+  EXPECT_FALSE(table.build(lengths, CodeTable::kLitLenRootBits, storage));
+
+  // Incomplete codes are allowed but leave invalid entries.
+  lengths.fill(0);
+  lengths[3] = 1;
+  ASSERT_TRUE(table.build(lengths, CodeTable::kDistRootBits, storage));
+  EXPECT_EQ(huff_entry(3, 1), table.entries()[0]);
+  EXPECT_NE(0, table.entries()[1] & kHuffInvalid);
+}
+
+// Checks that the canonical code decodes every input of kPeekBits bits the
+// same way as a code table built from the same lengths.
+static void check_canonical_code(array<uint32_t> lengths, const uint32_t *symbols = NULL) {
+  stack_array<uint32_t, CodeTable::kLitLenCapacity> table_storage;
+  CodeTable table;
+  ASSERT_TRUE(table.build(lengths, CodeTable::kLitLenRootBits, table_storage, symbols));
+  stack_array<uint32_t, 288> storage;
+  CanonicalCode code;
+  ASSERT_TRUE(code.build(lengths, storage, symbols));
+  uint32_t root_mask = (1 << CodeTable::kLitLenRootBits) - 1;
+  for (uint32_t bits = 0; bits < (1u << CanonicalCode::kPeekBits); bits++) {
+    uint32_t expected = table.entries()[bits & root_mask];
+    if ((expected & kHuffSubtable) != 0) {
+      uint32_t index = (bits >> CodeTable::kLitLenRootBits)
+          & ((1 << huff_entry_sub_bits(expected)) - 1);
+      expected = table.entries()[huff_entry_value(expected) + index]
+          + CodeTable::kLitLenRootBits;
+    }
+    uint32_t actual = code.find(bits);
+    if ((expected & kHuffInvalid) != 0)
+      ASSERT_NE(0, actual & kHuffInvalid) << bits;
+    else
+      ASSERT_EQ(expected, actual) << bits;
+  }
+}
+
+TEST(zip, canonical_code) {
+  stack_array<uint32_t, 20> lengths;
+  lengths.fill(0);
+  for (uint32_t i = 0; i < 15; i++)
+    lengths[i] = i + 1;
+  lengths[15] = 15;
+  check_canonical_code(lengths);
+
+  stack_array<uint32_t, 288> fixed_lengths;
+  fixed_lengths.slice(0, 144).fill(8);
+  fixed_lengths.slice(144, 256).fill(9);
+  fixed_lengths.slice(256, 280).fill(7);
+  fixed_lengths.slice(280, 288).fill(8);
+  check_canonical_code(fixed_lengths, DeflateSymbols::kLitLen.entries);
+
+  // Incomplete codes are allowed but leave inputs no code matches.
+  lengths.fill(0);
+  lengths[3] = 1;
+  lengths[5] = 3;
+  check_canonical_code(lengths);
+
+  // Over-subscribed codes are rejected.
+  stack_array<uint32_t, 288> storage;
+  CanonicalCode code;
+  lengths[7] = 1;
+  EXPECT_FALSE(code.build(lengths, storage));
+}
+
+TEST(zip, literal_table) {
+  // Literals 'a' and 'b' have 1 and 2 bit codes, 'c' a 9 bit one and the end
+  // of block code takes what's left.
+  stack_array<uint32_t, 257> lengths;
+  lengths['a'] = 1;
+  lengths['b'] = 2;
+  lengths['c'] = 9;
+  lengths[256] = 9;
+  stack_array<uint32_t, CodeTable::kLitLenCapacity> storage;
+  CodeTable table;
+  ASSERT_TRUE(table.build(lengths, CodeTable::kLitLenRootBits, storage,
+      DeflateSymbols::kLitLen.entries));
+  stack_array<uint64_t, 1 << CodeTable::kLitLenRootBits> literal_storage;
+  LiteralTable literals;
+  literals.build(table, literal_storage);
+  ASSERT_EQ(CodeTable::kLitLenRootBits, literals.root_bits());
+
+  // Three 'a's, the most an entry holds.
+  uint64_t aaa = literals.entries()[0];
+  ASSERT_EQ(3, literal_entry_count(aaa));
+  for (uint32_t i = 0; i < 3; i++) {
+    EXPECT_EQ('a', literal_entry_value(aaa, i));
+    EXPECT_EQ(1, literal_entry_length(aaa, i));
+  }
+  // 'b' then 'a' then 'b', with the codes read from the low bits.
+  uint64_t bab = literals.entries()[0x1 | (0x0 << 2) | (0x1 << 3)];
+  ASSERT_EQ(3, literal_entry_count(bab));
+  EXPECT_EQ('b', literal_entry_value(bab, 0));
+  EXPECT_EQ(2, literal_entry_length(bab, 0));
+  EXPECT_EQ('a', literal_entry_value(bab, 1));
+  EXPECT_EQ('b', literal_entry_value(bab, 2));
+  uint32_t c_code = 0;
+  for (uint32_t i = 0; i < (1u << CodeTable::kLitLenRootBits); i++) {
+    if (table.entries()[i] == (huff_entry('c', 9))) {
+      c_code = i;
+      break;
+    }
+  }
+  // 'a' followed by 'c' just fits.
+  uint64_t ac = literals.entries()[(c_code << 1) & 0x3FF];
+  ASSERT_EQ(2, literal_entry_count(ac));
+  EXPECT_EQ('c', literal_entry_value(ac, 1));
+  EXPECT_EQ(9, literal_entry_length(ac, 1));
+  // 'a' 'a' then 'c' only keeps the two that fit.
+  uint64_t aac = literals.entries()[(c_code << 2) & 0x3FF];
+  EXPECT_EQ(2, literal_entry_count(aac));
+  // 'b' then 'c' only resolves the one literal.
+  EXPECT_EQ(1, literal_entry_count(literals.entries()[(0x1 | (c_code << 2)) & 0x3FF]));
+  // Anything starting with the end of block code holds the root entry.
+  uint32_t end_code = 0;
+  while ((table.entries()[end_code] & kHuffEnd) == 0)
+    end_code++;
+  EXPECT_EQ(0, literal_entry_count(literals.entries()[end_code]));
+  EXPECT_EQ(table.entries()[end_code], literal_entry_code(literals.entries()[end_code]));
 }
 
 class ZLib {
@@ -170,3 +398,87 @@ TEST(zip, archive) {
   EXPECT_EQ(1093, arc->stream("lipsums/3.txt").size());
   EXPECT_EQ(1174, arc->stream("lipsums/4.txt").size());
 }
+
+// Records the bit size of each byte and block.
+class BitSizeWriter : public ByteWriter {
+public:
+  void copy(uint8_t data, uint32_t source, uint32_t copy, uint32_t bit_size) { add(data, bit_size); }
+  void append(uint8_t data, uint32_t bit_size) { add(data, bit_size); }
+  void borrow(uint8_t data, uint32_t copy, uint32_t bit_size) { add(data, bit_size); }
+  void open_block(uint8_t type) { }
+  void close_block(uint32_t bit_count) { block_bits_.push_back(bit_count); }
+
+  std::vector<uint8_t> &contents() { return contents_; }
+  std::vector<uint32_t> &bit_sizes() { return bit_sizes_; }
+  std::vector<uint32_t> &block_bits() { return block_bits_; }
+
+private:
+  void add(uint8_t data, uint32_t bit_size) {
+    contents_.push_back(data);
+    bit_sizes_.push_back(bit_size);
+  }
+
+  std::vector<uint8_t> contents_;
+  std::vector<uint32_t> bit_sizes_;
+  std::vector<uint32_t> block_bits_;
+};
+
+// A bit size writer that copies are read back from.
+class RetainingBitSizeWriter : public BitSizeWriter {
+public:
+  static const bool kRetainsOutput = true;
+  uint8_t history(uint32_t pos) { return contents()[pos]; }
+};
+
+const bool RetainingBitSizeWriter::kRetainsOutput;
+
+template <typename W>
+static void decode_bit_sizes(const std::string &zlib, bool multi_literal,
+    W &writer, uint32_t canonical_limit = 0) {
+  array<const uint8_t> data(reinterpret_cast<const uint8_t*>(zlib.data()), zlib.size());
+  ArrayBitReader reader(data.slice(2, data.size() - 4));
+  Deflater<ArrayBitReader, W> deflater(reader, writer);
+  deflater.set_multi_literal(multi_literal);
+  deflater.set_canonical_limit(canonical_limit);
+  deflater.deflate();
+}
+
+TEST(zip, multi_literal) {
+  // Decoding literals through the literal table reports the same bit sizes as
+  // decoding them one at a time.
+  std::string zlib = read_file("../tests/data/shakespeare.txt.z");
+  BitSizeWriter single;
+  decode_bit_sizes(zlib, false, single);
+  BitSizeWriter multi;
+  decode_bit_sizes(zlib, true, multi);
+  EXPECT_LT(0, single.contents().size());
+  EXPECT_TRUE(single.contents() == multi.contents());
+  EXPECT_TRUE(single.bit_sizes() == multi.bit_sizes());
+  EXPECT_TRUE(single.block_bits() == multi.block_bits());
+}
+
+TEST(zip, canonical_blocks) {
+  // Decoding without tables reports the same bit sizes as decoding with them.
+  std::string zlib = read_file("../tests/data/shakespeare.txt.z");
+  BitSizeWriter tables;
+  decode_bit_sizes(zlib, false, tables);
+  BitSizeWriter canonical;
+  decode_bit_sizes(zlib, false, canonical, static_cast<uint32_t>(-1));
+  EXPECT_LT(0, tables.contents().size());
+  EXPECT_TRUE(tables.contents() == canonical.contents());
+  EXPECT_TRUE(tables.bit_sizes() == canonical.bit_sizes());
+  EXPECT_TRUE(tables.block_bits() == canonical.block_bits());
+}
+
+TEST(zip, retained_output) {
+  // Copying from the writer's output gives the same result as copying from
+  // the tracker's own history.
+  std::string zlib = read_file("../tests/data/shakespeare.txt.z");
+  BitSizeWriter tracked;
+  decode_bit_sizes(zlib, true, tracked);
+  RetainingBitSizeWriter retained;
+  decode_bit_sizes(zlib, true, retained);
+  EXPECT_LT(0, tracked.contents().size());
+  EXPECT_TRUE(tracked.contents() == retained.contents());
+  EXPECT_TRUE(tracked.bit_sizes() == retained.bit_sizes());
+}
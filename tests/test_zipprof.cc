@@ -1,12 +1,14 @@
 // Copyright (c) 2018 Tundra. All right reserved.
 // Use of this code is governed by the terms defined in LICENSE.
 
+#include "corpus.hh"
 #include "zip.hh"
 
 #include "zipprof.h"
 #include "gtest/gtest.h"
 
 #include <zlib.h>
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <chrono>
@@ -40,6 +42,27 @@ DeflateProfile check_fixture(std::string name) {
   return profile;
 }
 
+// Generates a zlib stream of the given inflated size from the given seed for
+// each shape of synthetic corpus and calls fn with the shape's name and the
+// stream.
+template <typename F>
+static void for_each_shape_stream(uint32_t size, uint32_t seed, F fn) {
+  std::vector<gen::Shape> shapes = gen::Corpus::all_shapes();
+  for (auto shape = shapes.begin(); shape != shapes.end(); shape++) {
+    std::string zlib = gen::Corpus(*shape, seed).generate(size);
+    fn(gen::Corpus::shape_name(*shape), string_to_data(zlib));
+  }
+}
+
+// Like for_each_shape_stream but also passes the stream's profile.
+template <typename F>
+static void for_each_shape_profile(uint32_t size, uint32_t seed, F fn) {
+  for_each_shape_stream(size, seed, [&](const char *name, Array<const uint8_t> data) {
+    DeflateProfile profile = Profiler::profile_zlib(data);
+    fn(name, data, profile);
+  });
+}
+
 TEST(zipprof, lipsum) {
   DeflateProfile profile = check_fixture("lipsum.txt");
   EXPECT_EQ(552, profile.literal_count());
@@ -87,3 +110,692 @@ TEST(zipprof, lipsums) {
   EXPECT_EQ(548, l4p.literal_count());
   EXPECT_STREQ("Ut non elit vitae lorem feugiat", l4.substr(0, 31).c_str());
 }
+
+TEST(zipprof, timings) {
+  std::string defl_str = read_file("../tests/data/lipsum.txt.z");
+  DeflateProfile profile = Profiler::profile_zlib(string_to_data(defl_str));
+  DeflateTimings timings = profile.timings();
+  if (!DeflateTimings::enabled()) {
+    EXPECT_EQ(0, timings.block_count());
+    EXPECT_EQ(0, timings.total(DecodePhase::SYMBOLS).events);
+    return;
+  }
+  ASSERT_EQ(profile.block_count(), timings.block_count());
+  EXPECT_EQ(profile.block_count(), timings.total(DecodePhase::HEADERS).events);
+  EXPECT_EQ(profile.inflated_size(), timings.total(DecodePhase::WRITER).events
+      - 2 * profile.block_count());
+  EXPECT_LT(0, timings.total(DecodePhase::SYMBOLS).cycles);
+  EXPECT_LT(0, timings.total(DecodePhase::COPIES).events);
+  uint64_t symbol_events = 0;
+  for (uint32_t i = 0; i < timings.block_count(); i++)
+    symbol_events += timings.block(i, DecodePhase::SYMBOLS).events;
+  EXPECT_EQ(timings.total(DecodePhase::SYMBOLS).events, symbol_events);
+}
+
+TEST(zipprof, table_cache) {
+  // Compressing the same text after each full flush yields identical dynamic
+  // blocks so all but the first should find their tables in the cache.
+  std::string text = read_file("../tests/data/lipsum.txt").substr(0, 2048);
+  static const uint32_t kRepeatCount = 10;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  ASSERT_EQ(Z_OK, deflateInit(&stream, Z_DEFAULT_COMPRESSION));
+  std::vector<uint8_t> out(64 * 1024);
+  stream.next_out = out.data();
+  stream.avail_out = out.size();
+  for (uint32_t i = 0; i < kRepeatCount; i++) {
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+    stream.avail_in = text.size();
+    int flush = (i + 1 == kRepeatCount) ? Z_FINISH : Z_FULL_FLUSH;
+    ASSERT_NE(Z_STREAM_ERROR, deflate(&stream, flush));
+  }
+  ASSERT_EQ(0, stream.avail_in);
+  out.resize(out.size() - stream.avail_out);
+  deflateEnd(&stream);
+
+  DeflateProfile profile = Profiler::profile_zlib(Array<const uint8_t>(out.data(), out.size()));
+  EXPECT_EQ(kRepeatCount * text.size(), profile.inflated_size());
+  DeflateTimings timings = profile.timings();
+  EXPECT_EQ(kRepeatCount, timings.table_cache_lookups());
+  EXPECT_EQ(kRepeatCount - 1, timings.table_cache_hits());
+
+  // A stream with a single block never hits.
+  std::string defl_str = read_file("../tests/data/lipsum.txt.z");
+  DeflateTimings single = Profiler::profile_zlib(string_to_data(defl_str)).timings();
+  EXPECT_EQ(0, single.table_cache_hits());
+}
+
+TEST(zipprof, block_decoders) {
+  // The tiny blocks have codes too short to be worth building tables for.
+  gen::Corpus corpus(gen::Shape::TINY_BLOCKS, 1);
+  std::string tiny = corpus.generate(16 * gen::Corpus::kTinyBlockSize);
+  DeflateProfile tiny_profile = Profiler::profile_zlib(string_to_data(tiny));
+  DeflateTimings tiny_timings = tiny_profile.timings();
+  ASSERT_LT(1, tiny_profile.block_count());
+  uint32_t canonical = 0;
+  for (uint32_t i = 0; i < tiny_profile.block_count(); i++) {
+    if (tiny_timings.decoder(i) == BlockDecoder::CANONICAL)
+      canonical++;
+  }
+  EXPECT_LT(0, canonical);
+  EXPECT_EQ(tiny_profile.block_count() - canonical, tiny_timings.table_cache_lookups());
+
+  // Big blocks always get tables.
+  std::string defl_str = read_file("../tests/data/shakespeare.txt.z");
+  DeflateProfile profile = Profiler::profile_zlib(string_to_data(defl_str));
+  DeflateTimings timings = profile.timings();
+  for (uint32_t i = 0; i < profile.block_count(); i++)
+    EXPECT_EQ(BlockDecoder::TABLE, timings.decoder(i));
+  EXPECT_STREQ("canonical", DeflateTimings::decoder_name(BlockDecoder::CANONICAL));
+}
+
+// Checks that the summary of the given stream agrees with its full profile.
+static void check_summary(const char *name, Array<const uint8_t> zlib) {
+  DeflateProfile profile = Profiler::profile_zlib(zlib);
+  DeflateSummary summary = Profiler::summarize_zlib(zlib);
+  EXPECT_EQ(profile.deflated_size(), summary.deflated_size) << name;
+  EXPECT_EQ(profile.inflated_size(), summary.inflated_size) << name;
+  EXPECT_EQ(profile.literal_count(), summary.literal_count) << name;
+  EXPECT_EQ(profile.block_count(), summary.block_count) << name;
+  uint64_t histogram[DeflateSummary::kContributionBucketCount] = {0};
+  for (uint32_t i = 0; i < profile.inflated_size(); i++)
+    histogram[DeflateSummary::contribution_bucket(profile.literal_contribution(i))]++;
+  for (uint32_t i = 0; i < DeflateSummary::kContributionBucketCount; i++)
+    EXPECT_EQ(histogram[i], summary.contribution_histogram[i]) << name << " " << i;
+}
+
+// Hands out the given data in chunks of the given size.
+class ChunkedSource : public ByteSource {
+public:
+  ChunkedSource(Array<const uint8_t> data, size_t chunk_size)
+      : data_(data), chunk_size_(chunk_size), cursor_(0) { }
+
+  virtual Array<const uint8_t> next_chunk() override {
+    size_t size = std::min(chunk_size_, data_.size() - cursor_);
+    Array<const uint8_t> result(data_.begin() + cursor_, size);
+    cursor_ += size;
+    return result;
+  }
+
+private:
+  Array<const uint8_t> data_;
+  size_t chunk_size_;
+  size_t cursor_;
+};
+
+static void expect_same_summary(DeflateSummary expected, DeflateSummary actual,
+    const std::string &name) {
+  EXPECT_EQ(expected.deflated_size, actual.deflated_size) << name;
+  EXPECT_EQ(expected.inflated_size, actual.inflated_size) << name;
+  EXPECT_EQ(expected.literal_count, actual.literal_count) << name;
+  EXPECT_EQ(expected.block_count, actual.block_count) << name;
+  for (uint32_t i = 0; i < DeflateSummary::kContributionBucketCount; i++) {
+    EXPECT_EQ(expected.contribution_histogram[i], actual.contribution_histogram[i])
+        << name << " " << i;
+  }
+}
+
+TEST(zipprof, summary_stream) {
+  // Chunks smaller than a refill, odd sizes that split words and headers,
+  // and chunks larger than the reader's buffer.
+  static const size_t kChunkSizes[] = {1, 7, 4093, 1024 * 1024};
+  auto check_chunked = [&](const char *name, Array<const uint8_t> data) {
+    DeflateSummary expected = Profiler::summarize_zlib(data);
+    for (uint32_t i = 0; i < sizeof(kChunkSizes) / sizeof(kChunkSizes[0]); i++) {
+      ChunkedSource source(data, kChunkSizes[i]);
+      std::stringstream chunked_name;
+      chunked_name << name << " in chunks of " << kChunkSizes[i];
+      expect_same_summary(expected, Profiler::summarize_zlib(source), chunked_name.str());
+    }
+  };
+  for_each_shape_stream(256 * 1024, 5, check_chunked);
+  std::string shakespeare = read_file("../tests/data/shakespeare.txt.z");
+  check_chunked("shakespeare", string_to_data(shakespeare));
+  // Stored blocks are read in one go so they have to fit in the buffer.
+  std::string lipsum = read_file("../tests/data/lipsum-big.txt");
+  std::string text;
+  while (text.size() < 200 * 1024)
+    text += lipsum;
+  Compressor::Output *output = Compressor::zlib_no_compression().compress_with_dictionary(
+      string_to_data(text), string_to_data(lipsum));
+  Array<const uint8_t> deflated = output->contents();
+  DeflateSummary expected = Profiler::summarize_deflated(deflated, string_to_data(lipsum));
+  ChunkedSource source(deflated, 3);
+  DeflateSummary actual = Profiler::summarize_deflated(source, string_to_data(lipsum));
+  delete output;
+  EXPECT_EQ(text.size(), actual.inflated_size);
+  expect_same_summary(expected, actual, "stored");
+}
+
+TEST(zipprof, summary) {
+  for_each_shape_stream(512 * 1024, 3, check_summary);
+  std::string shakespeare = read_file("../tests/data/shakespeare.txt.z");
+  check_summary("shakespeare", string_to_data(shakespeare));
+  // Bytes borrowed from a dictionary are origins of their own, like literals.
+  std::string lipsum = read_file("../tests/data/lipsum.txt");
+  Compressor::Output *output = Compressor::zlib_best_compression().compress_with_dictionary(
+      string_to_data(lipsum), string_to_data(lipsum));
+  Array<const uint8_t> deflated = output->contents();
+  DeflateProfile profile = Profiler::profile_deflated(deflated, string_to_data(lipsum));
+  DeflateSummary summary = Profiler::summarize_deflated(deflated, string_to_data(lipsum));
+  delete output;
+  EXPECT_EQ(profile.inflated_size(), summary.inflated_size);
+  EXPECT_EQ(profile.literal_count(), summary.literal_count);
+  uint64_t never_copied = 0;
+  for (uint32_t i = 0; i < profile.inflated_size(); i++)
+    never_copied += (profile.literal_weight(i) == 1);
+  EXPECT_EQ(never_copied,
+      summary.contribution_histogram[DeflateSummary::kContributionBucketCount - 1]);
+}
+
+// Rebuilds the output from the tokens it is visited with, given the preset
+// dictionary if there is one.
+class RebuildingVisitor : public ProfileVisitor {
+public:
+  RebuildingVisitor(const std::string &dictionary = "")
+      : contents_(dictionary.begin(), dictionary.end())
+      , dictionary_size_(dictionary.size())
+      , literal_count_(0)
+      , block_count_(0)
+      , bits_(0) { }
+
+  virtual void on_block(uint32_t type, uint32_t header_bits) override {
+    block_count_++;
+    bits_ += header_bits;
+  }
+
+  virtual void on_literal(uint64_t pos, uint8_t value, uint32_t bits) override {
+    EXPECT_EQ(contents_.size(), dictionary_size_ + pos);
+    contents_.push_back(value);
+    literal_count_++;
+    bits_ += bits;
+  }
+
+  virtual void on_copy(uint64_t pos, uint64_t src, uint32_t len, uint32_t dist,
+      uint32_t bits) override {
+    EXPECT_EQ(contents_.size(), dictionary_size_ + pos);
+    EXPECT_EQ(pos - dist, src);
+    // Copies from the dictionary wrap around to it.
+    uint64_t start = dictionary_size_ + src;
+    for (uint32_t i = 0; i < len; i++)
+      contents_.push_back(contents_[start + i]);
+    bits_ += bits;
+  }
+
+  std::string contents() {
+    return std::string(contents_.begin() + dictionary_size_, contents_.end());
+  }
+  uint32_t literal_count() { return literal_count_; }
+  uint32_t block_count() { return block_count_; }
+  uint64_t bits() { return bits_; }
+
+private:
+  std::vector<uint8_t> contents_;
+  size_t dictionary_size_;
+  uint32_t literal_count_;
+  uint32_t block_count_;
+  uint64_t bits_;
+};
+
+// Only counts blocks and token batches, asking for no tokens.
+class BlockVisitor : public ProfileVisitor {
+public:
+  BlockVisitor() : block_count_(0), batch_count_(0) { }
+
+  virtual bool wants_literals() override { return false; }
+  virtual bool wants_copies() override { return false; }
+
+  virtual void on_block(uint32_t type, uint32_t header_bits) override { block_count_++; }
+
+  virtual void on_tokens(Array<const ProfileToken> tokens) override {
+    batch_count_++;
+    ProfileVisitor::on_tokens(tokens);
+  }
+
+  uint32_t block_count() { return block_count_; }
+  uint32_t batch_count() { return batch_count_; }
+
+private:
+  uint32_t block_count_;
+  uint32_t batch_count_;
+};
+
+// Counts batches and copies while leaving literals to the default, which
+// mustn't stop copies from being delivered.
+class ForwardingVisitor : public ProfileVisitor {
+public:
+  ForwardingVisitor() : batch_count_(0), copy_count_(0) { }
+
+  virtual void on_tokens(Array<const ProfileToken> tokens) override {
+    batch_count_++;
+    ProfileVisitor::on_tokens(tokens);
+  }
+
+  virtual void on_copy(uint64_t pos, uint64_t src, uint32_t len, uint32_t dist,
+      uint32_t bits) override {
+    copy_count_++;
+  }
+
+  uint32_t batch_count() { return batch_count_; }
+  uint64_t copy_count() { return copy_count_; }
+
+private:
+  uint32_t batch_count_;
+  uint64_t copy_count_;
+};
+
+TEST(zipprof, visitor) {
+  for_each_shape_profile(256 * 1024, 5, [&](const char *name, Array<const uint8_t> data,
+      DeflateProfile &profile) {
+    RebuildingVisitor rebuilding;
+    Profiler::visit_zlib(data, rebuilding);
+    EXPECT_EQ(data_to_string(profile.contents()), rebuilding.contents()) << name;
+    EXPECT_EQ(profile.literal_count(), rebuilding.literal_count()) << name;
+    EXPECT_EQ(profile.block_count(), rebuilding.block_count()) << name;
+    // Everything but the zlib framing and the padding of the last byte.
+    uint64_t stream_bits = (profile.deflated_size() - 6) * 8;
+    EXPECT_LE(rebuilding.bits(), stream_bits) << name;
+    EXPECT_GT(rebuilding.bits() + 8, stream_bits) << name;
+    // A visitor that wants no tokens gets no batches but still sees every
+    // block.
+    BlockVisitor blocks;
+    Profiler::visit_zlib(data, blocks);
+    EXPECT_EQ(profile.block_count(), blocks.block_count()) << name;
+    EXPECT_EQ(0, blocks.batch_count()) << name;
+    ForwardingVisitor forwarding;
+    Profiler::visit_zlib(data, forwarding);
+    EXPECT_EQ(profile.match_stats().match_count, forwarding.copy_count()) << name;
+  });
+  // Copies from a preset dictionary reach back before the output.
+  std::string lipsum = read_file("../tests/data/lipsum.txt");
+  Compressor::Output *output = Compressor::zlib_best_compression().compress_with_dictionary(
+      string_to_data(lipsum), string_to_data(lipsum));
+  DeflateProfile profile = Profiler::profile_deflated(output->contents(),
+      string_to_data(lipsum));
+  RebuildingVisitor rebuilding(lipsum);
+  Profiler::visit_deflated(output->contents(), string_to_data(lipsum), rebuilding);
+  delete output;
+  EXPECT_EQ(lipsum, rebuilding.contents());
+  EXPECT_EQ(profile.literal_count(), rebuilding.literal_count());
+  EXPECT_GT(10, rebuilding.literal_count());
+}
+
+// Collects the matches of a stream.
+class MatchVisitor : public ProfileVisitor {
+public:
+  virtual bool wants_literals() override { return false; }
+
+  virtual void on_copy(uint64_t pos, uint64_t src, uint32_t len, uint32_t dist,
+      uint32_t bits) override {
+    ProfileToken token = {pos, dist, len, bits, 0};
+    matches_.push_back(token);
+  }
+
+  std::vector<ProfileToken> &matches() { return matches_; }
+
+private:
+  std::vector<ProfileToken> matches_;
+};
+
+TEST(zipprof, block_stats) {
+  for_each_shape_profile(256 * 1024, 9, [&](const char *name, Array<const uint8_t> data,
+      DeflateProfile &profile) {
+    MatchVisitor visitor;
+    Profiler::visit_zlib(data, visitor);
+    std::vector<ProfileToken> &matches = visitor.matches();
+    Array<const BlockStat> blocks = profile.blocks();
+    ASSERT_EQ(profile.block_count(), blocks.size()) << name;
+    uint64_t bit_offset = 0;
+    uint32_t inflated_offset = 0;
+    uint32_t literal_count = 0;
+    size_t next_match = 0;
+    for (uint32_t i = 0; i < blocks.size(); i++) {
+      BlockStat block = blocks.begin()[i];
+      // The blocks cover the stream and the output without gaps.
+      EXPECT_EQ(bit_offset, block.bit_offset) << name << " " << i;
+      EXPECT_EQ(inflated_offset, block.inflated_offset) << name << " " << i;
+      EXPECT_LE(block.header_bits, block.bit_count) << name << " " << i;
+      bit_offset += block.bit_count;
+      inflated_offset += block.inflated_size;
+      literal_count += block.literal_count;
+      uint32_t match_count = 0;
+      uint64_t length_sum = 0;
+      uint32_t max_distance = 0;
+      for (; next_match < matches.size() && matches[next_match].pos < inflated_offset;
+          next_match++) {
+        match_count++;
+        length_sum += matches[next_match].len;
+        max_distance = std::max(max_distance, matches[next_match].dist);
+      }
+      EXPECT_EQ(match_count, block.match_count) << name << " " << i;
+      EXPECT_EQ(max_distance, block.max_match_distance) << name << " " << i;
+      if (match_count > 0) {
+        EXPECT_DOUBLE_EQ(static_cast<double>(length_sum) / match_count,
+            block.mean_match_length) << name << " " << i;
+      }
+      EXPECT_EQ(block.inflated_size, block.literal_count + length_sum) << name << " " << i;
+      if (block.type == 2) {
+        // Every code has an end of block symbol.
+        EXPECT_LE(257, block.lit_len_lengths.size()) << name << " " << i;
+        EXPECT_LT(0, block.lit_len_lengths.begin()[256]) << name << " " << i;
+        EXPECT_LE(1, block.dist_lengths.size()) << name << " " << i;
+      } else {
+        EXPECT_EQ(0, block.lit_len_lengths.size()) << name << " " << i;
+        EXPECT_EQ(0, block.dist_lengths.size()) << name << " " << i;
+      }
+    }
+    EXPECT_EQ(profile.inflated_size(), inflated_offset) << name;
+    EXPECT_EQ(profile.literal_count(), literal_count) << name;
+    // Everything but the zlib framing and the padding of the last byte.
+    uint64_t stream_bits = (profile.deflated_size() - 6) * 8;
+    EXPECT_LE(bit_offset, stream_bits) << name;
+    EXPECT_GT(bit_offset + 8, stream_bits) << name;
+  });
+}
+
+TEST(zipprof, match_stats) {
+  EXPECT_EQ(0, MatchStats::distance_bucket(1));
+  EXPECT_EQ(1, MatchStats::distance_bucket(2));
+  EXPECT_EQ(2, MatchStats::distance_bucket(3));
+  EXPECT_EQ(2, MatchStats::distance_bucket(4));
+  EXPECT_EQ(10, MatchStats::distance_bucket(1024));
+  EXPECT_EQ(11, MatchStats::distance_bucket(1025));
+  EXPECT_EQ(15, MatchStats::distance_bucket(32768));
+  for_each_shape_profile(256 * 1024, 10, [&](const char *name, Array<const uint8_t> data,
+      DeflateProfile &profile) {
+    MatchVisitor visitor;
+    Profiler::visit_zlib(data, visitor);
+    std::vector<ProfileToken> &matches = visitor.matches();
+    std::vector<uint64_t> lengths(MatchStats::kMaxLength + 1);
+    std::vector<uint64_t> within(MatchStats::kDistanceBucketCount);
+    uint64_t copied_bytes = 0;
+    for (auto it = matches.begin(); it != matches.end(); it++) {
+      lengths[it->len]++;
+      copied_bytes += it->len;
+      for (uint32_t bits = 0; bits < MatchStats::kDistanceBucketCount; bits++) {
+        if (it->dist <= (1U << bits))
+          within[bits] += it->len;
+      }
+    }
+    MatchStats stats = profile.match_stats();
+    EXPECT_EQ(matches.size(), stats.match_count) << name;
+    EXPECT_EQ(copied_bytes, stats.copied_bytes) << name;
+    EXPECT_EQ(profile.inflated_size(), profile.literal_count() + copied_bytes) << name;
+    for (uint32_t len = 0; len <= MatchStats::kMaxLength; len++)
+      EXPECT_EQ(lengths[len], stats.length_histogram[len]) << name << " " << len;
+    uint64_t bucketed = 0;
+    for (uint32_t bits = 0; bits < MatchStats::kDistanceBucketCount; bits++) {
+      EXPECT_EQ(within[bits], stats.copied_within(bits)) << name << " " << bits;
+      bucketed += stats.distance_histogram[bits];
+    }
+    EXPECT_EQ(stats.match_count, bucketed) << name;
+    EXPECT_EQ(copied_bytes, stats.copied_within(15)) << name;
+  });
+  // Far copies can't be made from a window any smaller than the full one.
+  std::string far = gen::Corpus(gen::Shape::FAR_COPIES, 10).generate(256 * 1024);
+  MatchStats far_stats = Profiler::profile_zlib(string_to_data(far)).match_stats();
+  EXPECT_LT(0.9, far_stats.copied_share_within(15));
+  EXPECT_GT(0.1, far_stats.copied_share_within(14));
+  // Nothing copied means nothing lost either.
+  std::string stored = gen::Corpus(gen::Shape::STORED, 10).generate(64 * 1024);
+  MatchStats stored_stats = Profiler::profile_zlib(string_to_data(stored)).match_stats();
+  EXPECT_EQ(0, stored_stats.match_count);
+  EXPECT_EQ(1, stored_stats.copied_share_within(10));
+}
+
+TEST(zipprof, copy_depths) {
+  EXPECT_EQ(0, DepthStats::depth_bucket(0));
+  EXPECT_EQ(1, DepthStats::depth_bucket(1));
+  EXPECT_EQ(2, DepthStats::depth_bucket(2));
+  EXPECT_EQ(2, DepthStats::depth_bucket(3));
+  EXPECT_EQ(3, DepthStats::depth_bucket(4));
+  EXPECT_EQ(32, DepthStats::depth_bucket(0xFFFFFFFF));
+  for_each_shape_profile(128 * 1024, 12, [&](const char *name, Array<const uint8_t> data,
+      DeflateProfile &profile) {
+    MatchVisitor visitor;
+    Profiler::visit_zlib(data, visitor);
+    std::vector<ProfileToken> &matches = visitor.matches();
+    uint32_t size = profile.inflated_size();
+    std::vector<uint32_t> depths(size);
+    for (auto it = matches.begin(); it != matches.end(); it++) {
+      for (uint32_t i = 0; i < it->len; i++)
+        depths[it->pos + i] = depths[it->pos + i - it->dist] + 1;
+    }
+    std::vector<uint64_t> histogram(DepthStats::kBucketCount);
+    uint64_t depth_sum = 0;
+    for (uint32_t i = 0; i < size; i++) {
+      ASSERT_EQ(depths[i], profile.copy_depth(i)) << name << " " << i;
+      histogram[DepthStats::depth_bucket(depths[i])]++;
+      depth_sum += depths[i];
+    }
+    // Asking for the depths first must leave the origins just the same.
+    DeflateProfile fresh = Profiler::profile_zlib(data);
+    for (uint32_t i = 0; i < size; i++) {
+      ASSERT_EQ(fresh.origin(i), profile.origin(i)) << name << " " << i;
+      ASSERT_EQ(fresh.literal_weight(i), profile.literal_weight(i)) << name << " " << i;
+    }
+    DepthStats stats = profile.depth_stats();
+    for (uint32_t b = 0; b < DepthStats::kBucketCount; b++)
+      EXPECT_EQ(histogram[b], stats.histogram[b]) << name << " " << b;
+    EXPECT_EQ(*std::max_element(depths.begin(), depths.end()), stats.max_depth) << name;
+    EXPECT_DOUBLE_EQ(static_cast<double>(depth_sum) / size, stats.mean_depth) << name;
+    DepthStats first = profile.depth_stats(0, 1);
+    EXPECT_EQ(1, first.histogram[0]) << name;
+    DepthStats empty = profile.depth_stats(size, size);
+    EXPECT_EQ(0, empty.max_depth) << name;
+    EXPECT_EQ(0, empty.mean_depth) << name;
+  });
+}
+
+TEST(zipprof, bit_costs) {
+  for_each_shape_profile(128 * 1024, 11, [&](const char *name, Array<const uint8_t> data,
+      DeflateProfile &profile) {
+    uint32_t size = profile.inflated_size();
+    std::vector<double> costs(size);
+    profile.bit_costs(0, Array<double>(costs.data(), size));
+    double total = 0;
+    for (uint32_t i = 0; i < size; i++) {
+      ASSERT_EQ(profile.bit_cost(i), costs[i]) << name << " " << i;
+      total += costs[i];
+    }
+    // Exactly, not just approximately.
+    EXPECT_EQ(profile.deflated_size() * 8.0, total) << name;
+    std::vector<double> tail(10);
+    profile.bit_costs(size - 10, Array<double>(tail.data(), 10));
+    EXPECT_EQ(profile.bit_cost(size - 1), tail[9]) << name;
+  });
+  // The bytes of a match share its bits rather than each being charged with
+  // all of them.
+  DeflateProfile runs = Profiler::profile_zlib(string_to_data(
+      gen::Corpus(gen::Shape::RUNS, 1).generate(64 * 1024)));
+  uint32_t cheap_count = 0;
+  for (uint32_t i = 0; i < runs.inflated_size(); i++)
+    cheap_count += (runs.bit_cost(i) < 1);
+  EXPECT_LT(runs.inflated_size() * 0.9, cheap_count);
+}
+
+// Marks which bytes of a stream are literals.
+class LiteralVisitor : public ProfileVisitor {
+public:
+  virtual bool wants_copies() override { return false; }
+
+  virtual void on_literal(uint64_t pos, uint8_t value, uint32_t bits) override {
+    literals_.resize(pos + 1);
+    literals_[pos] = true;
+  }
+
+  bool is_literal(uint32_t pos) { return pos < literals_.size() && literals_[pos]; }
+
+private:
+  std::vector<bool> literals_;
+};
+
+TEST(zipprof, range_totals) {
+  std::string zlib = gen::Corpus(gen::Shape::TEXT, 13).generate(300 * 1024);
+  DeflateProfile profile = Profiler::profile_zlib(string_to_data(zlib));
+  LiteralVisitor literals;
+  Profiler::visit_zlib(string_to_data(zlib), literals);
+  uint32_t size = profile.inflated_size();
+  profile.build_range_index();
+  RangeTotals all = profile.range_totals(0, size);
+  EXPECT_EQ(size, all.size);
+  EXPECT_EQ(profile.literal_count(), all.literal_count);
+  EXPECT_EQ(profile.deflated_size() * 8.0, all.bit_cost);
+  EXPECT_NEAR(profile.literal_count(), all.literal_contribution, 1e-3);
+  // Ranges with and without the start and end of the chunks the index is
+  // built in, and random ones.
+  std::vector<Segment> segments;
+  Segment fixed[] = {{0, 0}, {0, 1}, {size - 1, 1}, {65535, 2}, {65536, 65536},
+      {1000, 200000}, {size, 0}};
+  segments.insert(segments.end(), fixed, fixed + sizeof(fixed) / sizeof(fixed[0]));
+  uint32_t seed = 3;
+  for (uint32_t i = 0; i < 20; i++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t offset = seed % size;
+    seed = seed * 1103515245 + 12345;
+    segments.push_back({offset, (seed >> 8) % (size - offset)});
+  }
+  std::vector<RangeTotals> totals(segments.size());
+  profile.segment_totals(Array<const Segment>(segments.data(), segments.size()),
+      Array<RangeTotals>(totals.data(), totals.size()));
+  for (uint32_t i = 0; i < segments.size(); i++) {
+    Segment segment = segments[i];
+    uint32_t literal_count = 0;
+    double contribution = 0;
+    double bit_cost = 0;
+    for (uint32_t j = segment.offset; j < segment.offset + segment.length; j++) {
+      literal_count += literals.is_literal(j);
+      contribution += profile.literal_contribution(j);
+      bit_cost += profile.bit_cost(j);
+    }
+    RangeTotals single = profile.range_totals(segment.offset, segment.offset + segment.length);
+    EXPECT_EQ(single.bit_cost, totals[i].bit_cost) << i;
+    EXPECT_EQ(segment.length, totals[i].size) << i;
+    EXPECT_EQ(literal_count, totals[i].literal_count) << i;
+    EXPECT_EQ(bit_cost, totals[i].bit_cost) << i;
+    EXPECT_NEAR(contribution, totals[i].literal_contribution, 1e-4) << i;
+  }
+}
+
+TEST(zipprof, copy_index) {
+  for_each_shape_profile(200 * 1024, 15, [&](const char *name, Array<const uint8_t> data,
+      DeflateProfile &profile) {
+    uint32_t size = profile.inflated_size();
+    std::vector<std::vector<uint32_t>> expected(size);
+    for (uint32_t i = 0; i < size; i++)
+      expected[profile.origin(i)].push_back(i);
+    profile.build_copy_index();
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < size; i++) {
+      CopyPositions copies = profile.copies_of(i);
+      std::vector<uint32_t> positions;
+      for (uint32_t position : copies)
+        positions.push_back(position);
+      ASSERT_EQ(expected[i], positions) << name << " " << i;
+      if (!copies.empty()) {
+        EXPECT_EQ(i, *copies.begin()) << name << " " << i;
+        EXPECT_EQ(profile.literal_weight(i), copies.size()) << name << " " << i;
+      }
+      total += copies.size();
+    }
+    EXPECT_EQ(size, total) << name;
+  });
+}
+
+TEST(zipprof, copy_index_skewed) {
+  // Runs of zeros make nearly every byte's origin the same one, so its list
+  // spans every part the index is built in and has to come out in order
+  // without being sorted.
+  std::string str(1024 * 1024, '\0');
+  str += read_file("../tests/data/lipsum.txt");
+  str += std::string(2 * 1024 * 1024, '\0');
+  DeflateProfile profile = Profiler::profile_string(str);
+  uint32_t size = profile.inflated_size();
+  profile.build_copy_index();
+  uint64_t total = 0;
+  uint64_t largest = 0;
+  for (uint32_t i = 0; i < size; i++) {
+    CopyPositions copies = profile.copies_of(i);
+    uint64_t count = 0;
+    uint32_t last = 0;
+    for (uint32_t position : copies) {
+      ASSERT_EQ(i, profile.origin(position)) << i;
+      if (count++ > 0)
+        ASSERT_LT(last, position) << i;
+      last = position;
+    }
+    EXPECT_EQ(count, copies.size()) << i;
+    total += count;
+    largest = std::max(largest, count);
+  }
+  EXPECT_EQ(size, total);
+  EXPECT_GT(largest, 3 * 1024 * 1024 - 1024);
+}
+
+// Picks the hottest regions one window at a time, the slow way.
+static std::vector<HotRegion> pick_hottest_regions(DeflateProfile &profile, uint32_t window,
+    uint32_t k) {
+  std::vector<std::pair<double, uint32_t>> windows;
+  for (uint32_t i = 0; i + window <= profile.inflated_size(); i++)
+    windows.push_back(std::make_pair(-profile.range_totals(i, i + window).literal_contribution, i));
+  std::sort(windows.begin(), windows.end());
+  std::vector<HotRegion> result;
+  for (auto it = windows.begin(); it != windows.end() && result.size() < k; it++) {
+    bool overlaps = false;
+    for (auto picked = result.begin(); picked != result.end(); picked++) {
+      if (picked->offset < it->second + window && it->second < picked->offset + window)
+        overlaps = true;
+    }
+    if (!overlaps) {
+      HotRegion region = {it->second, window, -it->first};
+      result.push_back(region);
+    }
+  }
+  return result;
+}
+
+TEST(zipprof, top_queries) {
+  // Runs have lots of ties and are long enough to be split into chunks.
+  struct Case { gen::Shape shape; uint32_t size; uint32_t window; uint32_t k; };
+  Case cases[] = {{gen::Shape::TEXT, 200 * 1024, 4096, 10},
+      {gen::Shape::TINY_BLOCKS, 64 * 1024, 1, 50},
+      {gen::Shape::RUNS, 1536 * 1024, 1000, 20}};
+  for (uint32_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    Case &test = cases[c];
+    const char *name = gen::Corpus::shape_name(test.shape);
+    std::string zlib = gen::Corpus(test.shape, 14).generate(test.size);
+    DeflateProfile profile = Profiler::profile_zlib(string_to_data(zlib));
+    std::vector<HotRegion> expected = pick_hottest_regions(profile, test.window, test.k);
+    std::vector<HotRegion> regions = profile.hottest_regions(test.window, test.k);
+    ASSERT_EQ(expected.size(), regions.size()) << name;
+    for (size_t i = 0; i < regions.size(); i++) {
+      EXPECT_EQ(expected[i].offset, regions[i].offset) << name << " " << i;
+      EXPECT_EQ(test.window, regions[i].length) << name << " " << i;
+      EXPECT_EQ(expected[i].literal_contribution, regions[i].literal_contribution)
+          << name << " " << i;
+    }
+    LiteralVisitor literals;
+    Profiler::visit_zlib(string_to_data(zlib), literals);
+    std::vector<std::pair<int64_t, uint32_t>> origins;
+    for (uint32_t i = 0; i < profile.inflated_size(); i++) {
+      if (literals.is_literal(i))
+        origins.push_back(std::make_pair(-static_cast<int64_t>(profile.literal_weight(i)), i));
+    }
+    std::sort(origins.begin(), origins.end());
+    std::vector<CopiedByte> copied = profile.most_copied(test.k);
+    ASSERT_EQ(std::min<size_t>(test.k, origins.size()), copied.size()) << name;
+    for (size_t i = 0; i < copied.size(); i++) {
+      EXPECT_EQ(origins[i].second, copied[i].offset) << name << " " << i;
+      EXPECT_EQ(-origins[i].first, copied[i].weight) << name << " " << i;
+    }
+  }
+  // A window longer than the output covers all of it, once.
+  DeflateProfile small = Profiler::profile_string("abcabcabc");
+  std::vector<HotRegion> all = small.hottest_regions(100, 5);
+  ASSERT_EQ(1, all.size());
+  EXPECT_EQ(0, all[0].offset);
+  EXPECT_EQ(small.inflated_size(), all[0].length);
+  EXPECT_NEAR(small.literal_count(), all[0].literal_contribution, 1e-6);
+  EXPECT_EQ(0, small.hottest_regions(0, 5).size());
+  EXPECT_EQ(0, small.most_copied(0).size());
+}